@@ -0,0 +1,779 @@
+/* live-f1
+ *
+ * bench.c - headless benchmark of the data stream decoder
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "http.h"
+#include "packet.h"
+#include "record.h"
+#include "replay.h"
+#include "stream.h"
+#include "value.h"
+
+
+/* Decryption key and event number used for the synthetic stream */
+#define BENCH_KEY   0x5a3c96e1
+#define BENCH_EVENT 6001
+
+/* Number of cars in the synthetic stream */
+#define BENCH_CARS 24
+
+/* Size of the blocks the synthetic stream is split into, as a burst of
+ * a busy stream read by read_stream() might be
+ */
+#define BENCH_BLOCK 512
+
+/* Number of per-type counters; car types then system types */
+#define BENCH_TYPES 32
+
+/* Number of times each atom text is parsed by bench_values() */
+#define BENCH_VALUE_ROUNDS 200000
+
+
+/**
+ * BenchStream:
+ * @buf: stream data,
+ * @len: length of @buf,
+ * @size: allocated size of @buf,
+ * @salt: encryption salt.
+ *
+ * Synthetic data stream being built.
+ **/
+typedef struct {
+	unsigned char *buf;
+	size_t         len, size;
+	unsigned int   salt;
+} BenchStream;
+
+
+/* Forward prototypes */
+static void   make_stream   (BenchStream *stream, unsigned long npackets);
+static void   put_packet    (BenchStream *stream, int car, int type,
+			     int data, const char *payload, int len,
+			     int encrypt);
+static int    load_capture  (const char *filename, BenchStream *stream);
+static void   run_stream    (CurrentState *state,
+			     const BenchStream *stream, int capture,
+			     void (*run) (CurrentState *,
+					  const unsigned char *, size_t));
+static void   run_block     (CurrentState *state, const unsigned char *buf,
+			     size_t len);
+static void   frame_block   (CurrentState *state, const unsigned char *buf,
+			     size_t len);
+static double bench_values  (void);
+static unsigned long long monotonic_nsecs (void);
+static const char *type_name (int index);
+
+
+/* Program's name */
+const char *program_name = NULL;
+
+/* Curses display running */
+int cursed = 0;
+
+/* How verbose to be */
+static int verbosity = 0;
+
+/* Counters for each packet type */
+static unsigned long long type_count[BENCH_TYPES];
+static unsigned long long type_nsecs[BENCH_TYPES];
+
+/* Totals */
+static unsigned long long total_packets = 0;
+static unsigned long long total_bytes = 0;
+static unsigned long long framed_packets = 0;
+
+/* Cost of reading the clock twice, subtracted from each packet */
+static unsigned long long clock_nsecs = 0;
+
+/* Number of allocations made */
+static unsigned long long allocations = 0;
+static int                counting = 0;
+
+
+#ifdef __GLIBC__
+/* glibc allows malloc to be replaced, and calls the replacement for its
+ * own allocations (e.g. inside regcomp) too; so wrap the real thing to
+ * count every allocation the decoder causes.
+ */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+	allocations += counting;
+	return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+	size_t size)
+{
+	allocations += counting;
+	return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void   *ptr,
+	 size_t  size)
+{
+	allocations += counting;
+	return __libc_realloc (ptr, size);
+}
+# define HAVE_ALLOCATION_COUNT 1
+#endif /* __GLIBC__ */
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	CurrentState       state;
+	StreamParser       parser;
+	BenchStream        stream;
+	unsigned long      npackets = 200000;
+	unsigned long long start, elapsed, framing;
+	const char        *filename = NULL, *write_file = NULL;
+	int                i, repeat = 1, capture = 0, write_key = 1;
+
+	program_name = argv[0];
+
+	for (i = 1; i < argc; i++) {
+		if (! strcmp (argv[i], "-v")) {
+			verbosity++;
+		} else if ((! strcmp (argv[i], "-n")) && (i + 1 < argc)) {
+			npackets = strtoul (argv[++i], NULL, 10);
+		} else if ((! strcmp (argv[i], "-r")) && (i + 1 < argc)) {
+			repeat = atoi (argv[++i]);
+			repeat = MAX (repeat, 1);
+		} else if ((! strcmp (argv[i], "-w")) && (i + 1 < argc)) {
+			write_file = argv[++i];
+			write_key = 1;
+		} else if ((! strcmp (argv[i], "-W")) && (i + 1 < argc)) {
+			write_file = argv[++i];
+			write_key = 0;
+		} else if ((argv[i][0] != '-') && (! filename)) {
+			filename = argv[i];
+		} else {
+			fprintf (stderr, "Usage: %s [-v] [-n PACKETS] "
+				 "[-r REPEAT] [-w|-W FILE] [CAPTURE]\n",
+				 program_name);
+			return 1;
+		}
+	}
+
+	memset (&stream, 0, sizeof (stream));
+	if (filename) {
+		if (open_replay (filename, 0.0) || load_capture (filename, &stream))
+			return 1;
+
+		capture = 1;
+	} else {
+		make_stream (&stream, npackets);
+	}
+
+	/* Save the synthetic stream for replay testing; -W leaves out its
+	 * key, for testing --recover-key on it */
+	if (write_file && (! capture)) {
+		size_t offset;
+
+		if (open_recording (write_file))
+			return 1;
+
+		if (write_key)
+			record_key (BENCH_EVENT, BENCH_KEY);
+
+		for (offset = 0; offset < stream.len; offset += BENCH_BLOCK)
+			record_block (RECORD_STREAM, stream.buf + offset,
+				      MIN (stream.len - offset, BENCH_BLOCK));
+		close_recording ();
+	}
+
+	/* Calibrate the clock overhead */
+	start = monotonic_nsecs ();
+	for (i = 0; i < 100000; i++)
+		monotonic_nsecs ();
+	clock_nsecs = (monotonic_nsecs () - start) / 100000;
+
+	memset (&state, 0, sizeof (state));
+	state.host = "bench";
+	state.parser = &parser;
+	init_stream_parser (&parser, 0);
+
+	start = monotonic_nsecs ();
+	counting = 1;
+	for (i = 0; i < repeat; i++)
+		run_stream (&state, &stream, capture, run_block);
+	counting = 0;
+	elapsed = MAX (monotonic_nsecs () - start, 1);
+
+	/* Time the framer and decryption on their own */
+	start = monotonic_nsecs ();
+	for (i = 0; i < repeat; i++)
+		run_stream (&state, &stream, capture, frame_block);
+	framing = MAX (monotonic_nsecs () - start, 1);
+
+	printf ("%s: %llu packets, %llu bytes in %.3f s\n",
+		filename ? filename : "synthetic stream",
+		total_packets, total_bytes, elapsed / 1e9);
+	printf ("%14.0f packets/s\n", total_packets * 1e9 / elapsed);
+	printf ("%14.0f bytes/s\n", total_bytes * 1e9 / elapsed);
+	printf ("%14.1f ns/packet\n",
+		(double) elapsed / MAX (total_packets, 1));
+	printf ("%14.1f ns/packet framing and decryption\n",
+		(double) framing / MAX (framed_packets, 1));
+	printf ("%14.1f ns/atom parsing values\n", bench_values ());
+#if HAVE_ALLOCATION_COUNT
+	printf ("%14.3f allocations/packet (%llu total)\n",
+		(double) allocations / MAX (total_packets, 1), allocations);
+#else
+	printf ("%14s allocations/packet\n", "?");
+#endif
+	if (state.decryption_failure)
+		printf ("%14s decryption failed\n", "!!");
+	printf ("\n%-20s %12s %10s\n", "type", "packets", "ns/packet");
+	for (i = 0; i < BENCH_TYPES; i++) {
+		if (! type_count[i])
+			continue;
+
+		printf ("%-20s %12llu %10.1f\n", type_name (i), type_count[i],
+			(double) type_nsecs[i] / type_count[i]);
+	}
+
+	if (capture)
+		close_replay ();
+	free_stream_parser (&parser);
+	free (stream.buf);
+
+	return 0;
+}
+
+
+/**
+ * run_stream:
+ * @state: application state structure,
+ * @stream: stream or capture file contents,
+ * @capture: whether @stream is a capture file,
+ * @run: function to call for each block.
+ *
+ * Splits @stream into the blocks that would have been read from the
+ * server, and calls @run for each one.
+ **/
+static void
+run_stream (CurrentState       *state,
+	    const BenchStream  *stream,
+	    int                 capture,
+	    void (*run) (CurrentState *, const unsigned char *, size_t))
+{
+	const unsigned char *buf = stream->buf;
+	size_t               buf_len = stream->len;
+
+	if (capture) {
+		CaptureRecord record;
+
+		while (parse_record (&buf, &buf_len, &record) > 0)
+			if (record.type == RECORD_STREAM)
+				run (state, record.data, record.len);
+	} else {
+		while (buf_len) {
+			size_t len = MIN (buf_len, BENCH_BLOCK);
+
+			run (state, buf, len);
+			buf += len;
+			buf_len -= len;
+		}
+	}
+}
+
+/**
+ * run_block:
+ * @state: application state structure,
+ * @buf: data stream block,
+ * @len: length of @buf.
+ *
+ * Decodes and handles each packet in the block in the same way as
+ * parse_stream_block(), timing each handler.
+ **/
+static void
+run_block (CurrentState        *state,
+	   const unsigned char *buf,
+	   size_t               len)
+{
+	Packet packet;
+
+	total_bytes += len;
+	while (next_packet (state->parser, &packet, &buf, &len)) {
+		unsigned long long start, elapsed;
+		int                index;
+
+		start = monotonic_nsecs ();
+		if (packet.car) {
+			handle_car_packet (state, &packet);
+			index = packet.type;
+		} else {
+			handle_system_packet (state, &packet);
+			index = 16 + packet.type;
+		}
+		elapsed = monotonic_nsecs () - start;
+
+		index &= BENCH_TYPES - 1;
+		type_count[index]++;
+		type_nsecs[index] += (elapsed > clock_nsecs
+				      ? elapsed - clock_nsecs : 0);
+		total_packets++;
+	}
+}
+
+/**
+ * frame_block:
+ * @state: application state structure,
+ * @buf: data stream block,
+ * @len: length of @buf.
+ *
+ * Splits the block into packets and decrypts them without handling
+ * them, resetting the salt where handle_system_packet() would.
+ **/
+static void
+frame_block (CurrentState        *state,
+	     const unsigned char *buf,
+	     size_t               len)
+{
+	Packet packet;
+
+	while (next_packet (state->parser, &packet, &buf, &len)) {
+		if ((! packet.car) && ((packet.type == SYS_EVENT_ID)
+				       || (packet.type == SYS_KEY_FRAME)))
+			reset_decryption (state->parser);
+
+		framed_packets++;
+	}
+}
+
+/**
+ * make_stream:
+ * @stream: stream to fill,
+ * @npackets: approximate number of packets to generate.
+ *
+ * Generates a synthetic race data stream encrypted with BENCH_KEY: an
+ * event start, then laps of position updates and timing atoms for each
+ * car, interleaved with timestamps, weather and key frame markers in
+ * roughly the proportion seen on a real feed.
+ **/
+static void
+make_stream (BenchStream   *stream,
+	     unsigned long  npackets)
+{
+	unsigned char marker[2];
+	char          text[16];
+	unsigned int  frame = 1;
+	int           lap = 0;
+
+	snprintf (text, sizeof (text), "_%d", BENCH_EVENT);
+	put_packet (stream, 0, SYS_EVENT_ID, RACE_EVENT, text,
+		    strlen (text), 0);
+	stream->salt = 0x55555555;
+
+	while (stream->len < npackets * 8) {
+		int car;
+
+		lap++;
+		for (car = 1; car <= BENCH_CARS; car++) {
+			int pos = ((car + lap) % BENCH_CARS) + 1;
+
+			put_packet (stream, car, CAR_POSITION_UPDATE, 0,
+				    NULL, 0, 0);
+			put_packet (stream, car, CAR_POSITION_UPDATE, pos,
+				    NULL, 0, 0);
+
+			snprintf (text, sizeof (text), "%d", pos);
+			put_packet (stream, car, RACE_POSITION, 1, text,
+				    strlen (text), 1);
+			snprintf (text, sizeof (text), "%d", car);
+			put_packet (stream, car, RACE_NUMBER, 2, text,
+				    strlen (text), 1);
+			put_packet (stream, car, RACE_DRIVER, 2, "A. DRIVER",
+				    9, 1);
+			snprintf (text, sizeof (text), "%d.%d", pos * 3,
+				  car % 10);
+			put_packet (stream, car, RACE_GAP, 1, text,
+				    strlen (text), 1);
+			snprintf (text, sizeof (text), "%d", lap);
+			put_packet (stream, car, RACE_INTERVAL, 1, text,
+				    strlen (text), 1);
+			snprintf (text, sizeof (text), "1:%02d.%03d",
+				  20 + (car % 10), (lap * 37) % 1000);
+			put_packet (stream, car, RACE_LAP_TIME, 3, text,
+				    strlen (text), 1);
+			snprintf (text, sizeof (text), "%d.%d",
+				  25 + (car % 5), lap % 10);
+			put_packet (stream, car, RACE_SECTOR_1, 1, text,
+				    strlen (text), 1);
+			put_packet (stream, car, RACE_SECTOR_2, 1, text,
+				    strlen (text), 1);
+			put_packet (stream, car, RACE_SECTOR_3, 4, text,
+				    strlen (text), 1);
+			put_packet (stream, car, RACE_PIT_LAP_1, 0, "", -1, 1);
+		}
+
+		put_packet (stream, 0, SYS_TIMESTAMP, 0, "\x10\x27", 2, 1);
+		snprintf (text, sizeof (text), "%d", 20 + (lap % 15));
+		put_packet (stream, 0, SYS_WEATHER, WEATHER_TRACK_TEMP, text,
+			    strlen (text), 1);
+		put_packet (stream, 0, SYS_WEATHER, WEATHER_AIR_TEMP, text,
+			    strlen (text), 1);
+
+		if (lap % 5 == 0) {
+			marker[0] = frame & 0xff;
+			marker[1] = (frame >> 8) & 0xff;
+			put_packet (stream, 0, SYS_KEY_FRAME, 0,
+				    (const char *) marker, 2, 0);
+			stream->salt = 0x55555555;
+			frame++;
+		}
+	}
+}
+
+/**
+ * put_packet:
+ * @stream: stream to append to,
+ * @car: car index, or zero for system packets,
+ * @type: packet type,
+ * @data: data for the header,
+ * @payload: payload bytes,
+ * @len: length of @payload, or -1 for an empty short packet,
+ * @encrypt: whether to encrypt @payload.
+ *
+ * Encodes a packet with the right header format for its type and
+ * appends it to @stream.
+ **/
+static void
+put_packet (BenchStream *stream,
+	    int          car,
+	    int          type,
+	    int          data,
+	    const char  *payload,
+	    int          len,
+	    int          encrypt)
+{
+	unsigned char *ptr;
+	int            i, nbytes;
+
+	if (stream->len + 131 > stream->size) {
+		stream->size = MAX (stream->size * 2, 65536);
+		stream->buf = realloc (stream->buf, stream->size);
+		if (! stream->buf)
+			abort ();
+	}
+
+	ptr = stream->buf + stream->len;
+	ptr[0] = (car & 0x1f) | ((type & 0x07) << 5);
+	ptr[1] = (type >> 3) & 0x01;
+
+	nbytes = MAX (len, 0);
+	if (car && (type == CAR_POSITION_UPDATE)) {
+		ptr[1] |= data << 1;
+		nbytes = 0;
+	} else if ((car && (type == CAR_POSITION_HISTORY))
+		   || ((! car) && ((type == SYS_COMMENTARY)
+				   || (type == SYS_NOTICE)
+				   || (type == SYS_SPEED)
+				   || (type == SYS_COPYRIGHT)))) {
+		ptr[1] |= nbytes << 1;
+	} else if ((! car) && (type == SYS_TIMESTAMP)) {
+		nbytes = 2;
+	} else {
+		ptr[1] |= ((len < 0 ? 0x0f : len) << 4) | ((data & 0x07) << 1);
+	}
+
+	for (i = 0; i < nbytes; i++) {
+		unsigned char byte = payload[i];
+
+		if (encrypt) {
+			stream->salt = ((stream->salt >> 1)
+					^ (stream->salt & 0x01 ? BENCH_KEY : 0));
+			byte ^= stream->salt & 0xff;
+		}
+
+		ptr[2 + i] = byte;
+	}
+
+	stream->len += 2 + nbytes;
+}
+
+/**
+ * load_capture:
+ * @filename: capture file to load,
+ * @stream: stream to fill.
+ *
+ * Reads the records of the capture file @filename into @stream, so that
+ * the benchmark doesn't include any disk access.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+load_capture (const char  *filename,
+	      BenchStream *stream)
+{
+	struct stat statbuf;
+	int         fd;
+
+	fd = open (filename, O_RDONLY);
+	if ((fd < 0) || (fstat (fd, &statbuf) < 0)) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	stream->size = statbuf.st_size;
+	stream->buf = malloc (stream->size);
+	if (! stream->buf)
+		abort ();
+
+	while (stream->len < stream->size) {
+		ssize_t len;
+
+		len = read (fd, stream->buf + stream->len,
+			    stream->size - stream->len);
+		if (len <= 0) {
+			fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+				 len ? strerror (errno) : "short read");
+			close (fd);
+			return 1;
+		}
+
+		stream->len += len;
+	}
+	close (fd);
+
+	/* Skip the header, open_replay() checked it */
+	memmove (stream->buf, stream->buf + CAPTURE_HEADER_LEN,
+		 stream->len - CAPTURE_HEADER_LEN);
+	stream->len -= CAPTURE_HEADER_LEN;
+
+	return 0;
+}
+
+/**
+ * bench_values:
+ *
+ * Times parse_value() on the kinds of text found in car atoms.
+ *
+ * Returns: average time to parse one (nsecs).
+ **/
+static double
+bench_values (void)
+{
+	static const char *texts[] = {
+		"1", "12", "44", "A. DRIVER", "1:23.456", "32.105",
+		"+12.3", "1 L", "PIT", "STOP", "", "1:30:00",
+	};
+	unsigned long long start, elapsed;
+	volatile int       sink = 0;
+	size_t             lens[sizeof (texts) / sizeof (texts[0])];
+	int                i, j, value;
+
+	for (j = 0; j < sizeof (texts) / sizeof (texts[0]); j++)
+		lens[j] = strlen (texts[j]);
+
+	start = monotonic_nsecs ();
+	for (i = 0; i < BENCH_VALUE_ROUNDS; i++) {
+		for (j = 0; j < sizeof (texts) / sizeof (texts[0]); j++) {
+			sink += parse_value (texts[j], lens[j], &value);
+			sink += value;
+		}
+	}
+	elapsed = monotonic_nsecs () - start;
+
+	return (double) elapsed / BENCH_VALUE_ROUNDS
+		/ (sizeof (texts) / sizeof (texts[0]));
+}
+
+/**
+ * monotonic_nsecs:
+ *
+ * Returns: current value of the monotonic clock in nanoseconds.
+ **/
+static unsigned long long
+monotonic_nsecs (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * type_name:
+ * @index: counter index.
+ *
+ * Returns: name for the packet type counted by @index.
+ **/
+static const char *
+type_name (int index)
+{
+	static char name[20];
+
+	switch (index) {
+	case CAR_POSITION_UPDATE:
+		return "car position";
+	case CAR_POSITION_HISTORY:
+		return "car history";
+	case 16 + SYS_EVENT_ID:
+		return "event id";
+	case 16 + SYS_KEY_FRAME:
+		return "key frame";
+	case 16 + SYS_VALID_MARKER:
+		return "valid marker";
+	case 16 + SYS_COMMENTARY:
+		return "commentary";
+	case 16 + SYS_REFRESH_RATE:
+		return "refresh rate";
+	case 16 + SYS_NOTICE:
+		return "notice";
+	case 16 + SYS_TIMESTAMP:
+		return "timestamp";
+	case 16 + SYS_WEATHER:
+		return "weather";
+	case 16 + SYS_SPEED:
+		return "speed";
+	case 16 + SYS_TRACK_STATUS:
+		return "track status";
+	case 16 + SYS_COPYRIGHT:
+		return "copyright";
+	default:
+		if (index < 16) {
+			sprintf (name, "car atom %d", index);
+		} else {
+			sprintf (name, "system %d", index - 16);
+		}
+		return name;
+	}
+}
+
+
+/* Display functions, stubbed out so that only the decoder is measured */
+
+void open_display (void) {}
+void close_display (void) {}
+int  handle_keys (CurrentState *state) { return 0; }
+void clear_board (CurrentState *state) {}
+void update_cell (CurrentState *state, int car, int type) {}
+void update_car (CurrentState *state, int car) {}
+void clear_car (CurrentState *state, int car) {}
+void update_status (CurrentState *state) {}
+void update_time (CurrentState *state) {}
+void flush_display (CurrentState *state) {}
+void mark_decoded (unsigned long long when) {}
+void popup_message (const char *message) {}
+void close_popup (void) {}
+
+
+/* HTTP functions, served from the capture when there is one */
+
+char *
+obtain_auth_cookie (const char *host,
+		    const char *email,
+		    const char *password)
+{
+	return NULL;
+}
+
+unsigned int
+obtain_decryption_key (CurrentState *state,
+		       unsigned int  event_no)
+{
+	return replaying ? replay_decryption_key (event_no) : BENCH_KEY;
+}
+
+void
+renew_decryption_key (CurrentState *state)
+{
+}
+
+int
+fetch_key_frame (CurrentState *state,
+		 unsigned int  frame)
+{
+	StreamParser *parser = state->parser;
+	StreamParser  key_frame;
+
+	if (! replaying)
+		return 0;
+
+	begin_key_frame_parser (&key_frame, parser);
+	state->parser = &key_frame;
+	replay_key_frame (frame, state);
+	state->parser = parser;
+	end_key_frame_parser (&key_frame, parser);
+
+	return 0;
+}
+
+int
+prefetch_key_frame (CurrentState *state,
+		    unsigned int  frame)
+{
+	return 0;
+}
+
+unsigned int
+obtain_total_laps (void)
+{
+	return replaying ? replay_total_laps () : 58;
+}
+
+
+int
+info (int         irrelevance,
+      const char *format, ...)
+{
+	va_list ap;
+	int     ret;
+
+	if (verbosity < irrelevance)
+		return 0;
+
+	va_start (ap, format);
+	ret = vfprintf (stderr, format, ap);
+	va_end (ap);
+
+	return ret;
+}
@@ -33,6 +33,8 @@
 #include "live-f1.h"
 #include "packet.h" /* for packet type */
 #include "display.h"
+#include "render.h"
+#include "stats.h"
 
 
 /* Colours to be allocated, note that this mostly matches the data stream
@@ -55,15 +57,41 @@ typedef enum {
 	LAST_COLOUR
 } TextColour;
 
+/* Parts of the screen that need drawing at the next frame; the board
+ * cells and rows to be cleared are kept in dirty_cars and dirty_rows.
+ */
+typedef enum {
+	DIRTY_BOARD  = 0x01,
+	DIRTY_STATUS = 0x02,
+	DIRTY_TIME   = 0x04,
+	DIRTY_LAYOUT = 0x08
+} DirtyFlags;
+
+/* Rows of the board we can track; positions are at most 127 */
+#define DIRTY_ROWS 256
+
 
 /* Forward prototypes */
-static void _update_cell (CurrentState *state, int car, int type);
-static void _update_time (CurrentState *state);
+static void _update_cell   (CurrentState *state, int car, int type);
+static void _update_status (CurrentState *state);
+static void _update_time   (CurrentState *state);
+static void render         (CurrentState *state);
+static void draw_overlay   (void);
+static void close_overlay  (void);
+static void redraw_windows (void);
+static void display_too_small (const char *message);
+static unsigned long long frame_clock (void);
 
 
 /* Curses display running */
 int cursed = 0;
 
+/* Curses display not to be used */
+int headless = 0;
+
+/* Minimum time between frames (msecs), zero to draw after every block */
+unsigned int frame_interval = 100;
+
 /* Number of lines being used for the board */
 static int nlines = 0;
 
@@ -74,6 +102,29 @@ static int attrs[LAST_COLOUR];
 static WINDOW *boardwin = NULL;
 static WINDOW *statwin = NULL;
 static WINDOW *popupwin = NULL;
+static WINDOW *overlaywin = NULL;
+
+/* Statistics overlay shown */
+static int show_stats = FALSE;
+
+/* Changes waiting for the next frame: a bitmask of DirtyFlags, a bitmask
+ * of cells for each car and a bitmap of board rows to be cleared.
+ */
+static int          dirty = 0;
+static unsigned int dirty_cars[32];
+static unsigned int dirty_rows[DIRTY_ROWS / 32];
+
+/* Time the last frame was drawn (msecs) */
+static unsigned long long last_frame = 0;
+
+/* Nesting depth of bulk loads; while non-zero nothing is drawn */
+static int bulk_loading = 0;
+
+/* Time we started waiting for the first board (msecs), or zero */
+static unsigned long long board_wait = 0;
+
+/* Time the earliest change not yet on screen was parsed (nsecs), or zero */
+static unsigned long long decoded_at = 0;
 
 
 /**
@@ -85,7 +136,7 @@ static WINDOW *popupwin = NULL;
 void
 open_display (void)
 {
-	if (cursed)
+	if (cursed || headless)
 		return;
 
 	initscr ();
@@ -151,18 +202,33 @@ open_display (void)
  * @state: application state structure.
  *
  * Clear an area on the screen for the timing board and put the headers
- * in.  Updates display when done.
+ * in.  The display is updated at the next frame; during a bulk load,
+ * the board is only laid out once it's finished.
  **/
 void
 clear_board (CurrentState *state)
 {
 	int i, j;
 
+	if (queue_display (TRUE)) {
+		queue_layout (state);
+		return;
+	}
+
+	if (bulk_loading) {
+		dirty |= DIRTY_LAYOUT;
+		return;
+	}
+
 	open_display ();
+	if (! cursed)
+		return;
+
 	close_popup ();
 
 	if (boardwin)
 		delwin (boardwin);
+	boardwin = NULL;
 
 	nlines = MAX (state->num_cars, 21);
 	for (i = 0; i < state->num_cars; i++)
@@ -171,16 +237,12 @@ clear_board (CurrentState *state)
 	nlines += 3;
 
 	if (LINES < nlines) {
-		close_display ();
-		fprintf (stderr, "%s: %s\n", program_name,
-			 _("insufficient lines on display"));
-		exit (10);
+		display_too_small (_("insufficient lines on display"));
+		return;
 	}
 	if (COLS < 69) {
-		close_display ();
-		fprintf (stderr, "%s: %s\n", program_name,
-			 _("insufficient columns on display"));
-		exit (10);
+		display_too_small (_("insufficient columns on display"));
+		return;
 	}
 
 	boardwin = newwin (nlines, 69, 0, 0);
@@ -215,8 +277,11 @@ clear_board (CurrentState *state)
 			_update_cell (state, i, j);
 	}
 
-	wnoutrefresh (boardwin);
-	doupdate ();
+	/* Everything pending has just been drawn */
+	memset (dirty_cars, 0, sizeof (dirty_cars));
+	memset (dirty_rows, 0, sizeof (dirty_rows));
+	dirty &= ~DIRTY_LAYOUT;
+	dirty |= DIRTY_BOARD;
 
 	if (statwin) {
 		delwin (statwin);
@@ -469,22 +534,24 @@ _update_cell (CurrentState *state,
  *
  * Update a particular cell on the board, with the necessary information
  * available in the state structure.  Intended for external code as it
- * updates the display when done.
+ * marks the cell to be drawn at the next frame.
  **/
 void
 update_cell (CurrentState *state,
 	     int           car,
 	     int           type)
 {
+	if (queue_display (TRUE)) {
+		queue_cell (state, car, type);
+		return;
+	}
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
-	_update_cell (state, car, type);
-
-	_update_time (state);
- 	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_cars[car] |= 1 << type;
+	dirty |= DIRTY_BOARD;
 }
 
 /**
@@ -492,24 +559,23 @@ update_cell (CurrentState *state,
  * @state: application state structure,
  * @car: car number to update.
  *
- * Update the entire row for the given car, and the display when done.
+ * Marks the entire row for the given car to be drawn at the next frame.
  **/
 void
 update_car (CurrentState *state,
 	    int           car)
 {
-	int i;
+	if (queue_display (TRUE)) {
+		queue_car (state, car);
+		return;
+	}
 
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
-	for (i = 0; i < LAST_CAR_PACKET; i++)
-		_update_cell (state, car, i);
-
-	_update_time (state);
- 	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_cars[car] = (1 << LAST_CAR_PACKET) - 1;
+	dirty |= DIRTY_BOARD;
 }
 
 /**
@@ -517,7 +583,8 @@ update_car (CurrentState *state,
  * @state: application state structure,
  * @car: car number to update.
  *
- * Clear the car from the board, updating the display when done.
+ * Clear the car from the board at the next frame.  The row is noted
+ * now, since the car's position is usually about to change.
  **/
 void
 clear_car (CurrentState *state,
@@ -525,6 +592,11 @@ clear_car (CurrentState *state,
 {
 	int y;
 
+	if (queue_display (TRUE)) {
+		queue_clear_car (state, car);
+		return;
+	}
+
 	if (! cursed)
 		clear_board (state);
 
@@ -536,12 +608,8 @@ clear_car (CurrentState *state,
 
 	close_popup ();
 
-	wmove (boardwin, y, 0);
-	wclrtoeol (boardwin);
-
-	_update_time (state);
-	wnoutrefresh (boardwin);
-	doupdate ();
+	dirty_rows[y / 32] |= 1U << (y % 32);
+	dirty |= DIRTY_BOARD;
 }
 
 /**
@@ -567,16 +635,33 @@ draw_bar (WINDOW *win, int len)
  * update_status:
  * @state: application state structure,
  *
- * Update the status window, creating it if necessary.  Updates the
- * display when done.
+ * Marks the status window to be updated at the next frame.
  **/
 void
 update_status (CurrentState *state)
 {
+	if (queue_display (TRUE)) {
+		queue_status (state);
+		return;
+	}
+
 	if (! cursed)
 		clear_board (state);
 	close_popup ();
 
+	dirty |= DIRTY_STATUS;
+}
+
+/**
+ * _update_status:
+ * @state: application state structure,
+ *
+ * Update the status window, creating it if necessary.  For internal use,
+ * does not update the screen.
+ **/
+static void
+_update_status (CurrentState *state)
+{
 	/* Put the window down the side if we have enough room */
 	if (! statwin) {
 		if (COLS < 80)
@@ -706,12 +791,6 @@ update_status (CurrentState *state)
 	/* Update session clock */
 	
 	_update_time (state);
-
-	/* Refresh display */
-
-	wnoutrefresh (statwin);
-	wnoutrefresh (boardwin);
-	doupdate ();
 }
 
 /**
@@ -765,16 +844,240 @@ _update_time (CurrentState *state)
  * External function to update the time, unlike most display functions this
  * one doesn't clear an open popup as it's not possible for them to ever
  * cover the time.  It also doesn't open the display if not already done.
+ * Draws the next frame if one is due.
  **/
 void
 update_time (CurrentState *state)
 {
+	if (queue_display (FALSE)) {
+		queue_time (state);
+		flush_queue (state);
+		return;
+	}
+
 	if ((! cursed) || (! statwin))
 		return;
 
+	dirty |= DIRTY_TIME;
+	flush_display (state);
+}
+
+/**
+ * flush_display:
+ * @state: application state structure.
+ *
+ * Draws the changes made since the last frame, if there are any and at
+ * least frame_interval milliseconds have passed since it.  Called at the
+ * end of each data stream block and each time around the main loop, so
+ * a burst of packets costs a single terminal update.
+ *
+ * While the render thread is running, this and the other display
+ * functions called by the decoding thread queue their changes for it
+ * instead, and this wakes it.
+ **/
+void
+flush_display (CurrentState *state)
+{
+	unsigned long long now;
+
+	if (queue_display (FALSE)) {
+		flush_queue (state);
+		return;
+	}
+
+	if ((! cursed) || (! dirty) || bulk_loading)
+		return;
+
+	now = frame_clock ();
+	if (frame_interval && (now - last_frame < frame_interval))
+		return;
+
+	render (state);
+	last_frame = now;
+}
+
+/**
+ * frame_delay:
+ *
+ * Returns: milliseconds until the changes waiting to be drawn are due,
+ * zero if they're due now or -1 if there are none.
+ **/
+int
+frame_delay (void)
+{
+	unsigned long long now;
+
+	if (queue_display (FALSE) || (! cursed) || (! dirty) || bulk_loading)
+		return -1;
+
+	now = frame_clock ();
+	if ((! frame_interval) || (now - last_frame >= frame_interval))
+		return 0;
+
+	return last_frame + frame_interval - now;
+}
+
+/**
+ * mark_decoded:
+ * @when: time the changes were parsed (nsecs).
+ *
+ * Notes that the changes marked since the last frame were parsed at
+ * @when, so the time until they're on screen can be measured.  Called
+ * at the end of each data stream block.
+ **/
+void
+mark_decoded (unsigned long long when)
+{
+	if (queue_display (FALSE)) {
+		queue_decoded (when);
+		return;
+	}
+
+	if (cursed && (dirty & ~DIRTY_TIME) && (! decoded_at))
+		decoded_at = when;
+}
+
+/**
+ * render:
+ * @state: application state structure.
+ *
+ * Clears the rows, draws the cells and the status window marked since
+ * the last frame, then updates the screen with a single doupdate().
+ * The statistics overlay, if shown, is drawn afresh over the top, and
+ * an open popup is kept on top of that.  The time since the changes
+ * were parsed goes into the decode to screen histogram.
+ **/
+static void
+render (CurrentState *state)
+{
+	int flags, car, type, y, i;
+
+	flags = dirty;
+	dirty = 0;
+
+	for (y = 0; y < nlines; y++) {
+		if (! (dirty_rows[y / 32] & (1U << (y % 32))))
+			continue;
+
+		wmove (boardwin, y, 0);
+		wclrtoeol (boardwin);
+
+		/* Anything already moved into the row needs redrawing */
+		for (i = 0; i < state->num_cars; i++)
+			if (state->car_position[i] == y)
+				dirty_cars[i + 1] = (1 << LAST_CAR_PACKET) - 1;
+	}
+	memset (dirty_rows, 0, sizeof (dirty_rows));
+
+	for (car = 1; car <= state->num_cars; car++) {
+		unsigned int cells = dirty_cars[car];
+
+		dirty_cars[car] = 0;
+		for (type = 0; cells; type++, cells >>= 1)
+			if (cells & 1)
+				_update_cell (state, car, type);
+	}
+
+	/* clear_board() may have asked for the status window again */
+	if ((flags | dirty) & DIRTY_STATUS)
+		_update_status (state);
+	dirty = 0;
+
 	_update_time (state);
+	wnoutrefresh (boardwin);
+
+	if (show_stats)
+		draw_overlay ();
+
+	if (popupwin) {
+		touchwin (popupwin);
+		wnoutrefresh (popupwin);
+	}
 
 	doupdate ();
+
+	if (decoded_at) {
+		note_screen_latency (stats_clock () - decoded_at);
+		decoded_at = 0;
+	}
+
+	if (board_wait && state->num_cars) {
+		info (1, _("Timing board drawn %llu ms after starting\n"),
+		      frame_clock () - board_wait);
+		board_wait = 0;
+	}
+}
+
+/**
+ * begin_bulk_load:
+ *
+ * Starts a bulk load, such as parsing a key frame, during which the
+ * board is neither laid out nor drawn however many times the state
+ * changes.  Calls may be nested.
+ **/
+void
+begin_bulk_load (void)
+{
+	if (queue_display (FALSE)) {
+		queue_bulk_load (1);
+		return;
+	}
+
+	bulk_loading++;
+}
+
+/**
+ * end_bulk_load:
+ * @state: application state structure.
+ *
+ * Ends a bulk load started with begin_bulk_load(), laying out the board
+ * if it was asked for and drawing everything changed in one frame.
+ **/
+void
+end_bulk_load (CurrentState *state)
+{
+	if (queue_display (FALSE)) {
+		queue_bulk_load (-1);
+		return;
+	}
+
+	if ((! bulk_loading) || --bulk_loading)
+		return;
+
+	if (dirty & DIRTY_LAYOUT)
+		clear_board (state);
+
+	if (cursed && dirty) {
+		render (state);
+		last_frame = frame_clock ();
+	}
+}
+
+/**
+ * start_board_timer:
+ *
+ * Notes the time we started, so that the time taken to draw the first
+ * timing board can be reported.
+ **/
+void
+start_board_timer (void)
+{
+	board_wait = frame_clock ();
+}
+
+/**
+ * frame_clock:
+ *
+ * Returns: monotonic time in milliseconds.
+ **/
+static unsigned long long
+frame_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
 }
 
 /**
@@ -786,11 +1089,16 @@ update_time (CurrentState *state)
 void
 close_display (void)
 {
+	if (queue_display (FALSE))
+		stop_render_thread ();
+
 	if (! cursed)
 		return;
 
 	if (popupwin)
 		delwin (popupwin);
+	if (overlaywin)
+		delwin (overlaywin);
 	if (boardwin)
 		delwin (boardwin);
 
@@ -799,35 +1107,82 @@ close_display (void)
 	cursed = 0;
 }
 
+/**
+ * display_too_small:
+ * @message: what's too small.
+ *
+ * Closes the display, reports @message and exits, since the board can't
+ * be drawn.  On the render thread this is left to the decoding thread,
+ * which finds it in handle_keys(), so that it doesn't exit under the
+ * feet of the capture file, emitter and shared memory.
+ **/
+static void
+display_too_small (const char *message)
+{
+	if (fail_render (message))
+		return;
+
+	close_display ();
+	fprintf (stderr, "%s: %s\n", program_name, message);
+	exit (10);
+}
+
 /**
  * handle_keys:
  * @state: application state structure.
  *
- * Checks for a key press on the keyboard and handles it; this includes
- * keys that should quit the app (Enter, Escape, q, etc.) and pseudo-keys
- * like the resize event.
+ * Checks for key presses on the keyboard and handles them; this includes
+ * keys that should quit the app (Enter, Escape, q, etc.), s to show or
+ * hide the statistics overlay and pseudo-keys like the resize event.
+ * Every key waiting is handled, since curses may have read more than one
+ * from the terminal at once.  Should the render thread have found the
+ * terminal too small for the board, this exits.
  *
- * Returns: 0 if none were pressed, 1 if one was, -1 if should quit.
+ * Returns: 0 if none were pressed, 1 if some were, -1 if should quit.
  **/
 int
 handle_keys (CurrentState *state)
 {
+	int ret = 0;
+
+	if (queue_display (FALSE)) {
+		if (render_failure ())
+			display_too_small (render_failure ());
+
+		return render_quitting () ? -1 : 0;
+	}
+
 	if (! cursed)
 		return 0;
 
-	switch (getch ()) {
-	case KEY_ENTER:
-	case '\r':
-	case '\n':
-	case 0x1b: /* Escape */
-	case 'q':
-	case 'Q':
-		return -1;
-	case KEY_RESIZE:
-		clear_board (state);
-		return 1;
-	default:
-		return 0;
+	for (;;) {
+		switch (getch ()) {
+		case ERR:
+			return ret;
+		case KEY_ENTER:
+		case '\r':
+		case '\n':
+		case 0x1b: /* Escape */
+		case 'q':
+		case 'Q':
+			return -1;
+		case KEY_RESIZE:
+			clear_board (state);
+			ret = 1;
+			break;
+		case 's':
+		case 'S':
+			show_stats = ! show_stats;
+			if (! show_stats)
+				close_overlay ();
+
+			dirty |= DIRTY_TIME;
+			ret = 1;
+			break;
+		default:
+			ret = 1;
+			break;
+		}
 	}
 }
 
@@ -846,6 +1201,11 @@ popup_message (const char *message)
 	int    nlines, ncols, col, ls, i;
 	regex_t re;
 
+	if (queue_display (FALSE)) {
+		queue_popup (message);
+		return;
+	}
+
 	open_display ();
 	close_popup ();
 
@@ -941,12 +1301,112 @@ popup_message (const char *message)
 void
 close_popup (void)
 {
+	if (queue_display (FALSE)) {
+		queue_close_popup ();
+		return;
+	}
+
 	if ((! cursed) || (! popupwin))
 		return;
 
 	delwin (popupwin);
 	popupwin = NULL;
 
+	redraw_windows ();
+}
+
+/**
+ * draw_overlay:
+ *
+ * Draws the statistics overlay in the middle of the screen, recreating
+ * it at the size it needs now; should it shrink, the windows under it
+ * are redrawn.  For internal use, does not update the screen.
+ **/
+static void
+draw_overlay (void)
+{
+	char        buf[2048];
+	const char *line, *end;
+	int         nlines, ncols, y, x;
+
+	format_stats (buf, sizeof (buf));
+
+	nlines = ncols = 0;
+	for (line = buf; *line; line = end + 1) {
+		end = line + strcspn (line, "\n");
+		ncols = MAX (ncols, end - line);
+		nlines++;
+		if (! *end)
+			break;
+	}
+
+	nlines = MIN (nlines + 2, LINES);
+	ncols = MIN (ncols + 4, COLS);
+	y = (LINES - nlines) / 2;
+	x = (COLS - ncols) / 2;
+
+	if (overlaywin) {
+		int oldy, oldx, oldlines, oldcols;
+
+		getbegyx (overlaywin, oldy, oldx);
+		getmaxyx (overlaywin, oldlines, oldcols);
+		delwin (overlaywin);
+		overlaywin = NULL;
+
+		if ((oldy < y) || (oldx < x)
+		    || (oldy + oldlines > y + nlines)
+		    || (oldx + oldcols > x + ncols))
+			redraw_windows ();
+	}
+
+	overlaywin = newwin (nlines, ncols, y, x);
+	if (! overlaywin)
+		return;
+
+	wbkgdset (overlaywin, attrs[COLOUR_POPUP]);
+	werase (overlaywin);
+	box (overlaywin, 0, 0);
+
+	y = 1;
+	for (line = buf; *line && (y < nlines - 1); line = end + 1) {
+		end = line + strcspn (line, "\n");
+		mvwaddnstr (overlaywin, y++, 2, line,
+			    MIN (end - line, ncols - 4));
+		if (! *end)
+			break;
+	}
+
+	wnoutrefresh (overlaywin);
+}
+
+/**
+ * close_overlay:
+ *
+ * Closes the statistics overlay and schedules the windows under it to be
+ * redrawn when the next doupdate() is called.
+ **/
+static void
+close_overlay (void)
+{
+	if (! overlaywin)
+		return;
+
+	delwin (overlaywin);
+	overlaywin = NULL;
+
+	redraw_windows ();
+}
+
+/**
+ * redraw_windows:
+ *
+ * Schedules all of the windows on the screen to be redrawn when the
+ * next doupdate() is called, after a window over the top of them has
+ * been closed; the statistics overlay is kept on top.
+ **/
+static void
+redraw_windows (void)
+{
 	redrawwin (stdscr);
 	wnoutrefresh (stdscr);
 
@@ -959,4 +1419,9 @@ close_popup (void)
 		redrawwin (statwin);
 		wnoutrefresh (statwin);
 	}
+
+	if (overlaywin) {
+		redrawwin (overlaywin);
+		wnoutrefresh (overlaywin);
+	}
 }
@@ -27,7 +27,13 @@
 SJR_BEGIN_EXTERN
 
 /* Curses display running */
-int cursed;
+extern int cursed;
+
+/* Curses display not to be used */
+extern int headless;
+
+/* Minimum time between frames (msecs) */
+extern unsigned int frame_interval;
 
 
 void open_display  (void);
@@ -41,6 +47,13 @@ void clear_car     (CurrentState *state, int car);
 
 void update_status (CurrentState *state);
 void update_time   (CurrentState *state);
+void flush_display (CurrentState *state);
+int  frame_delay   (void);
+void mark_decoded  (unsigned long long when);
+
+void begin_bulk_load   (void);
+void end_bulk_load     (CurrentState *state);
+void start_board_timer (void);
 
 void popup_message (const char *message);
 void close_popup   (void);
@@ -0,0 +1,622 @@
+/* live-f1
+ *
+ * emit.c - write decoded packets out for other programs
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "emit.h"
+#include "packet.h"
+#include "value.h"
+
+
+/* Size of the buffer records are collected in before being written */
+#define EMIT_BUF_SIZE 1048576
+
+/* Room needed in the buffer for any one record, and a record of those
+ * dropped before it; a payload byte escapes to at most six bytes */
+#define EMIT_RECORD_MAX 2048
+
+
+/* Forward prototypes */
+static void   describe_packet (const Packet *packet, EmitRecord *rec,
+			       const unsigned char **text);
+static void   set_value       (EmitRecord *rec, ValueType type, int number);
+static void   encode_record   (const EmitRecord *rec,
+			       const unsigned char *text);
+static size_t put_number      (unsigned char *buf, unsigned long long number);
+static size_t put_value       (unsigned char *buf, int64_t value);
+static size_t put_text        (unsigned char *buf, const unsigned char *text,
+			       int len);
+
+
+/* Format packets are being written out in, if any */
+EmitFormat emitting = EMIT_NONE;
+
+/* File descriptor written to, and its flags before we changed them */
+static int emit_fd = -1;
+static int emit_fd_flags = 0;
+
+/* Buffer of records not yet written */
+static unsigned char emit_buf[EMIT_BUF_SIZE];
+static size_t        emit_buf_len = 0;
+
+/* Number of records dropped since the last one written */
+static unsigned long long emit_dropped = 0;
+
+/* Latest timestamp in the data stream (seconds) */
+static unsigned int feed_time = 0;
+
+
+/**
+ * open_emitter:
+ * @format: "ndjson" or "binary".
+ *
+ * Writes each packet decoded from now on to standard output as a record
+ * in @format, which may be a pipe or FIFO as well as a file.  Unless
+ * it's a terminal, writes never block: records are collected in a large buffer, written as
+ * fast as the reader takes them, and if it falls so far behind that the
+ * buffer fills, dropped and counted rather than holding up the decoder.
+ *
+ * An NDJSON record is one line holding an object with the members
+ * "mono", the monotonic clock when the packet was decoded in
+ * nanoseconds; "feed", the latest timestamp in the data stream in
+ * seconds; "car", "type" and "colour" for a car packet, or "sys" and
+ * "data" for a system packet; then "text" if it carried any, and
+ * "value", the number, time or laps in it, if there was one, with
+ * "kind" saying which or that it was "pit" or "stopped".  Records that
+ * had to be dropped are counted by a record with a "dropped" member
+ * instead.  Binary records are described by EmitRecord.
+ *
+ * Returns: 0 on success, non-zero if @format isn't known.
+ **/
+int
+open_emitter (const char *format)
+{
+	static int registered = 0;
+
+	if (emitting)
+		close_emitter ();
+
+	if (! strcmp (format, "ndjson")) {
+		emitting = EMIT_NDJSON;
+	} else if (! strcmp (format, "binary")) {
+		emitting = EMIT_BINARY;
+	} else {
+		return 1;
+	}
+
+	/* A terminal's file description is shared with standard error and
+	 * the shell, which mustn't be left non-blocking; the flags are put
+	 * back by close_emitter(), which a signal reaches too */
+	emit_fd = STDOUT_FILENO;
+	emit_fd_flags = -1;
+	if (! isatty (emit_fd))
+		emit_fd_flags = fcntl (emit_fd, F_GETFL);
+	if (emit_fd_flags >= 0)
+		fcntl (emit_fd, F_SETFL, emit_fd_flags | O_NONBLOCK);
+
+	emit_buf_len = 0;
+	emit_dropped = 0;
+	feed_time = 0;
+
+	if (! registered++)
+		atexit (close_emitter);
+
+	return 0;
+}
+
+/**
+ * close_emitter:
+ *
+ * Writes out everything still buffered, waiting for the reader to take
+ * it this time, and stops writing packets out.  This is registered with
+ * atexit().
+ **/
+void
+close_emitter (void)
+{
+	EmitRecord rec;
+
+	if (! emitting)
+		return;
+
+	if (emit_fd_flags >= 0)
+		fcntl (emit_fd, F_SETFL, emit_fd_flags);
+
+	flush_emitter ();
+
+	if (emitting && emit_dropped) {
+		memset (&rec, 0, sizeof (rec));
+		rec.kind = EMIT_DROPPED;
+		encode_record (&rec, NULL);
+
+		flush_emitter ();
+	}
+
+	emitting = EMIT_NONE;
+	emit_fd = -1;
+}
+
+/**
+ * flush_emitter:
+ *
+ * Writes out as much of the buffered records as the reader will take
+ * without waiting; called once each block of the data stream is parsed.
+ **/
+void
+flush_emitter (void)
+{
+	size_t done = 0;
+
+	if (! emitting)
+		return;
+
+	while (done < emit_buf_len) {
+		ssize_t len;
+
+		len = write (emit_fd, emit_buf + done, emit_buf_len - done);
+		if (len > 0) {
+			done += len;
+		} else if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((len < 0) && (errno == EAGAIN)) {
+			break;
+		} else {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("unable to write decoded packets"),
+				 strerror (errno));
+			emitting = EMIT_NONE;
+			emit_buf_len = 0;
+			return;
+		}
+	}
+
+	if (done) {
+		memmove (emit_buf, emit_buf + done, emit_buf_len - done);
+		emit_buf_len -= done;
+	}
+}
+
+/**
+ * emit_packet:
+ * @packet: decoded packet.
+ *
+ * Writes @packet out as a record, if that's been asked for; nothing is
+ * allocated.  The record is dropped if the buffer is full.
+ **/
+void
+emit_packet (const Packet *packet)
+{
+	const unsigned char *text;
+	EmitRecord           rec;
+
+	if (! emitting)
+		return;
+
+	if (emit_buf_len + EMIT_RECORD_MAX > EMIT_BUF_SIZE) {
+		flush_emitter ();
+		if (emit_buf_len + EMIT_RECORD_MAX > EMIT_BUF_SIZE) {
+			emit_dropped++;
+			return;
+		}
+	}
+
+	if (emit_dropped) {
+		memset (&rec, 0, sizeof (rec));
+		rec.kind = EMIT_DROPPED;
+		encode_record (&rec, NULL);
+	}
+
+	describe_packet (packet, &rec, &text);
+	encode_record (&rec, text);
+}
+
+
+/**
+ * describe_packet:
+ * @packet: decoded packet,
+ * @rec: record to fill in,
+ * @text: set to the text of the packet.
+ *
+ * Fills in @rec for @packet, parsing the value out of it where the
+ * packet carries one, and noting the feed time from SYS_TIMESTAMP
+ * packets.  Payloads that aren't text, such as the little-endian
+ * numbers of key frame markers and timestamps, are left out.
+ **/
+static void
+describe_packet (const Packet         *packet,
+		 EmitRecord           *rec,
+		 const unsigned char **text)
+{
+	const unsigned char *payload;
+	ValueType            type;
+	int64_t              value;
+	int                  len, number, i;
+
+	memset (rec, 0, sizeof (EmitRecord));
+	rec->type = packet->type;
+	rec->car = packet->car;
+	rec->data = packet->data;
+
+	payload = packet->payload;
+	len = packet->len;
+
+	if (packet->car) {
+		rec->kind = EMIT_CAR;
+
+		switch ((CarPacketType) packet->type) {
+		case CAR_POSITION_UPDATE:
+			rec->value = packet->data * 1000LL;
+			rec->flags |= EMIT_HAS_VALUE;
+			len = -1;
+			break;
+		case CAR_POSITION_HISTORY:
+			len = -1;
+			break;
+		default:
+			type = parse_value ((const char *) payload, len, &number);
+			set_value (rec, type, number);
+			break;
+		}
+	} else {
+		rec->kind = EMIT_SYSTEM;
+
+		switch ((SystemPacketType) packet->type) {
+		case SYS_EVENT_ID:
+			/* Odd byte, then the event number */
+			if (len > 0) {
+				payload++;
+				len--;
+			}
+			type = parse_value ((const char *) payload, len, &number);
+			set_value (rec, type, number);
+			break;
+		case SYS_KEY_FRAME:
+		case SYS_TIMESTAMP:
+			value = 0;
+			for (i = len; i > 0; i--) {
+				value <<= 8;
+				value |= payload[i - 1];
+			}
+
+			if (packet->type == SYS_TIMESTAMP)
+				feed_time = value;
+
+			rec->value = value * 1000;
+			rec->flags |= EMIT_HAS_VALUE;
+			len = -1;
+			break;
+		case SYS_REFRESH_RATE:
+			rec->value = packet->data * 1000LL;
+			rec->flags |= EMIT_HAS_VALUE;
+			len = -1;
+			break;
+		case SYS_SPEED:
+			/* Field to be updated, then the text */
+			if (len > 0) {
+				rec->data = payload[0];
+				payload++;
+				len--;
+			}
+			type = parse_value ((const char *) payload, len, &number);
+			set_value (rec, type, number);
+			break;
+		case SYS_WEATHER:
+		case SYS_TRACK_STATUS:
+			type = parse_value ((const char *) payload, len, &number);
+			set_value (rec, type, number);
+			break;
+		default:
+			break;
+		}
+
+		/* System packets with nothing to say have no text */
+		if (! len)
+			len = -1;
+	}
+
+	if (len >= 0) {
+		rec->flags |= EMIT_HAS_TEXT;
+		rec->text_len = len;
+	}
+
+	*text = payload;
+	rec->feed_time = feed_time;
+}
+
+/**
+ * set_value:
+ * @rec: record to fill in,
+ * @type: type of value parsed from the text of the packet,
+ * @number: value parsed.
+ *
+ * Sets the value of @rec, in thousandths, to the number, time (in
+ * seconds) or laps in the text of the packet if there was one, and
+ * notes which it was.
+ **/
+static void
+set_value (EmitRecord *rec,
+	   ValueType   type,
+	   int         number)
+{
+	rec->value_type = type;
+
+	switch (type) {
+	case VALUE_NUMBER:
+	case VALUE_LAPS:
+		rec->value = number * 1000LL;
+		break;
+	case VALUE_TIME:
+		rec->value = number;
+		break;
+	default:
+		return;
+	}
+
+	rec->flags |= EMIT_HAS_VALUE;
+}
+
+/**
+ * encode_record:
+ * @rec: record to encode,
+ * @text: text of the record.
+ *
+ * Appends @rec to the buffer, which must have room, in the format asked
+ * for; the monotonic clock is filled in here.  An EMIT_DROPPED record
+ * takes its value from the count of records dropped, which is reset.
+ **/
+static void
+encode_record (const EmitRecord    *rec,
+	       const unsigned char *text)
+{
+	unsigned char   *buf = emit_buf + emit_buf_len;
+	struct timespec  ts;
+	EmitRecord       hdr;
+
+	memcpy (&hdr, rec, sizeof (EmitRecord));
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	hdr.monotonic = (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+
+	if (hdr.kind == EMIT_DROPPED) {
+		hdr.value = emit_dropped;
+		hdr.flags = EMIT_HAS_VALUE;
+		hdr.feed_time = feed_time;
+		emit_dropped = 0;
+	}
+
+	if (emitting == EMIT_BINARY) {
+		hdr.size = sizeof (EmitRecord) + hdr.text_len;
+		memcpy (buf, &hdr, sizeof (EmitRecord));
+		buf += sizeof (EmitRecord);
+
+		if (hdr.text_len) {
+			memcpy (buf, text, hdr.text_len);
+			buf += hdr.text_len;
+		}
+
+		emit_buf_len = buf - emit_buf;
+		return;
+	}
+
+#define PUT(_str) (memcpy (buf, _str, sizeof (_str) - 1), \
+		   buf += sizeof (_str) - 1)
+
+	PUT ("{\"mono\":");
+	buf += put_number (buf, hdr.monotonic);
+	PUT (",\"feed\":");
+	buf += put_number (buf, hdr.feed_time);
+
+	switch ((EmitKind) hdr.kind) {
+	case EMIT_CAR:
+		PUT (",\"car\":");
+		buf += put_number (buf, hdr.car);
+		PUT (",\"type\":");
+		buf += put_number (buf, hdr.type);
+		PUT (",\"colour\":");
+		buf += put_number (buf, hdr.data);
+		break;
+	case EMIT_SYSTEM:
+		PUT (",\"sys\":");
+		buf += put_number (buf, hdr.type);
+		PUT (",\"data\":");
+		buf += put_number (buf, hdr.data);
+		break;
+	case EMIT_DROPPED:
+		PUT (",\"dropped\":");
+		buf += put_number (buf, hdr.value);
+		hdr.flags = 0;
+		break;
+	}
+
+	if (hdr.flags & EMIT_HAS_TEXT) {
+		PUT (",\"text\":\"");
+		buf += put_text (buf, text, hdr.text_len);
+		PUT ("\"");
+	}
+
+	if (hdr.flags & EMIT_HAS_VALUE) {
+		PUT (",\"value\":");
+		buf += put_value (buf, hdr.value);
+	}
+
+	switch ((ValueType) hdr.value_type) {
+	case VALUE_NUMBER:
+		PUT (",\"kind\":\"number\"");
+		break;
+	case VALUE_TIME:
+		PUT (",\"kind\":\"time\"");
+		break;
+	case VALUE_LAPS:
+		PUT (",\"kind\":\"laps\"");
+		break;
+	case VALUE_PIT:
+		PUT (",\"kind\":\"pit\"");
+		break;
+	case VALUE_STOPPED:
+		PUT (",\"kind\":\"stopped\"");
+		break;
+	case VALUE_NONE:
+		break;
+	}
+
+	PUT ("}\n");
+
+#undef PUT
+
+	emit_buf_len = buf - emit_buf;
+}
+
+/**
+ * put_number:
+ * @buf: buffer to write to,
+ * @number: number to write.
+ *
+ * Writes @number in decimal, without the help of printf().
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+put_number (unsigned char      *buf,
+	    unsigned long long  number)
+{
+	unsigned char digits[20];
+	size_t        len = 0, i;
+
+	do {
+		digits[len++] = '0' + (number % 10);
+		number /= 10;
+	} while (number);
+
+	for (i = 0; i < len; i++)
+		buf[i] = digits[len - i - 1];
+
+	return len;
+}
+
+/**
+ * put_value:
+ * @buf: buffer to write to,
+ * @value: value in thousandths.
+ *
+ * Writes @value as a JSON number, with as many decimals as it needs.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+put_value (unsigned char *buf,
+	   int64_t        value)
+{
+	size_t len = 0;
+	int    frac;
+
+	if (value < 0) {
+		buf[len++] = '-';
+		value = -value;
+	}
+
+	len += put_number (buf + len, value / 1000);
+
+	frac = value % 1000;
+	if (frac) {
+		buf[len++] = '.';
+		buf[len++] = '0' + (frac / 100);
+		if (frac % 100) {
+			buf[len++] = '0' + (frac / 10 % 10);
+			if (frac % 10)
+				buf[len++] = '0' + (frac % 10);
+		}
+	}
+
+	return len;
+}
+
+/**
+ * put_text:
+ * @buf: buffer to write to,
+ * @text: text to write,
+ * @len: length of @text.
+ *
+ * Writes @text escaped for a JSON string.  Valid UTF-8 is copied as it
+ * is, any other byte is taken to be Latin-1.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+put_text (unsigned char       *buf,
+	  const unsigned char *text,
+	  int                  len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t            out = 0;
+	int               i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = text[i];
+		int           follow, j;
+
+		if ((c == '"') || (c == '\\')) {
+			buf[out++] = '\\';
+			buf[out++] = c;
+			continue;
+		} else if ((c < 0x20) || (c == 0x7f)) {
+			memcpy (buf + out, "\\u00", 4);
+			buf[out + 4] = hex[c >> 4];
+			buf[out + 5] = hex[c & 0x0f];
+			out += 6;
+			continue;
+		} else if (c < 0x80) {
+			buf[out++] = c;
+			continue;
+		}
+
+		follow = ((c >= 0xc2) && (c < 0xe0) ? 1
+			  : (c >= 0xe0) && (c < 0xf0) ? 2
+			  : (c >= 0xf0) && (c < 0xf5) ? 3 : 0);
+		for (j = 1; follow && (j <= follow); j++)
+			if ((i + j >= len) || ((text[i + j] & 0xc0) != 0x80))
+				follow = 0;
+
+		if (follow) {
+			memcpy (buf + out, text + i, follow + 1);
+			out += follow + 1;
+			i += follow;
+		} else {
+			buf[out++] = 0xc0 | (c >> 6);
+			buf[out++] = 0x80 | (c & 0x3f);
+		}
+	}
+
+	return out;
+}
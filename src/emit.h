@@ -0,0 +1,98 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_EMIT_H
+#define LIVE_F1_EMIT_H
+
+#include <stdint.h>
+
+#include "live-f1.h"
+#include "packet.h"
+
+
+/**
+ * EmitFormat:
+ *
+ * Formats decoded packets can be written out in.
+ **/
+typedef enum {
+	EMIT_NONE,
+	EMIT_NDJSON,
+	EMIT_BINARY
+} EmitFormat;
+
+/**
+ * EmitKind:
+ *
+ * Kind of each record written out.
+ **/
+typedef enum {
+	EMIT_CAR	= 1,
+	EMIT_SYSTEM	= 2,
+	EMIT_DROPPED	= 3
+} EmitKind;
+
+/* Record has a @value, or has text even if it's empty */
+#define EMIT_HAS_VALUE 0x01
+#define EMIT_HAS_TEXT  0x02
+
+/**
+ * EmitRecord:
+ * @size: size of the record, including the text that follows it,
+ * @kind: EmitKind of the record,
+ * @type: packet type,
+ * @car: car the packet is for, or zero,
+ * @flags: EMIT_HAS_VALUE and EMIT_HAS_TEXT,
+ * @data: data from the packet header, the colour of a car atom,
+ * @monotonic: monotonic clock when the packet was decoded (nsecs),
+ * @value: value parsed from the packet in thousandths, or for a
+ *         EMIT_DROPPED record the number of records dropped,
+ * @feed_time: latest timestamp in the data stream (seconds),
+ * @text_len: length of the text that follows,
+ * @value_type: ValueType of the text.
+ *
+ * Header of each record written by --emit=binary, in host byte order,
+ * followed by @text_len bytes of text as sent in the data stream.
+ **/
+typedef struct {
+	uint16_t size;
+	uint8_t  kind, type, car, flags;
+	int16_t  data;
+	uint64_t monotonic;
+	int64_t  value;
+	uint32_t feed_time;
+	uint16_t text_len, value_type;
+} EmitRecord;
+
+
+SJR_BEGIN_EXTERN
+
+/* Format packets are being written out in, if any */
+extern EmitFormat emitting;
+
+
+int  open_emitter  (const char *format);
+void close_emitter (void);
+void flush_emitter (void);
+
+void emit_packet   (const Packet *packet);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_EMIT_H */
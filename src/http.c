@@ -23,13 +23,27 @@
 # include <config.h>
 #endif /* HAVE_CONFIG_H */
 
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <ne_request.h>
 #include <ne_uri.h>
 
 #include "live-f1.h"
+#include "display.h"
+#include "loop.h"
+#include "record.h"
+#include "replay.h"
+#include "stats.h"
 #include "stream.h"
 #include "http.h"
 
@@ -37,14 +51,120 @@
 /* URLs to important places on the live-timing site */
 #define LOGIN_URL           "/reg/login"
 #define REGISTER_URL        "/reg/registration"
-#define KEY_URL_BASE        "/reg/getkey/"
-#define KEYFRAME_URL_PREFIX "/keyframe"
+
+/* Names of files in the cache */
+#define KEYFRAME_CACHE      "%u-keyframe_%05u.bin"
+#define KEY_CACHE           "%u-key"
+#define COOKIE_CACHE        "cookie"
+
+/* How long a cached authentication cookie is trusted for (seconds) */
+#define COOKIE_LIFETIME     (24 * 60 * 60)
+
+/* Number of idle sessions kept open for re-use */
+#define SESSION_POOL_SIZE 4
+
+
+/**
+ * PooledSession:
+ * @host: host the session is connected to,
+ * @sess: idle neon session.
+ *
+ * Session kept in the pool between requests, so that its connection
+ * to @host can be re-used with HTTP keep-alive.
+ **/
+typedef struct {
+	char       *host;
+	ne_session *sess;
+} PooledSession;
+
+/**
+ * KeyFrameFetch:
+ * @host: host to obtain key frame from,
+ * @frame: key frame number to obtain,
+ * @event_no: event the key frame is expected to belong to,
+ * @prefetch: only store it in the cache,
+ * @cached: whether it was read from the cache,
+ * @thread: thread downloading it,
+ * @threaded: whether @thread was started,
+ * @buf: data received,
+ * @len: length of @buf,
+ * @size: allocated size of @buf,
+ * @error: error message if the request failed,
+ * @done: set once the download has finished.
+ *
+ * Key frame being downloaded in the background.  The worker thread
+ * owns everything but @done until it sets it; when prefetching nobody
+ * waits for it, so the worker frees the structure itself.
+ **/
+typedef struct {
+	char          *host;
+	unsigned int   frame;
+	unsigned int   event_no;
+	int            prefetch;
+	int            cached;
+	pthread_t      thread;
+	int            threaded;
+
+	unsigned char *buf;
+	size_t         len, size;
+	char          *error;
+
+	int            done;
+} KeyFrameFetch;
+
+
+/* Idle sessions, shared with the key frame download thread */
+static PooledSession   session_pool[SESSION_POOL_SIZE];
+static pthread_mutex_t session_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Directory key frames are cached in, NULL if there isn't one */
+static char *cache_dir = NULL;
+
+/* Event of the last key frame parsed, assumed to be the one still
+ * running when we reconnect and can't yet know the event */
+static unsigned int cache_event = 0;
+
+/* Set while a prefetch is in progress */
+static int prefetching = 0;
+
+/* Whether the cookie came from the cache, and the event whose key did;
+ * these are only trusted until decryption fails */
+static int          cookie_cached = FALSE;
+static unsigned int key_cached = 0;
+
+/* Thread logging in, while logging_in is set */
+static pthread_t login_thread;
+static int       logging_in = FALSE;
 
 
 /* Forward prototypes */
+static void *retry_login (void *data);
+static char *login       (const char *host, const char *email,
+			  const char *password, int *refused);
+static ne_session *get_session (const char *host);
+static void        put_session (const char *host, ne_session *sess, int ok);
+static int         dispatch_request (ne_request *req);
 static void parse_cookie_hdr (char **value, const char  *header);
 static int  parse_key_body   (unsigned int *key, const char *buf, size_t len);
 static int  parse_number_body();
+static void *download_key_frame   (void *data);
+static int    store_key_frame_body (KeyFrameFetch *fetch, const char *buf,
+				    size_t len);
+static void   parse_key_frame      (CurrentState *state, unsigned int frame,
+				    const unsigned char *buf, size_t len);
+static char *        cache_filename         (const char *format, ...);
+static void          write_cache_file       (const char *filename,
+					     const void *buf, size_t len);
+static int           read_cached_key_frame  (KeyFrameFetch *fetch);
+static void          write_cached_key_frame (KeyFrameFetch *fetch);
+static unsigned int  key_frame_event        (const unsigned char *buf,
+					     size_t len);
+static char *        read_cached_cookie     (const char *email);
+static void          write_cached_cookie    (const char *email,
+					     const char *cookie);
+static unsigned int  read_cached_key        (unsigned int event_no);
+static void          write_cached_key       (unsigned int event_no,
+					     unsigned int key);
 
 
 /**
@@ -64,6 +184,100 @@ numlen (unsigned int number)
 	return len;
 }
 
+/**
+ * get_session:
+ * @host: host to connect to.
+ *
+ * Takes an idle session for @host out of the pool, so that the request
+ * re-uses its connection; or creates a new one if there isn't one.
+ * The session should be given back with put_session().  This may be
+ * called from any thread, so must not touch the display.
+ *
+ * Returns: session for @host.
+ **/
+static ne_session *
+get_session (const char *host)
+{
+	ne_session *sess = NULL;
+	int         i;
+
+	pthread_mutex_lock (&session_pool_lock);
+	for (i = 0; i < SESSION_POOL_SIZE; i++) {
+		if (session_pool[i].sess && (! strcmp (session_pool[i].host, host))) {
+			sess = session_pool[i].sess;
+			session_pool[i].sess = NULL;
+			free (session_pool[i].host);
+			session_pool[i].host = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&session_pool_lock);
+
+	if (sess)
+		return sess;
+
+	sess = ne_session_create ("http", host, 80);
+	ne_set_useragent (sess, PACKAGE_STRING);
+
+	return sess;
+}
+
+/**
+ * put_session:
+ * @host: host @sess is connected to,
+ * @sess: session from get_session(),
+ * @ok: whether the request succeeded.
+ *
+ * Gives the session back to the pool so that the next request to @host
+ * can re-use its connection.  Sessions whose request failed, or that
+ * don't fit in the pool, are destroyed instead.
+ **/
+static void
+put_session (const char *host,
+	     ne_session *sess,
+	     int         ok)
+{
+	int i;
+
+	if (ok) {
+		pthread_mutex_lock (&session_pool_lock);
+		for (i = 0; i < SESSION_POOL_SIZE; i++) {
+			if (! session_pool[i].sess) {
+				session_pool[i].host = strdup (host);
+				session_pool[i].sess = sess;
+				sess = NULL;
+				break;
+			}
+		}
+		pthread_mutex_unlock (&session_pool_lock);
+	}
+
+	if (sess)
+		ne_session_destroy (sess);
+}
+
+/**
+ * dispatch_request:
+ * @req: request to dispatch.
+ *
+ * Dispatches @req, counting it and the time it took in the statistics;
+ * may be called from any thread.
+ *
+ * Returns: as ne_request_dispatch().
+ **/
+static int
+dispatch_request (ne_request *req)
+{
+	unsigned long long started;
+	int                ret;
+
+	started = stats_clock ();
+	ret = ne_request_dispatch (req);
+	count_http_request (stats_clock () - started);
+
+	return ret;
+}
+
 
 /**
  * obtain_auth_cookie:
@@ -77,19 +291,154 @@ numlen (unsigned int number)
  *
  * For convenience sake, the cookie is never unencoded.
  *
+ * The cookie is cached for a day, so we only log in again once it's
+ * old or if the decryption key obtained with it doesn't work.
+ *
  * Returns: cookie in newly allocated string or NULL on failure.
  **/
 char *
 obtain_auth_cookie (const char *host,
 		    const char *email,
 		    const char *password)
+{
+	char *cookie;
+	int   refused = FALSE;
+
+	cookie = read_cached_cookie (email);
+	if (cookie) {
+		info (3, _("Got cached authentication cookie: %s\n"), cookie);
+		cookie_cached = TRUE;
+		return cookie;
+	}
+
+	info (1, _("Obtaining authentication cookie ...\n"));
+
+	cookie = login (host, email, password, &refused);
+	if (refused) {
+		close_display ();
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("login failed: check email and password in ~/.f1rc"));
+		exit (2);
+	} else if (cookie) {
+		info (3, _("Got authentication cookie: %s\n"), cookie);
+		cookie_cached = FALSE;
+	}
+
+	return cookie;
+}
+
+/**
+ * start_login:
+ * @state: application state structure.
+ *
+ * Starts logging in to obtain the authentication cookie in the
+ * background, retrying until it succeeds, so that we can connect to
+ * the data stream and fetch the key frame meanwhile.  The cookie isn't
+ * needed until we obtain a decryption key, which calls finish_login().
+ *
+ * If the cookie is in the cache, it's simply used.
+ **/
+void
+start_login (CurrentState *state)
+{
+	state->cookie = read_cached_cookie (state->email);
+	if (state->cookie) {
+		info (3, _("Got cached authentication cookie: %s\n"),
+		      state->cookie);
+		cookie_cached = TRUE;
+		return;
+	}
+
+	info (1, _("Obtaining authentication cookie ...\n"));
+
+	logging_in = ! pthread_create (&login_thread, NULL, retry_login, state);
+	if (! logging_in)
+		retry_login (state);
+}
+
+/**
+ * finish_login:
+ * @state: application state structure.
+ *
+ * Waits for the login started by start_login() to finish.
+ *
+ * Returns: authentication cookie.
+ **/
+const char *
+finish_login (CurrentState *state)
+{
+	if (! logging_in)
+		return state->cookie;
+
+	pthread_join (login_thread, NULL);
+	logging_in = FALSE;
+
+	if (! state->cookie) {
+		close_display ();
+		fprintf (stderr, "%s: %s\n", program_name,
+			 _("login failed: check email and password in ~/.f1rc"));
+		exit (2);
+	}
+
+	info (3, _("Got authentication cookie: %s\n"), state->cookie);
+	cookie_cached = FALSE;
+
+	return state->cookie;
+}
+
+/**
+ * retry_login:
+ * @data: application state structure.
+ *
+ * Logs in, backing off between attempts up to a minute, until we either
+ * have the cookie or have been told the e-mail address and password are
+ * wrong.  This runs in its own thread so must not touch the display and
+ * only sets the cookie in the state.
+ *
+ * Returns: NULL.
+ **/
+static void *
+retry_login (void *data)
+{
+	CurrentState *state = data;
+	int           refused = FALSE, delay;
+
+	for (delay = 1; ; delay = MIN (delay * 2, 60)) {
+		state->cookie = login (state->auth_host, state->email,
+				       state->password, &refused);
+		if (state->cookie || refused)
+			break;
+
+		sleep (delay);
+	}
+
+	return NULL;
+}
+
+/**
+ * login:
+ * @host: host to obtain cookie from,
+ * @email: e-mail address registered with the F1 website,
+ * @password: paassword registered for @email,
+ * @refused: set to TRUE if the login was refused.
+ *
+ * Logs in to the Live Timing website, and steals the cookie out of the
+ * response headers; this may be called from any thread, so doesn't
+ * touch the display.  The cookie is written to the cache.
+ *
+ * Returns: cookie in newly allocated string or NULL on failure.
+ **/
+static char *
+login (const char *host,
+       const char *email,
+       const char *password,
+       int        *refused)
 {
 	ne_session *sess;
 	ne_request *req;
 	char       *cookie = NULL, *body, *e_email, *e_password;
 	const char *header;
-
-	info (1, _("Obtaining authentication cookie ...\n"));
+	int         ok = FALSE;
 
 	/* Encode the e-mail and password as a form */
 	e_email = ne_path_escape (email);
@@ -99,8 +448,7 @@ obtain_auth_cookie (const char *host,
 	free (e_password);
 	free (e_email);
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = get_session (host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "POST", LOGIN_URL);
@@ -117,7 +465,7 @@ obtain_auth_cookie (const char *host,
 #endif
 
 	/* Dispatch the event, and check it was a good one */
-	if (ne_request_dispatch (req)) {
+	if (dispatch_request (req)) {
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("login request failed"), ne_get_error (sess));
 		goto error;
@@ -127,6 +475,7 @@ obtain_auth_cookie (const char *host,
 			 ne_get_status (req)->reason_phrase);
 		goto error;
 	}
+	ok = TRUE;
 
 #if HAVE_NE_GET_RESPONSE_HEADER
 	header = ne_get_response_header (req, "Set-Cookie");
@@ -134,23 +483,17 @@ obtain_auth_cookie (const char *host,
 		parse_cookie_hdr (&cookie, header);
 #endif
 
-	if (! cookie) {
-		fprintf (stderr, "%s: %s\n", program_name,
-			 _("login failed: check email and password in ~/.f1rc"));
-		goto fatal_error;
+	if (cookie) {
+		write_cached_cookie (email, cookie);
+	} else {
+		*refused = TRUE;
 	}
 
 error:
 	ne_request_destroy (req);
-	ne_session_destroy (sess);
+	put_session (host, sess, ok);
 
 	return cookie;
-
-fatal_error:
-	ne_request_destroy (req);
-	ne_session_destroy (sess);
-
-	exit (2);
 }
 
 /**
@@ -177,32 +520,45 @@ parse_cookie_hdr (char       **value,
 	*value = malloc (len + 1);
 	strncpy (*value, header, len);
 	(*value)[len] = 0;
-
-	info (3, _("Got authentication cookie: %s\n"), *value);
 }
 
 /**
  * obtain_decryption_key:
- * @host: host to obtain key from,
- * @event_no: official event number,
- * @cookie: uri-encoded cookie.
+ * @state: application state structure,
+ * @event_no: official event number.
  *
  * Obtains the decryption key for the event using the authorisation
- * cookie of a registered user.
+ * cookie of a registered user, waiting for the login to finish if
+ * it hasn't already.
  *
- * @cookie should be supplied already uri-encoded.
+ * Keys never change, so are cached; renew_decryption_key() obtains it
+ * again should the cached key not work.
  *
  * Returns: key obtained on success, or zero on failure.
  **/
 unsigned int
-obtain_decryption_key (const char   *host,
-		       unsigned int  event_no,
-		       const char   *cookie)
+obtain_decryption_key (CurrentState *state,
+		       unsigned int  event_no)
 {
 	ne_session   *sess;
 	ne_request   *req;
+	const char   *cookie;
 	char         *url;
 	unsigned int  key = 0;
+	int           ok;
+
+	if (replaying)
+		return replay_decryption_key (event_no);
+
+	key = read_cached_key (event_no);
+	if (key) {
+		info (3, _("Got cached decryption key: %08x\n"), key);
+		record_key (event_no, key);
+		key_cached = event_no;
+		return key;
+	}
+
+	cookie = finish_login (state);
 
 	info (1, _("Obtaining decryption key ...\n"));
 
@@ -210,8 +566,7 @@ obtain_decryption_key (const char   *host,
 		      + strlen (cookie) + 11);
 	sprintf (url, "%s%u.asp?auth=%s", KEY_URL_BASE, event_no, cookie);
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = get_session (state->host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "GET", url);
@@ -220,15 +575,20 @@ obtain_decryption_key (const char   *host,
 	free (url);
 
 	/* Dispatch the event */
-	if (ne_request_dispatch (req)) {
+	ok = ! dispatch_request (req);
+	if (! ok) {
 		fprintf (stderr, "%s: %s: %s\n", program_name,
 			 _("key request failed"), ne_get_error (sess));
 	}
 
 	info (3, _("Got decryption key: %08x\n"), key);
+	record_key (event_no, key);
+	if (key)
+		write_cached_key (event_no, key);
+	key_cached = 0;
 
 	ne_request_destroy (req);
-	ne_session_destroy (sess);
+	put_session (state->host, sess, ok);
 
 	return key;
 }
@@ -265,66 +625,755 @@ parse_key_body (unsigned int *key,
 }
 
 /**
- * obtain_key_frame:
- * @host: host to obtain key frame from,
- * @frame: key frame number to obtain,
- * @userdata: pointer to pass to stream parser.
+ * renew_decryption_key:
+ * @state: application state structure.
  *
- * Obtains the key frame numbered from the website and arranges for the
- * data to be parsed immediately with the data stream parser.
+ * Called when decryption fails; if the key for the current event came
+ * from the cache, it's thrown away and obtained from the website again,
+ * logging in again first if the cookie was cached too.  The data stream
+ * is back in sync with the new key at the next key frame.
+ **/
+void
+renew_decryption_key (CurrentState *state)
+{
+	char *filename, *cookie;
+
+	if (replaying || (! state->event_no) || (key_cached != state->event_no))
+		return;
+
+	info (2, _("Cached decryption key failed, obtaining it again ...\n"));
+	filename = cache_filename (KEY_CACHE, state->event_no);
+	unlink (filename);
+	free (filename);
+	key_cached = 0;
+
+	finish_login (state);
+	if (cookie_cached) {
+		filename = cache_filename (COOKIE_CACHE);
+		unlink (filename);
+		free (filename);
+		cookie_cached = FALSE;
+
+		cookie = obtain_auth_cookie (state->auth_host, state->email,
+					     state->password);
+		if (cookie) {
+			free (state->cookie);
+			state->cookie = cookie;
+		}
+	}
+
+	state->parser->key = obtain_decryption_key (state, state->event_no);
+}
+
+/**
+ * fetch_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number to obtain.
+ *
+ * Starts a download of the numbered key frame from the website in the
+ * background.  Until finish_key_frame() parses it, the data stream is
+ * queued rather than parsed, so the socket is still read and pinged
+ * while we wait.
+ *
+ * The key frame is read from the cache instead if it's there.  When
+ * replaying the key frame is parsed immediately instead.
  *
  * Returns: 0 on success, non-zero on failure.
  **/
 int
-obtain_key_frame (const char   *host,
-		  unsigned int  frame,
-		  void         *userdata)
+fetch_key_frame (CurrentState *state,
+		 unsigned int  frame)
 {
-	ne_session *sess;
-	ne_request *req;
-	char       *url;
+	KeyFrameFetch *fetch;
+
+	if (replaying) {
+		parse_key_frame (state, frame, NULL, 0);
+		return 0;
+	}
+
+	if (state->parser->key_frame)
+		return 1;
 
 	if (frame > 0) {
 		info (2, _("Obtaining key frame %d ...\n"), frame);
-
-		url = malloc (strlen (KEYFRAME_URL_PREFIX)
-			      + MAX (numlen (frame), 5) + 6);
-		sprintf (url, "%s_%05d.bin", KEYFRAME_URL_PREFIX, frame);
 	} else {
 		info (2, _("Obtaining current key frame ...\n"));
+	}
+
+	fetch = calloc (1, sizeof (KeyFrameFetch));
+	if (! fetch)
+		abort ();
+
+	fetch->host = strdup (state->host);
+	fetch->frame = frame;
+	fetch->event_no = state->event_no ? state->event_no : cache_event;
+
+	/* Without a thread, just download it now */
+	fetch->threaded = ! pthread_create (&fetch->thread, NULL,
+					    download_key_frame, fetch);
+	if (! fetch->threaded)
+		download_key_frame (fetch);
+
+	state->parser->key_frame = fetch;
+	return 0;
+}
+
+/**
+ * finish_key_frame:
+ * @state: application state structure,
+ * @wait: whether to wait for the download to finish.
+ *
+ * Checks whether the key frame started by fetch_key_frame() has been
+ * downloaded, and if so records it in the capture file and parses it
+ * before resuming the data stream that was queued meanwhile.
+ *
+ * Should the current key frame, fetched while connecting, fail or be
+ * superseded then the key frame marker in the data stream fetches the
+ * numbered one.
+ *
+ * Returns: 1 if a key frame was finished, 0 if none was ready.
+ **/
+int
+finish_key_frame (CurrentState *state,
+		  int           wait)
+{
+	KeyFrameFetch *fetch = state->parser->key_frame;
+
+	if (! fetch)
+		return 0;
+	if ((! wait) && (! __sync_fetch_and_add (&fetch->done, 0)))
+		return 0;
+
+	if (fetch->threaded)
+		pthread_join (fetch->thread, NULL);
+	state->parser->key_frame = NULL;
+
+	/* The current key frame carries its own marker; if that's the one
+	 * the data stream asked for meanwhile, or it hasn't asked yet, it's
+	 * recorded and cached under that number and not fetched again.
+	 * A new key frame may have been published while we waited for it,
+	 * in which case it's useless to us and the marker queued in the
+	 * data stream fetches the numbered one instead. */
+	if ((! fetch->frame) && (! fetch->error)) {
+		unsigned int frame, queued;
+
+		frame = first_key_frame (fetch->buf, fetch->len);
+		queued = queued_key_frame (state->parser);
+		if (frame && queued && (frame != queued)) {
+			info (3, _("Key frame %d superseded by %d\n"),
+			      frame, queued);
+			goto finished;
+		} else if (frame) {
+			fetch->frame = state->frame = frame;
+			write_cached_key_frame (fetch);
+		}
+	}
+
+	record_number (RECORD_KEY_FRAME_BEGIN, fetch->frame);
+	if (fetch->error) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("key frame request failed"), fetch->error);
+	} else {
+		record_block (RECORD_KEY_FRAME, fetch->buf, fetch->len);
+		parse_key_frame (state, fetch->frame, fetch->buf, fetch->len);
+		count_key_frame (fetch->cached);
+		if (fetch->cached) {
+			info (3, _("Key frame read from cache\n"));
+		} else {
+			info (3, _("Key frame received\n"));
+		}
 
+		if (state->event_no)
+			cache_event = state->event_no;
+	}
+	record_block (RECORD_KEY_FRAME_END, NULL, 0);
+
+finished:
+	free (fetch->host);
+	free (fetch->buf);
+	free (fetch->error);
+	free (fetch);
+
+	resume_stream (state);
+	return 1;
+}
+
+/**
+ * prefetch_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number to obtain.
+ *
+ * Downloads the numbered key frame into the cache in the background
+ * without parsing it, so that should we need to resync to it later it
+ * can be read from disk.  Only one key frame is prefetched at a time,
+ * others are skipped while it downloads.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+prefetch_key_frame (CurrentState *state,
+		    unsigned int  frame)
+{
+	KeyFrameFetch  *fetch;
+	pthread_attr_t  attr;
+	char           *filename;
+	int             cached;
+
+	if (replaying || (! cache_dir) || (! frame) || (! state->event_no))
+		return 1;
+
+	filename = cache_filename (KEYFRAME_CACHE, state->event_no, frame);
+	cached = ! access (filename, R_OK);
+	free (filename);
+	if (cached)
+		return 0;
+
+	if (! __sync_bool_compare_and_swap (&prefetching, 0, 1))
+		return 1;
+
+	info (4, _("Prefetching key frame %d ...\n"), frame);
+
+	fetch = calloc (1, sizeof (KeyFrameFetch));
+	if (! fetch)
+		abort ();
+
+	fetch->host = strdup (state->host);
+	fetch->frame = frame;
+	fetch->event_no = state->event_no;
+	fetch->prefetch = TRUE;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	fetch->threaded = ! pthread_create (&fetch->thread, &attr,
+					    download_key_frame, fetch);
+	pthread_attr_destroy (&attr);
+
+	/* Not worth holding up the stream for */
+	if (! fetch->threaded) {
+		free (fetch->host);
+		free (fetch);
+		__sync_lock_release (&prefetching);
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * download_key_frame:
+ * @data: key frame being fetched.
+ *
+ * Reads the key frame from the cache or downloads it into memory,
+ * storing it in the cache for next time; this runs in its own thread
+ * so must not touch the display, the capture file or the state.
+ *
+ * Returns: NULL.
+ **/
+static void *
+download_key_frame (void *data)
+{
+	KeyFrameFetch *fetch = data;
+	ne_session    *sess;
+	ne_request    *req;
+	char          *url;
+	int            ok;
+
+	if (read_cached_key_frame (fetch)) {
+		fetch->cached = TRUE;
+		goto finished;
+	}
+
+	if (fetch->frame > 0) {
+		url = malloc (strlen (KEYFRAME_URL_PREFIX)
+			      + MAX (numlen (fetch->frame), 5) + 6);
+		sprintf (url, "%s_%05d.bin", KEYFRAME_URL_PREFIX,
+			 fetch->frame);
+	} else {
 		url = malloc (strlen (KEYFRAME_URL_PREFIX) + 5);
 		sprintf (url, "%s.bin", KEYFRAME_URL_PREFIX);
 	}
 
-	sess = ne_session_create ("http", host, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	sess = get_session (fetch->host);
 
 	/* Create the request */
 	req = ne_request_create (sess, "GET", url);
 	ne_add_response_body_reader (req, ne_accept_2xx,
-				     (ne_block_reader) parse_stream_block,
-				     userdata);
+				     (ne_block_reader) store_key_frame_body,
+				     fetch);
 	free (url);
 
 	/* Dispatch the event */
-	if (ne_request_dispatch (req)) {
-		fprintf (stderr, "%s: %s: %s\n", program_name,
-			 _("key frame request failed"), ne_get_error (sess));
+	ok = ! dispatch_request (req);
+	if (! ok) {
+		fetch->error = strdup (ne_get_error (sess));
+	} else if ((ne_get_status (req)->code < 300) && fetch->len) {
+		write_cached_key_frame (fetch);
+	}
 
-		ne_request_destroy (req);
-		ne_session_destroy (sess);
-		return 1;
+	ne_request_destroy (req);
+	put_session (fetch->host, sess, ok);
+
+finished:
+	if (fetch->prefetch) {
+		free (fetch->host);
+		free (fetch->buf);
+		free (fetch->error);
+		free (fetch);
+
+		__sync_lock_release (&prefetching);
+		return NULL;
 	}
 
-	info (3, _("Key frame received\n"));
+	__sync_lock_test_and_set (&fetch->done, 1);
+	wake_event_loop ();
+	return NULL;
+}
+
+/**
+ * fetch_page:
+ * @host: host to fetch from,
+ * @path: path, and query, of the page,
+ * @buf: set to newly allocated body of the page,
+ * @len: set to length of @buf.
+ *
+ * Fetches a page unchanged, so that the relay can pass it on to its
+ * viewers.  Like download_key_frame() this may be called from any
+ * thread, so must not touch the display or the capture file.
+ *
+ * Returns: HTTP status of the response, or zero if the request failed.
+ **/
+int
+fetch_page (const char     *host,
+	    const char     *path,
+	    unsigned char **buf,
+	    size_t         *len)
+{
+	KeyFrameFetch  fetch;
+	ne_session    *sess;
+	ne_request    *req;
+	int            status = 0;
+
+	memset (&fetch, 0, sizeof (fetch));
+
+	sess = get_session (host);
+
+	/* Create the request */
+	req = ne_request_create (sess, "GET", path);
+	ne_add_response_body_reader (req, ne_accept_always,
+				     (ne_block_reader) store_key_frame_body,
+				     &fetch);
+
+	/* Dispatch the request */
+	if (! dispatch_request (req))
+		status = ne_get_status (req)->code;
 
 	ne_request_destroy (req);
-	ne_session_destroy (sess);
+	put_session (host, sess, status != 0);
+
+	*buf = fetch.buf;
+	*len = fetch.len;
+	return status;
+}
+
+/**
+ * store_key_frame_body:
+ * @fetch: key frame being fetched,
+ * @buf: buffer of data received from server,
+ * @len: length of buffer.
+ *
+ * Appends the block of key frame data received from the server to the
+ * data already received.
+ **/
+static int
+store_key_frame_body (KeyFrameFetch *fetch,
+		      const char    *buf,
+		      size_t         len)
+{
+	if (fetch->len + len > fetch->size) {
+		fetch->size = MAX (fetch->len + len, fetch->size * 2);
+		fetch->buf = realloc (fetch->buf, fetch->size);
+		if (! fetch->buf)
+			abort ();
+	}
+
+	memcpy (fetch->buf + fetch->len, buf, len);
+	fetch->len += len;
 
 	return 0;
 }
 
+/**
+ * set_cache_dir:
+ * @dir: directory to cache in.
+ *
+ * Creates @dir, and any missing parents, and caches key frames, keys
+ * and the authentication cookie there from now on.  If it can't be
+ * created, nothing is cached.
+ **/
+void
+set_cache_dir (const char *dir)
+{
+	char *path, *ptr;
+
+	path = strdup (dir);
+	for (ptr = strchr (path + 1, '/'); ; ptr = strchr (ptr + 1, '/')) {
+		if (ptr)
+			*ptr = 0;
+
+		if ((mkdir (path, 0700) < 0) && (errno != EEXIST)) {
+			info (2, _("Not caching in %s: %s\n"),
+			      path, strerror (errno));
+			free (path);
+			return;
+		}
+
+		if (! ptr)
+			break;
+		*ptr = '/';
+	}
+
+	free (cache_dir);
+	cache_dir = path;
+}
+
+/**
+ * cache_filename:
+ * @format: printf format of the name within the cache,
+ * @...: arguments for @format.
+ *
+ * Key frames, keys and the authentication cookie are cached on disk in
+ * files named after what they belong to.
+ *
+ * Returns: name of cache file in newly allocated string.
+ **/
+static char *
+cache_filename (const char *format,
+		...)
+{
+	va_list  ap;
+	char    *filename, name[64];
+
+	va_start (ap, format);
+	vsnprintf (name, sizeof (name), format, ap);
+	va_end (ap);
+
+	filename = malloc (strlen (cache_dir) + strlen (name) + 2);
+	if (! filename)
+		abort ();
+
+	sprintf (filename, "%s/%s", cache_dir, name);
+
+	return filename;
+}
+
+/**
+ * write_cache_file:
+ * @filename: name of cache file,
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Writes @buf to the cache file, readable only by the user since it
+ * may hold their cookie.  The file is written under a temporary name
+ * and renamed, so that it's never seen half written.
+ **/
+static void
+write_cache_file (const char *filename,
+		  const void *buf,
+		  size_t      len)
+{
+	char *tmpname;
+	FILE *cache;
+	int   fd;
+
+	tmpname = malloc (strlen (filename) + 8);
+	if (! tmpname)
+		abort ();
+	sprintf (tmpname, "%s.XXXXXX", filename);
+
+	/* mkstemp() creates the file with mode 0600 */
+	fd = mkstemp (tmpname);
+	if (fd < 0)
+		goto error;
+
+	cache = fdopen (fd, "wb");
+	if (! cache) {
+		close (fd);
+		unlink (tmpname);
+		goto error;
+	}
+
+	if ((fwrite (buf, 1, len, cache) != len)
+	    || fclose (cache) || rename (tmpname, filename))
+		unlink (tmpname);
+
+error:
+	free (tmpname);
+}
+
+/**
+ * read_cached_key_frame:
+ * @fetch: key frame being fetched.
+ *
+ * Reads the key frame from the cache into @fetch if it's there.  The
+ * "current" key frame changes, so is never cached.
+ *
+ * Returns: TRUE if the key frame was read, FALSE otherwise.
+ **/
+static int
+read_cached_key_frame (KeyFrameFetch *fetch)
+{
+	char   *filename, buf[4096];
+	FILE   *cache;
+	size_t  len;
+
+	if ((! cache_dir) || (! fetch->frame) || (! fetch->event_no))
+		return FALSE;
+
+	filename = cache_filename (KEYFRAME_CACHE, fetch->event_no,
+				   fetch->frame);
+	cache = fopen (filename, "rb");
+	free (filename);
+	if (! cache)
+		return FALSE;
+
+	while ((len = fread (buf, 1, sizeof (buf), cache)) > 0)
+		store_key_frame_body (fetch, buf, len);
+
+	if (ferror (cache) || (! fetch->len)) {
+		fetch->len = 0;
+		fclose (cache);
+		return FALSE;
+	}
+
+	fclose (cache);
+	return TRUE;
+}
+
+/**
+ * write_cached_key_frame:
+ * @fetch: key frame downloaded.
+ *
+ * Writes the key frame downloaded into the cache.  Key frames begin by
+ * announcing their event, which we prefer to the event we expected in
+ * case it changed while we were disconnected.
+ **/
+static void
+write_cached_key_frame (KeyFrameFetch *fetch)
+{
+	unsigned int  event_no;
+	char         *filename;
+
+	event_no = key_frame_event (fetch->buf, fetch->len);
+	if (! event_no)
+		event_no = fetch->event_no;
+	if ((! cache_dir) || (! fetch->frame) || (! event_no))
+		return;
+
+	filename = cache_filename (KEYFRAME_CACHE, event_no, fetch->frame);
+	write_cache_file (filename, fetch->buf, fetch->len);
+	free (filename);
+}
+
+/**
+ * key_frame_event:
+ * @buf: key frame data,
+ * @len: length of @buf.
+ *
+ * Key frames begin with an event start packet, which is never
+ * encrypted, so we can tell which event a key frame belongs to
+ * without parsing it.
+ *
+ * Returns: event number, or zero if @buf doesn't begin with one.
+ **/
+static unsigned int
+key_frame_event (const unsigned char *buf,
+		 size_t               len)
+{
+	Packet       packet;
+	unsigned int number = 0;
+	int          i;
+
+	if (len < 2)
+		return 0;
+
+	packet_header (buf, &packet);
+	if (packet.car || (packet.type != SYS_EVENT_ID)
+	    || ((size_t) packet.len + 2 > len))
+		return 0;
+
+	for (i = 1; i < packet.len; i++) {
+		if ((buf[2 + i] < '0') || (buf[2 + i] > '9'))
+			return 0;
+
+		number *= 10;
+		number += buf[2 + i] - '0';
+	}
+
+	return number;
+}
+
+/**
+ * read_cached_cookie:
+ * @email: e-mail address the cookie is for.
+ *
+ * The cookie cache holds its expiry time, the e-mail address it was
+ * obtained for and then the cookie, one to a line.
+ *
+ * Returns: cookie in newly allocated string, or NULL if there's none
+ * cached for @email or it has expired.
+ **/
+static char *
+read_cached_cookie (const char *email)
+{
+	char *filename, line[1024], *cookie = NULL;
+	FILE *cache;
+
+	if (! cache_dir)
+		return NULL;
+
+	filename = cache_filename (COOKIE_CACHE);
+	cache = fopen (filename, "r");
+	free (filename);
+	if (! cache)
+		return NULL;
+
+	if ((! fgets (line, sizeof (line), cache))
+	    || (strtol (line, NULL, 10) <= time (NULL)))
+		goto out;
+
+	if (! fgets (line, sizeof (line), cache))
+		goto out;
+	line[strcspn (line, "\n")] = 0;
+	if (strcmp (line, email))
+		goto out;
+
+	if (! fgets (line, sizeof (line), cache))
+		goto out;
+	line[strcspn (line, "\n")] = 0;
+	if (*line)
+		cookie = strdup (line);
+
+out:
+	fclose (cache);
+	return cookie;
+}
+
+/**
+ * write_cached_cookie:
+ * @email: e-mail address the cookie is for,
+ * @cookie: authentication cookie.
+ *
+ * Writes the cookie into the cache, to expire after COOKIE_LIFETIME.
+ **/
+static void
+write_cached_cookie (const char *email,
+		     const char *cookie)
+{
+	char *filename, *buf;
+
+	if (! cache_dir)
+		return;
+
+	buf = malloc (strlen (email) + strlen (cookie) + 24);
+	if (! buf)
+		abort ();
+	sprintf (buf, "%ld\n%s\n%s\n", (long) time (NULL) + COOKIE_LIFETIME,
+		 email, cookie);
+
+	filename = cache_filename (COOKIE_CACHE);
+	write_cache_file (filename, buf, strlen (buf));
+	free (filename);
+	free (buf);
+}
+
+/**
+ * read_cached_key:
+ * @event_no: official event number.
+ *
+ * Returns: decryption key cached for @event_no, or zero if none is.
+ **/
+static unsigned int
+read_cached_key (unsigned int event_no)
+{
+	char         *filename;
+	FILE         *cache;
+	unsigned int  key = 0;
+
+	if (! cache_dir)
+		return 0;
+
+	filename = cache_filename (KEY_CACHE, event_no);
+	cache = fopen (filename, "r");
+	free (filename);
+	if (! cache)
+		return 0;
+
+	if (fscanf (cache, "%x", &key) != 1)
+		key = 0;
+
+	fclose (cache);
+	return key;
+}
+
+/**
+ * write_cached_key:
+ * @event_no: official event number,
+ * @key: decryption key.
+ *
+ * Writes the decryption key for @event_no into the cache.
+ **/
+static void
+write_cached_key (unsigned int event_no,
+		  unsigned int key)
+{
+	char *filename, buf[10];
+
+	if (! cache_dir)
+		return;
+
+	sprintf (buf, "%08x\n", key);
+
+	filename = cache_filename (KEY_CACHE, event_no);
+	write_cache_file (filename, buf, strlen (buf));
+	free (filename);
+}
+
+/**
+ * parse_key_frame:
+ * @state: application state structure,
+ * @frame: key frame number,
+ * @buf: key frame data, or NULL to take it from the capture,
+ * @len: length of @buf.
+ *
+ * Parses the key frame with a stream parser of its own, so that it
+ * can't leave anything behind in the data stream's; but it may begin
+ * a new event, so we take the key back from it.  This is done as a
+ * bulk load, so the board is only drawn once it's all parsed.
+ **/
+static void
+parse_key_frame (CurrentState        *state,
+		 unsigned int         frame,
+		 const unsigned char *buf,
+		 size_t               len)
+{
+	StreamParser *parser = state->parser;
+	StreamParser  key_frame;
+
+	begin_key_frame_parser (&key_frame, parser);
+	state->parser = &key_frame;
+
+	begin_bulk_load ();
+	if (buf) {
+		parse_stream_block (state, buf, len);
+	} else {
+		replay_key_frame (frame, state);
+	}
+	end_bulk_load (state);
+
+	state->parser = parser;
+	end_key_frame_parser (&key_frame, parser);
+}
+
 /**
  * obtain_total_laps:
  *
@@ -333,14 +1382,17 @@ obtain_key_frame (const char   *host,
  * Returns: total obtained on success, or zero on failure.
  **/
 unsigned int
-obtain_total_laps ()
+obtain_total_laps (void)
 {
 	ne_session   *sess;
 	ne_request   *req;
 	unsigned int  total_laps = 0;
+	int           ok;
 
-	sess = ne_session_create ("http", WEBSERVICE_HOST, 80);
-	ne_set_useragent (sess, PACKAGE_STRING);
+	if (replaying)
+		return replay_total_laps ();
+
+	sess = get_session (WEBSERVICE_HOST);
 
 	/* Create the request */
 	req = ne_request_create (sess, "GET", "/laps.php");
@@ -348,10 +1400,12 @@ obtain_total_laps ()
 				     (ne_block_reader) parse_number_body, &total_laps);
 
 	/* Dispatch the request */
-	ne_request_dispatch (req);
+	ok = ! dispatch_request (req);
+
+	record_number (RECORD_TOTAL_LAPS, total_laps);
 
 	ne_request_destroy (req);
-	ne_session_destroy (sess);
+	put_session (WEBSERVICE_HOST, sess, ok);
 
 	return total_laps;
 }
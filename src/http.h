@@ -23,14 +23,28 @@
 #include "live-f1.h"
 
 
+/* URLs of the key frames and keys on the live-timing site, which the
+ * relay serves too */
+#define KEY_URL_BASE        "/reg/getkey/"
+#define KEYFRAME_URL_PREFIX "/keyframe"
+
+
 SJR_BEGIN_EXTERN
 
 char *       obtain_auth_cookie    (const char *host,
 				    const char *email, const char *password);
-unsigned int obtain_decryption_key (const char *host, unsigned int event_no,
-				    const char *cookie);
-int          obtain_key_frame      (const char *host, unsigned int frame,
-				    void *unknown);
+void         start_login           (CurrentState *state);
+const char * finish_login          (CurrentState *state);
+unsigned int obtain_decryption_key (CurrentState *state,
+				    unsigned int event_no);
+void         renew_decryption_key  (CurrentState *state);
+int          fetch_key_frame       (CurrentState *state, unsigned int frame);
+int          finish_key_frame      (CurrentState *state, int wait);
+int          prefetch_key_frame    (CurrentState *state, unsigned int frame);
+int          fetch_page            (const char *host, const char *path,
+				    unsigned char **buf, size_t *len);
+void         set_cache_dir         (const char *dir);
+unsigned int obtain_total_laps     (void);
 
 SJR_END_EXTERN
 
@@ -0,0 +1,643 @@
+/* live-f1
+ *
+ * keyrec.c - recovery of decryption keys from captured data streams
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "record.h"
+#include "stream.h"
+#include "keyrec.h"
+
+
+/* Number of keys tested side by side; the inner loop is written so the
+ * compiler can turn each step into a handful of vector instructions.
+ */
+#define KEYREC_LANES 16
+
+/* Number of keys each thread takes from the key space at once */
+#define KEYREC_CHUNK (1ULL << 24)
+
+/* Most known bytes we keep for each segment */
+#define KEYREC_MAX_KNOWN 256
+
+/* Bits of known plaintext a segment needs before we stop looking for
+ * one that starts earlier; 32 for the key plus a safety margin.
+ */
+#define KEYREC_ENOUGH_BITS 64.0
+
+
+/**
+ * KnownByte:
+ * @offset: position in the keystream,
+ * @cipher: encrypted byte,
+ * @lo: lowest plaintext value allowed,
+ * @span: number of plaintext values allowed.
+ *
+ * Byte of the encrypted stream for which we know roughly what the
+ * plaintext must be; e.g. the digits of a car's position.
+ **/
+typedef struct {
+	unsigned int  offset;
+	unsigned char cipher, lo, span;
+} KnownByte;
+
+/**
+ * Segment:
+ * @known: array of known bytes in keystream order,
+ * @len: number of entries in @known,
+ * @bits: amount of information in @known, in bits,
+ * @pos: current position in the keystream.
+ *
+ * Part of the data stream or a key frame between two salt resets.
+ **/
+typedef struct {
+	KnownByte known[KEYREC_MAX_KNOWN];
+	size_t    len;
+	double    bits;
+	size_t    pos;
+} Segment;
+
+/**
+ * Framer:
+ * @pbuf: partial packet,
+ * @pbuf_len: length of @pbuf,
+ * @seg: current segment.
+ *
+ * Splits the data stream or a key frame into packets without
+ * decrypting them, collecting the known bytes of each segment.
+ **/
+typedef struct {
+	unsigned char pbuf[129];
+	size_t        pbuf_len;
+	Segment       seg;
+} Framer;
+
+/**
+ * EventKey:
+ * @event_no: event number,
+ * @best: best segment found for the event,
+ * @have_best: whether @best is filled.
+ **/
+typedef struct {
+	unsigned int event_no;
+	Segment      best;
+	int          have_best;
+} EventKey;
+
+/**
+ * Search:
+ * @seg: segment to test keys against,
+ * @next_chunk: next chunk of the key space to be searched,
+ * @found: keys found,
+ * @nfound: number of keys in @found,
+ * @lock: protects @found and progress output.
+ *
+ * Shared by all of the search threads.
+ **/
+typedef struct {
+	const Segment      *seg;
+	unsigned long long  next_chunk;
+	unsigned int        found[16];
+	int                 nfound;
+	pthread_mutex_t     lock;
+} Search;
+
+
+/* Forward prototypes */
+static void   feed_framer    (Framer *framer, const unsigned char *buf,
+			      size_t len);
+static void   handle_packet  (Framer *framer, const Packet *packet,
+			      const unsigned char *payload, int decrypt);
+static void   add_known      (Segment *seg, const unsigned char *payload,
+			      int start, int len, unsigned char lo,
+			      unsigned char hi);
+static void   end_segment    (Framer *framer);
+static void   search_key     (EventKey *event);
+static void  *search_thread  (void *data);
+static void   search_chunk   (Search *search, unsigned int first,
+			      unsigned long long count);
+
+
+/* Events seen so far, and the current one */
+static EventKey *events = NULL;
+static size_t    nevents = 0;
+static int       current_event = -1;
+
+
+/**
+ * recover_key:
+ * @filename: capture file to search.
+ *
+ * Recovers the decryption key for each event in the capture file by
+ * brute force.  The packet headers are never encrypted, so we can split
+ * the data into packets and tell which bytes of the keystream each
+ * payload was xor'd with; and many payloads, like car positions, can
+ * only contain a few possible characters.
+ *
+ * We pick the part of the capture with the most such known plaintext
+ * nearest the start of a salt reset, and test every key against it
+ * using all of the available processors; almost every wrong key fails
+ * on the first byte or two.
+ *
+ * Returns: 0 if a key was found for every event, non-zero otherwise.
+ **/
+int
+recover_key (const char *filename)
+{
+	const unsigned char *map, *buf;
+	struct stat          statbuf;
+	size_t               buf_len, i;
+	CaptureRecord        record;
+	Framer              *stream, *key_frame;
+	int                  fd, ret = 0;
+
+	fd = open (filename, O_RDONLY);
+	if ((fd < 0) || (fstat (fd, &statbuf) < 0)) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	map = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	if ((statbuf.st_size < CAPTURE_HEADER_LEN)
+	    || memcmp (map, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 _("not a capture file"));
+		munmap ((void *) map, statbuf.st_size);
+		return 1;
+	}
+
+	stream = calloc (1, sizeof (Framer));
+	key_frame = calloc (1, sizeof (Framer));
+	if ((! stream) || (! key_frame))
+		abort ();
+
+	buf = map + CAPTURE_HEADER_LEN;
+	buf_len = statbuf.st_size - CAPTURE_HEADER_LEN;
+	while (parse_record (&buf, &buf_len, &record) > 0) {
+		switch (record.type) {
+		case RECORD_STREAM:
+			feed_framer (stream, record.data, record.len);
+			break;
+		case RECORD_KEY_FRAME_BEGIN:
+		case RECORD_KEY_FRAME_END:
+			end_segment (key_frame);
+			key_frame->pbuf_len = 0;
+			break;
+		case RECORD_KEY_FRAME:
+			feed_framer (key_frame, record.data, record.len);
+			break;
+		default:
+			break;
+		}
+	}
+	end_segment (stream);
+	end_segment (key_frame);
+
+	munmap ((void *) map, statbuf.st_size);
+	free (stream);
+	free (key_frame);
+
+	if (! nevents) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 _("no events found in capture"));
+		return 1;
+	}
+
+	for (i = 0; i < nevents; i++) {
+		if (! events[i].have_best) {
+			fprintf (stderr, "%s: %s %u\n", program_name,
+				 _("not enough known data for event"),
+				 events[i].event_no);
+			ret = 1;
+			continue;
+		}
+
+		search_key (&events[i]);
+	}
+
+	free (events);
+	events = NULL;
+	nevents = 0;
+	current_event = -1;
+
+	return ret;
+}
+
+
+/**
+ * feed_framer:
+ * @framer: framer to feed,
+ * @buf: data to add,
+ * @len: length of @buf.
+ *
+ * Splits @buf into packets in the same way as next_packet(), but
+ * without decrypting them, and handles each complete one.
+ **/
+static void
+feed_framer (Framer              *framer,
+	     const unsigned char *buf,
+	     size_t               len)
+{
+	while (len) {
+		Packet packet;
+		size_t needed;
+		int    decrypt;
+
+		if (framer->pbuf_len < 2) {
+			needed = MIN (len, 2 - framer->pbuf_len);
+			memcpy (framer->pbuf + framer->pbuf_len, buf, needed);
+			framer->pbuf_len += needed;
+			buf += needed;
+			len -= needed;
+
+			if (framer->pbuf_len < 2)
+				return;
+		}
+
+		decrypt = packet_header (framer->pbuf, &packet);
+		if (packet.len > 0) {
+			needed = MIN (len, (packet.len + 2) - framer->pbuf_len);
+			memcpy (framer->pbuf + framer->pbuf_len, buf, needed);
+			framer->pbuf_len += needed;
+			buf += needed;
+			len -= needed;
+
+			if (framer->pbuf_len < (packet.len + 2))
+				return;
+		}
+
+		framer->pbuf_len = 0;
+		handle_packet (framer, &packet, framer->pbuf + 2, decrypt);
+	}
+}
+
+/**
+ * handle_packet:
+ * @framer: framer the packet came from,
+ * @packet: decoded packet header,
+ * @payload: encrypted payload,
+ * @decrypt: whether @payload is encrypted.
+ *
+ * Records what we know about the plaintext of each encrypted payload,
+ * and follows the event and salt resets in the same way as
+ * handle_system_packet().
+ **/
+static void
+handle_packet (Framer              *framer,
+	       const Packet        *packet,
+	       const unsigned char *payload,
+	       int                  decrypt)
+{
+	Segment *seg = &framer->seg;
+
+	if ((! packet->car) && (packet->type == SYS_EVENT_ID)) {
+		unsigned int number = 0;
+		int          i;
+
+		for (i = 1; i < packet->len; i++) {
+			number *= 10;
+			number += payload[i] - '0';
+		}
+
+		end_segment (framer);
+
+		for (current_event = 0; current_event < nevents;
+		     current_event++)
+			if (events[current_event].event_no == number)
+				break;
+
+		if (current_event == nevents) {
+			events = realloc (events,
+					  sizeof (EventKey) * (nevents + 1));
+			if (! events)
+				abort ();
+
+			memset (&events[nevents], 0, sizeof (EventKey));
+			events[nevents++].event_no = number;
+		}
+		return;
+	} else if ((! packet->car) && (packet->type == SYS_KEY_FRAME)) {
+		end_segment (framer);
+		return;
+	}
+
+	if ((! decrypt) || (packet->len <= 0))
+		return;
+
+	if (packet->car) {
+		switch (packet->type) {
+		case RACE_POSITION:
+			/* Position, as checked by handle_car_packet() */
+			if (packet->len <= 2) {
+				add_known (seg, payload, 0, 1, '1', '9');
+				add_known (seg, payload, 1, packet->len - 1,
+					   '0', '9');
+			}
+			break;
+		case RACE_NUMBER:
+			/* Car number */
+			if (packet->len <= 2)
+				add_known (seg, payload, 0, packet->len,
+					   '0', '9');
+			break;
+		case CAR_POSITION_HISTORY:
+			break;
+		default:
+			/* Names and times are all printable ASCII */
+			add_known (seg, payload, 0, packet->len, ' ', '~');
+			break;
+		}
+	} else if (packet->type == SYS_WEATHER) {
+		/* Digits, with '-', '.' and ':' */
+		add_known (seg, payload, 0, packet->len, '-', ':');
+	} else if (packet->type == SYS_TRACK_STATUS) {
+		add_known (seg, payload, 0, packet->len, '0', '9');
+	}
+
+	seg->pos += packet->len;
+}
+
+/**
+ * add_known:
+ * @seg: segment to add to,
+ * @payload: encrypted payload,
+ * @start: first byte of @payload to add,
+ * @len: number of bytes to add,
+ * @lo: lowest plaintext character allowed,
+ * @hi: highest plaintext character allowed.
+ *
+ * Adds @len bytes of @payload from @start to the known bytes of @seg,
+ * each of which must decrypt to a character between @lo and @hi;
+ * @payload must be at the current position of the segment.
+ **/
+static void
+add_known (Segment             *seg,
+	   const unsigned char *payload,
+	   int                  start,
+	   int                  len,
+	   unsigned char        lo,
+	   unsigned char        hi)
+{
+	int i;
+
+	for (i = start; (i < start + len) && (seg->len < KEYREC_MAX_KNOWN); i++) {
+		KnownByte *known = &seg->known[seg->len++];
+
+		known->offset = seg->pos + i;
+		known->cipher = payload[i];
+		known->lo = lo;
+		known->span = hi - lo + 1;
+
+		seg->bits += 8.0 - (31 - __builtin_clz (known->span));
+	}
+}
+
+/**
+ * end_segment:
+ * @framer: framer to end the segment of.
+ *
+ * Called when the salt is reset; keeps the current segment if it's the
+ * best one we've seen for the event, and starts a new one.
+ *
+ * The cost of the search is dominated by the steps of the salt needed
+ * to reach the first known byte, so we prefer the segment whose known
+ * bytes start earliest out of those with enough of them.
+ **/
+static void
+end_segment (Framer *framer)
+{
+	Segment  *seg = &framer->seg;
+	EventKey *event;
+
+	if ((current_event >= 0) && seg->len) {
+		int better;
+
+		event = &events[current_event];
+		if (! event->have_best) {
+			better = 1;
+		} else if (seg->bits < KEYREC_ENOUGH_BITS) {
+			better = (seg->bits > event->best.bits);
+		} else if (event->best.bits < KEYREC_ENOUGH_BITS) {
+			better = 1;
+		} else {
+			better = (seg->known[0].offset
+				  < event->best.known[0].offset);
+		}
+
+		if (better) {
+			event->best = *seg;
+			event->have_best = 1;
+		}
+	}
+
+	memset (seg, 0, sizeof (Segment));
+}
+
+/**
+ * search_key:
+ * @event: event to find the key for.
+ *
+ * Searches the whole key space for keys that decrypt the best segment
+ * of @event to the plaintext we expect, with one thread per processor,
+ * and prints the keys found.
+ **/
+static void
+search_key (EventKey *event)
+{
+	pthread_t      *threads;
+	Search          search;
+	struct timespec start, end;
+	long            i, nthreads;
+
+	nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	info (1, _("Searching for key for event %u using %ld threads "
+		   "(%zu known bytes, %.0f bits, first at %u) ...\n"),
+	      event->event_no, nthreads, event->best.len, event->best.bits,
+	      event->best.known[0].offset);
+
+	if (event->best.bits < 32.0)
+		fprintf (stderr, "%s: %s %u\n", program_name,
+			 _("too little known data, expect false keys for event"),
+			 event->event_no);
+
+	memset (&search, 0, sizeof (search));
+	search.seg = &event->best;
+	pthread_mutex_init (&search.lock, NULL);
+
+	threads = malloc (sizeof (pthread_t) * nthreads);
+	if (! threads)
+		abort ();
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create (&threads[i], NULL, search_thread, &search))
+			break;
+	nthreads = i;
+	if (! nthreads)
+		search_thread (&search);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join (threads[i], NULL);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	info (1, _("Searched key space in %.1f seconds\n"),
+	      (end.tv_sec - start.tv_sec)
+	      + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+	if (! search.nfound)
+		fprintf (stderr, "%s: %s %u\n", program_name,
+			 _("no key found for event"), event->event_no);
+
+	for (i = 0; i < search.nfound; i++)
+		printf (_("Event %u: key %08x\n"), event->event_no,
+			search.found[i]);
+
+	pthread_mutex_destroy (&search.lock);
+	free (threads);
+}
+
+/**
+ * search_thread:
+ * @data: shared search structure.
+ *
+ * Takes chunks of the key space and searches them until none are left.
+ *
+ * Returns: NULL.
+ **/
+static void *
+search_thread (void *data)
+{
+	Search             *search = data;
+	unsigned long long  nchunks = (1ULL << 32) / KEYREC_CHUNK;
+
+	for (;;) {
+		unsigned long long chunk;
+
+		chunk = __sync_fetch_and_add (&search->next_chunk, 1);
+		if (chunk >= nchunks)
+			break;
+
+		search_chunk (search, chunk * KEYREC_CHUNK, KEYREC_CHUNK);
+
+		if ((chunk + 1) % (nchunks / 16) == 0) {
+			pthread_mutex_lock (&search->lock);
+			info (2, _("%llu%% of key space searched\n"),
+			      (chunk + 1) * 100 / nchunks);
+			pthread_mutex_unlock (&search->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * search_chunk:
+ * @search: shared search structure,
+ * @first: first key to test,
+ * @count: number of keys to test.
+ *
+ * Tests KEYREC_LANES keys at a time against the known bytes of the
+ * segment, stepping each salt in lockstep.  This is the same shift and
+ * xor as decrypt_bytes(), written without branches so that it
+ * vectorises; the lanes are abandoned together as soon as none of them
+ * can be right.
+ **/
+static void
+search_chunk (Search             *search,
+	      unsigned int        first,
+	      unsigned long long  count)
+{
+	const Segment *seg = search->seg;
+	unsigned int   key[KEYREC_LANES], salt[KEYREC_LANES];
+	unsigned int   alive[KEYREC_LANES];
+	unsigned long long n;
+	int            l;
+
+	for (n = 0; n < count; n += KEYREC_LANES) {
+		unsigned int pos = 0, any = 1;
+		size_t       k;
+
+		for (l = 0; l < KEYREC_LANES; l++) {
+			key[l] = first + n + l;
+			salt[l] = CRYPTO_SEED;
+			alive[l] = (key[l] != 0);
+		}
+
+		for (k = 0; any && (k < seg->len); k++) {
+			const KnownByte *known = &seg->known[k];
+
+			/* Each byte is xor'd with the salt after stepping */
+			while (pos <= known->offset) {
+				for (l = 0; l < KEYREC_LANES; l++)
+					salt[l] = ((salt[l] >> 1)
+						   ^ (key[l] & -(salt[l] & 1)));
+				pos++;
+			}
+
+			any = 0;
+			for (l = 0; l < KEYREC_LANES; l++) {
+				unsigned char plain;
+
+				plain = (salt[l] ^ known->cipher) - known->lo;
+				alive[l] &= (plain < known->span);
+				any |= alive[l];
+			}
+		}
+
+		if (! any)
+			continue;
+
+		pthread_mutex_lock (&search->lock);
+		for (l = 0; l < KEYREC_LANES; l++) {
+			if (alive[l] && (search->nfound < 16))
+				search->found[search->nfound++] = key[l];
+		}
+		pthread_mutex_unlock (&search->lock);
+	}
+}
@@ -0,0 +1,186 @@
+/* live-f1
+ *
+ * live-f1-shm.h - layout of the timing board published in shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_SHM_H
+#define LIVE_F1_SHM_H
+
+/* This header stands alone, so that other programs can read the board
+ * live-f1 publishes with --shm.  Map the POSIX shared memory object
+ * read-only, check the magic, version and size, then read it between
+ * live_f1_shm_begin() and live_f1_shm_retry():
+ *
+ *	do {
+ *		seq = live_f1_shm_begin (shm);
+ *		laps = shm->laps_completed;
+ *		...
+ *	} while (live_f1_shm_retry (shm, seq));
+ *
+ * Nothing read inside the loop may be trusted until it ends, since
+ * live-f1 never waits for readers and may be rewriting the board
+ * meanwhile; the loop then runs again.
+ */
+
+#include <stdint.h>
+
+
+/* Default name of the shared memory object */
+#define LIVE_F1_SHM_NAME "/live-f1"
+
+/* Identifies the object, and the version of the layout below */
+#define LIVE_F1_SHM_MAGIC   0x5331464cU /* "LF1S" */
+#define LIVE_F1_SHM_VERSION 2
+
+/* Number of cars there's room for; car numbers in the data stream are
+ * five bits, and never zero */
+#define LIVE_F1_SHM_CARS 31
+
+/* Number of atoms for each car, indexed by packet type; which are used
+ * depends on the event type, see packet.h */
+#define LIVE_F1_SHM_ATOMS 16
+
+
+/* Types of value parsed from the text of an atom */
+#define LIVE_F1_SHM_VALUE_NONE    0
+#define LIVE_F1_SHM_VALUE_NUMBER  1 /* whole number */
+#define LIVE_F1_SHM_VALUE_TIME    2 /* time or gap, in milliseconds */
+#define LIVE_F1_SHM_VALUE_LAPS    3 /* gap in laps */
+#define LIVE_F1_SHM_VALUE_PIT     4 /* in or leaving the pits */
+#define LIVE_F1_SHM_VALUE_STOPPED 5 /* stopped or retired */
+
+
+/**
+ * LiveF1ShmAtom:
+ * @data: colour the atom is displayed in,
+ * @text: content of the atom, NUL-terminated,
+ * @type: LIVE_F1_SHM_VALUE_* type of value in @text,
+ * @value: value in @text.
+ *
+ * One piece of information about a car; its text is parsed once, by
+ * live-f1, so that times can be compared without parsing them again.
+ **/
+typedef struct {
+	int32_t data;
+	char    text[16];
+	int32_t type;
+	int32_t value;
+} LiveF1ShmAtom;
+
+/**
+ * LiveF1ShmCar:
+ * @position: position of the car, or zero if it has none,
+ * @atoms: information about the car.
+ *
+ * Everything known about one car.
+ **/
+typedef struct {
+	int32_t       position;
+	LiveF1ShmAtom atoms[LIVE_F1_SHM_ATOMS];
+} LiveF1ShmCar;
+
+/**
+ * LiveF1Shm:
+ * @magic: LIVE_F1_SHM_MAGIC,
+ * @version: LIVE_F1_SHM_VERSION,
+ * @size: size of this structure,
+ * @seq: odd while the board is being written, changes with each write,
+ * @updates: number of times the board has been written,
+ * @event_no: event number,
+ * @event_type: 1 for a race, 2 for practice, 3 for qualifying,
+ * @flag: 1 green, 2 yellow, 3 safety car standby, 4 safety car
+ *        deployed, 5 red,
+ * @frame: latest key frame number,
+ * @remaining_time: seconds of the session remaining at @epoch_time,
+ * @epoch_time: time @remaining_time was set, or zero if the clock is
+ *              stopped,
+ * @laps_completed: laps completed in a race,
+ * @total_laps: laps in a race, or zero if unknown,
+ * @track_temp: track temperature (degrees C),
+ * @air_temp: air temperature (degrees C),
+ * @humidity: humidity (percentage),
+ * @wind_speed: wind speed (meters per second),
+ * @wind_direction: wind direction (destination in degrees),
+ * @pressure: barometric pressure (millibars),
+ * @fl_car: car number of the fastest lap,
+ * @fl_driver: driver of the fastest lap,
+ * @fl_time: time of the fastest lap,
+ * @fl_lap: lap number of the fastest lap,
+ * @num_cars: number of cars in the event,
+ * @cars: cars by car number, less one.
+ *
+ * Layout of the shared memory object.  All strings are NUL-terminated.
+ **/
+typedef struct {
+	uint32_t     magic, version, size;
+	uint32_t     seq;
+	uint64_t     updates;
+
+	uint32_t     event_no, event_type, flag, frame;
+	int64_t      remaining_time, epoch_time;
+	uint32_t     laps_completed, total_laps;
+
+	int32_t      track_temp, air_temp, humidity;
+	int32_t      wind_speed, wind_direction, pressure;
+
+	char         fl_car[4], fl_driver[16], fl_time[16], fl_lap[4];
+
+	uint32_t     num_cars;
+	LiveF1ShmCar cars[LIVE_F1_SHM_CARS];
+} LiveF1Shm;
+
+
+/**
+ * live_f1_shm_begin:
+ * @shm: mapped shared memory object.
+ *
+ * Waits for live-f1 to finish any write in progress, which it does
+ * without ever sleeping, before the board is read.
+ *
+ * Returns: sequence number to pass to live_f1_shm_retry().
+ **/
+static inline uint32_t
+live_f1_shm_begin (const LiveF1Shm *shm)
+{
+	uint32_t seq;
+
+	while ((seq = __atomic_load_n (&shm->seq, __ATOMIC_ACQUIRE)) & 1)
+		;
+
+	return seq;
+}
+
+/**
+ * live_f1_shm_retry:
+ * @shm: mapped shared memory object,
+ * @seq: sequence number returned by live_f1_shm_begin().
+ *
+ * Returns: non-zero if the board was rewritten while it was being read,
+ * and must be read again.
+ **/
+static inline int
+live_f1_shm_retry (const LiveF1Shm *shm,
+		   uint32_t         seq)
+{
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n (&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+#endif /* LIVE_F1_SHM_H */
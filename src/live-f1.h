@@ -62,20 +62,97 @@ typedef enum {
 } FlagStatus;
 
 
+/* Number of cars the data stream can address; car numbers are five bits,
+ * and never zero */
+#define MAX_CARS 31
+
+/* Number of atoms held for each car, one for each type of car packet */
+#define CAR_ATOMS 16
+
+
+/**
+ * ValueType:
+ *
+ * Type of value parsed from the text of an atom; see parse_value().
+ **/
+typedef enum {
+	VALUE_NONE = 0,
+	VALUE_NUMBER = 1,
+	VALUE_TIME = 2,
+	VALUE_LAPS = 3,
+	VALUE_PIT = 4,
+	VALUE_STOPPED = 5
+} ValueType;
+
+
 /**
  * CarAtom:
  * @data: data associated with atom,
- * @text: content of atom.
+ * @text: content of atom,
+ * @type: type of value in @text,
+ * @value: number in @text, time in milliseconds or laps down.
  *
  * Used to hold the current information about a car, there is one CarAtom
  * for each car for each possible packet type that can be received from
- * the server.
+ * the server.  The text is parsed once, when it's received, so that the
+ * value can be used without parsing it again.
  **/
 typedef struct {
-	int  data;
-	char text[16];
+	int       data;
+	char      text[16];
+	ValueType type;
+	int       value;
 } CarAtom;
 
+/**
+ * CarArena:
+ * @car_position: current position of each car,
+ * @car_info: information about each car.
+ *
+ * Everything known about the cars in an event, in one allocation made
+ * when the first car appears and freed in one go when the event ends;
+ * it has room for every car the data stream can address, so it never
+ * has to grow.
+ **/
+typedef struct {
+	int     car_position[MAX_CARS];
+	CarAtom car_info[MAX_CARS][CAR_ATOMS];
+} CarArena;
+
+/**
+ * StreamParser:
+ * @key: decryption key for the stream,
+ * @salt_pos: bytes decrypted since the salt was last reset,
+ * @pbuf: packet that crossed the end of the last block,
+ * @pbuf_len: length of @pbuf,
+ * @key_frame: key frame being downloaded, if any,
+ * @queue: data received while waiting for @key_frame,
+ * @queue_len: length of @queue,
+ * @queue_size: allocated size of @queue,
+ * @keystreams: keystreams generated for recent keys, or NULL,
+ * @recv_buf: buffer the data stream is read into,
+ * @recv_size: allocated size of @recv_buf.
+ *
+ * Everything needed to decode one data stream, so that any number can
+ * be decoded at once on different threads.  Key frames are parsed with
+ * their own, so they can't disturb the stream they arrive in, though
+ * they borrow its keystreams.
+ **/
+typedef struct {
+	unsigned int   key;
+	size_t         salt_pos;
+	unsigned char  pbuf[129];
+	size_t         pbuf_len;
+
+	void          *key_frame;
+	unsigned char *queue;
+	size_t         queue_len, queue_size;
+
+	void          *keystreams;
+	unsigned char *recv_buf;
+	size_t         recv_size;
+} StreamParser;
+
 /**
  * CurrentState:
  * @host: hostname to contact,
@@ -83,10 +160,10 @@ typedef struct {
  * @email: user's e-mail address,
  * @password: user's password,
  * @cookie: user's authorisation cookie,
- * @key: decryption key,
- * @salt: current decryption salt,
+ * @parser: data stream being decoded,
  * @decryption_failure: indicates if payload decryption has failed (0=no,1=yes),
  * @frame: last seen key frame,
+ * @refresh_rate: time between updates announced by the server (msecs),
  * @event_no: event number,
  * @event_type: event type,
  * @remaining_time: time remaining for the event,
@@ -105,9 +182,10 @@ typedef struct {
  * @fl_driver: fastest lap (driver's name),
  * @fl_time: fastest lap (lap time),
  * @fl_lap: fastest lap (lap number),
- * @num_cars: number of cars in the event,
- * @car_position: current position of car,
- * @car_info: arrays of information about each car.
+ * @num_cars: highest car number seen in the event,
+ * @cars: arena holding @car_position and @car_info, or NULL,
+ * @car_position: current position of each car,
+ * @car_info: information about each car.
  *
  * Holds the current application state so we don't need to pass around
  * a lot of variables or keep them globally.
@@ -115,9 +193,10 @@ typedef struct {
 typedef struct {
 	char          *host, *auth_host;
 	char          *email, *password, *cookie;
-	unsigned int   key, salt;
+	StreamParser  *parser;
 	int            decryption_failure;
 	unsigned int   frame;
+	unsigned int   refresh_rate;
 
 	unsigned int   event_no;
 	EventType      event_type;
@@ -131,15 +210,16 @@ typedef struct {
 	char          *fl_car, *fl_driver, *fl_time, *fl_lap;
 	
 	int            num_cars;
+	CarArena      *cars;
 	int           *car_position;
-	CarAtom      **car_info;
+	CarAtom      (*car_info)[CAR_ATOMS];
 } CurrentState;
 
 
 SJR_BEGIN_EXTERN
 
 /* Program's name */
-const char *program_name;
+extern const char *program_name;
 
 
 int info (int irrelevance, const char *format, ...);
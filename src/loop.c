@@ -0,0 +1,656 @@
+/* live-f1
+ *
+ * loop.c - wait for the data stream, the keyboard and timers at once
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "http.h"
+#include "record.h"
+#include "render.h"
+#include "shm.h"
+#include "stats.h"
+#include "stream.h"
+#include "loop.h"
+
+
+/**
+ * EventSource:
+ *
+ * Things the event loop waits for, stored in the epoll event data.
+ **/
+typedef enum {
+	SOURCE_STREAM,
+	SOURCE_KEYS,
+	SOURCE_WAKE,
+	SOURCE_PING,
+	SOURCE_CLOCK,
+	SOURCE_FRAME,
+	SOURCE_SIGNAL,
+} EventSource;
+
+/**
+ * BurstStats:
+ * @bursts: number of bursts read from the data stream,
+ * @bytes: sum of their lengths,
+ * @reads: sum of the reads it took to drain them,
+ * @largest: length of the largest of them,
+ * @timed: number of them whose latency was measured,
+ * @total: sum of their latencies (nsecs),
+ * @worst: worst of their latencies (nsecs).
+ *
+ * How much data each wakeup for the data stream brings, and the time
+ * taken from it arriving from the server to it being parsed.
+ **/
+typedef struct {
+	unsigned long      bursts;
+	unsigned long long bytes, reads;
+	size_t             largest;
+
+	unsigned long      timed;
+	unsigned long long total, worst;
+} BurstStats;
+
+
+/**
+ * PingSchedule:
+ * @interval: time between updates the server asked for (msecs),
+ * @rtt: smoothed time from a ping to the data it brings (msecs),
+ * @last_ping: time we last pinged the server (msecs),
+ * @last_heard: time we last heard from the server (msecs),
+ * @waiting: whether the last ping is yet to be answered,
+ * @misses: number of pings in a row that went unanswered,
+ * @pings: number of pings sent,
+ * @answered: number of them answered,
+ * @rtt_total: sum of the round-trip times of those answered (msecs),
+ * @last_answer: time the last ping was answered (msecs),
+ * @gap_total: sum of the times between answers (msecs),
+ * @gaps: number of times summed into @gap_total.
+ *
+ * What the ping policy knows of the server, and how it's doing.
+ **/
+typedef struct {
+	unsigned long long interval, rtt;
+	unsigned long long last_ping, last_heard;
+	int                waiting, misses;
+
+	unsigned long      pings, answered;
+	unsigned long long rtt_total;
+	unsigned long long last_answer, gap_total;
+	unsigned long      gaps;
+} PingSchedule;
+
+/**
+ * PingPolicy:
+ * @name: name given to --ping,
+ * @next_ping: returns when the server should next be pinged (msecs).
+ *
+ * Decides when to ping the server, which only sends us data when it's
+ * been pinged.
+ **/
+typedef struct {
+	const char         *name;
+	unsigned long long (*next_ping) (const PingSchedule *sched);
+} PingPolicy;
+
+
+/* Forward prototypes */
+static unsigned long long adaptive_ping   (const PingSchedule *sched);
+static unsigned long long quiet_ping      (const PingSchedule *sched);
+static void               heard_server    (PingSchedule *sched,
+					   unsigned long long now);
+static int                watch_fd        (int epfd, int fd,
+					   EventSource source);
+static int                arm_timer       (int fd, clockid_t clock,
+					   unsigned long long when,
+					   unsigned long long interval);
+static void               drain_fd        (int fd);
+static void               note_burst      (const StreamBurst *burst);
+static unsigned long long monotonic_msecs (void);
+
+
+/* eventfd worker threads write to, to wake the loop */
+static int wake_fd = -1;
+
+/* signalfd for the signals that stop us, once they're caught */
+static int signal_fd = -1;
+
+/* Bursts of the data stream since we connected */
+static BurstStats stats;
+
+/* Ways of deciding when to ping, the first is the default */
+static const PingPolicy ping_policies[] = {
+	{ "adaptive", adaptive_ping },
+	{ "quiet",    quiet_ping },
+	{ NULL,       NULL },
+};
+
+/* Policy in use */
+static const PingPolicy *ping_policy = &ping_policies[0];
+
+
+/**
+ * run_event_loop:
+ * @state: application state structure,
+ * @sock: data stream socket.
+ *
+ * Waits for, and handles, data from the stream, keys pressed by the
+ * user and key frames being downloaded, along with timers that ping
+ * the server when the ping policy says so, tick the session clock on
+ * the second and draw changes when the next frame is due.  Nothing
+ * wakes us otherwise.  A signal caught by catch_signals() is taken as
+ * the user quitting.
+ *
+ * Returns: 0 if the socket closed, > 0 if the user quit, < 0 on error.
+ **/
+int
+run_event_loop (CurrentState *state,
+		int           sock)
+{
+	struct epoll_event  events[8];
+	struct timespec     now;
+	StreamBurst         burst;
+	PingSchedule        sched;
+	unsigned long long  ping_at, when;
+	int                 epfd, ping_fd, clock_fd, frame_fd;
+	int                 keys = FALSE, ret = 0, delay, nevents, i;
+	int                 parsed;
+
+	if (wake_fd < 0)
+		wake_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	ping_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	clock_fd = timerfd_create (CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+	frame_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if ((wake_fd < 0) || (epfd < 0) || (ping_fd < 0) || (clock_fd < 0)
+	    || (frame_fd < 0)) {
+		ret = -1;
+		goto finished;
+	}
+
+	if (watch_fd (epfd, sock, SOURCE_STREAM)
+	    || watch_fd (epfd, wake_fd, SOURCE_WAKE)
+	    || watch_fd (epfd, ping_fd, SOURCE_PING)
+	    || watch_fd (epfd, clock_fd, SOURCE_CLOCK)
+	    || watch_fd (epfd, frame_fd, SOURCE_FRAME)
+	    || ((signal_fd >= 0)
+		&& watch_fd (epfd, signal_fd, SOURCE_SIGNAL))) {
+		ret = -1;
+		goto finished;
+	}
+
+	memset (&stats, 0, sizeof (stats));
+	memset (&sched, 0, sizeof (sched));
+
+	/* The clock ticks on the second */
+	clock_gettime (CLOCK_REALTIME, &now);
+	arm_timer (clock_fd, CLOCK_REALTIME, (now.tv_sec + 1) * 1000ULL, 1000);
+
+	sched.interval = PING_INTERVAL;
+	sched.last_heard = sched.last_ping = monotonic_msecs ();
+	ping_at = ping_policy->next_ping (&sched);
+	arm_timer (ping_fd, CLOCK_MONOTONIC, ping_at, 0);
+
+	for (;;) {
+		/* Only once the display is open are the keys for us, and
+		 * not even then if it's drawn by the render thread */
+		if ((! rendering) && cursed && (! keys)) {
+			if (watch_fd (epfd, STDIN_FILENO, SOURCE_KEYS)) {
+				ret = -1;
+				goto finished;
+			}
+			keys = TRUE;
+		}
+
+		nevents = epoll_wait (epfd, events, 8, -1);
+		if (nevents < 0) {
+			if (errno != EINTR) {
+				ret = -1;
+				goto finished;
+			}
+
+			/* Probably SIGWINCH, which curses turns into a key */
+			if (handle_keys (state) < 0) {
+				ret = 1;
+				goto finished;
+			}
+
+			nevents = 0;
+		}
+
+		parsed = FALSE;
+		for (i = 0; i < nevents; i++) {
+			switch ((EventSource) events[i].data.u32) {
+			case SOURCE_STREAM:
+				ret = read_stream (state, sock, &burst);
+				if (burst.len) {
+					parsed = TRUE;
+					note_burst (&burst);
+					heard_server (&sched, monotonic_msecs ());
+				}
+				if (ret <= 0)
+					goto finished;
+				break;
+			case SOURCE_KEYS:
+				if (handle_keys (state) < 0) {
+					ret = 1;
+					goto finished;
+				}
+				break;
+			case SOURCE_WAKE:
+				drain_fd (wake_fd);
+
+				/* The render thread wakes us when the user quits */
+				if (handle_keys (state) < 0) {
+					ret = 1;
+					goto finished;
+				}
+				break;
+			case SOURCE_PING:
+				drain_fd (ping_fd);
+				ping_at = 0;
+
+				/* May have heard from the server since */
+				if (monotonic_msecs ()
+				    < ping_policy->next_ping (&sched))
+					break;
+
+				ret = ping_stream (sock);
+				if (ret <= 0)
+					goto finished;
+
+				if (sched.waiting)
+					sched.misses++;
+				sched.waiting = TRUE;
+				sched.last_ping = monotonic_msecs ();
+				sched.pings++;
+				break;
+			case SOURCE_CLOCK:
+				drain_fd (clock_fd);
+				update_time (state);
+				tick_recording ();
+				dump_stats (FALSE);
+				break;
+			case SOURCE_FRAME:
+				drain_fd (frame_fd);
+				break;
+			case SOURCE_SIGNAL:
+				if (caught_signal ()) {
+					ret = 1;
+					goto finished;
+				}
+				break;
+			}
+		}
+
+		if (finish_key_frame (state, FALSE))
+			parsed = TRUE;
+		flush_display (state);
+		if (parsed)
+			publish_shm (state);
+
+		/* Having heard from the server may bring the ping forwards */
+		sched.interval = (state->refresh_rate ? state->refresh_rate
+				  : PING_INTERVAL);
+		when = ping_policy->next_ping (&sched);
+		if ((! ping_at) || (when < ping_at)) {
+			ping_at = when;
+			arm_timer (ping_fd, CLOCK_MONOTONIC, ping_at, 0);
+		}
+
+		delay = frame_delay ();
+		if (delay > 0)
+			arm_timer (frame_fd, CLOCK_MONOTONIC,
+				   monotonic_msecs () + delay, 0);
+	}
+
+finished:
+	if (stats.bursts)
+		info (2, _("Data stream read in %lu bursts of %.0f bytes "
+			   "and %.1f reads on average, %zu bytes at most\n"),
+		      stats.bursts,
+		      (double) stats.bytes / stats.bursts,
+		      (double) stats.reads / stats.bursts,
+		      stats.largest);
+	if (stats.timed)
+		info (2, _("Data stream latency: %lu bursts, "
+			   "%.2f ms average, %.2f ms worst\n"),
+		      stats.timed,
+		      stats.total / 1e6 / stats.timed,
+		      stats.worst / 1e6);
+	if (sched.pings)
+		info (2, _("Pinged %lu times (%s), %lu answered in %.0f ms "
+			   "on average, updates every %.0f ms\n"),
+		      sched.pings, ping_policy->name, sched.answered,
+		      sched.answered ? (double) sched.rtt_total / sched.answered : 0.0,
+		      sched.gaps ? (double) sched.gap_total / sched.gaps : 0.0);
+
+	if (frame_fd >= 0)
+		close (frame_fd);
+	if (clock_fd >= 0)
+		close (clock_fd);
+	if (ping_fd >= 0)
+		close (ping_fd);
+	if (epfd >= 0)
+		close (epfd);
+
+	return ret;
+}
+
+/**
+ * wake_event_loop:
+ *
+ * Wakes the event loop, so that it notices something a worker thread
+ * has finished, such as downloading a key frame, or the user quitting
+ * on the render thread.  May be called from any thread.
+ **/
+void
+wake_event_loop (void)
+{
+	uint64_t one = 1;
+
+	if (wake_fd >= 0)
+		write (wake_fd, &one, sizeof (one));
+}
+
+/**
+ * catch_signals:
+ *
+ * Blocks the signals that would otherwise kill us, SIGINT, SIGTERM and
+ * SIGHUP, so that they're caught by the event loop instead and we stop
+ * as if the user had quit: the capture file, emitter, statistics and
+ * shared memory are then closed properly on the way out.  Must be
+ * called before any threads are started, so that they block them too.
+ *
+ * Returns: 0 on success, < 0 if they're left to kill us.
+ **/
+int
+catch_signals (void)
+{
+	sigset_t mask;
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGINT);
+	sigaddset (&mask, SIGTERM);
+	sigaddset (&mask, SIGHUP);
+
+	if (pthread_sigmask (SIG_BLOCK, &mask, NULL))
+		return -1;
+
+	signal_fd = signalfd (-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (signal_fd < 0) {
+		pthread_sigmask (SIG_UNBLOCK, &mask, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * caught_signal:
+ *
+ * Checks, without waiting, whether one of the signals blocked by
+ * catch_signals() has arrived; for loops other than the event loop.
+ *
+ * Returns: number of the signal, or zero if none has.
+ **/
+int
+caught_signal (void)
+{
+	struct signalfd_siginfo siginfo;
+
+	if (signal_fd < 0)
+		return 0;
+	if (read (signal_fd, &siginfo, sizeof (siginfo)) != sizeof (siginfo))
+		return 0;
+
+	return siginfo.ssi_signo;
+}
+
+/**
+ * set_ping_policy:
+ * @name: name of policy.
+ *
+ * Sets how we decide when to ping the server.
+ *
+ * Returns: 0 on success, non-zero if there's no policy called @name.
+ **/
+int
+set_ping_policy (const char *name)
+{
+	const PingPolicy *policy;
+
+	for (policy = ping_policies; policy->name; policy++) {
+		if (! strcmp (policy->name, name)) {
+			ping_policy = policy;
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/**
+ * adaptive_ping:
+ * @sched: ping schedule.
+ *
+ * Pings so that the ping reaches the server just as it has the next
+ * update.  It had the last one about half a round trip before we heard
+ * it, and the ping takes another half to get there, so we ping a round
+ * trip short of the refresh interval after hearing from it.  While pings
+ * go unanswered the server has nothing new, so we back off up to eight
+ * intervals, and never ping more than twice an interval.
+ *
+ * Returns: time to next ping the server (msecs).
+ **/
+static unsigned long long
+adaptive_ping (const PingSchedule *sched)
+{
+	unsigned long long interval, when;
+
+	interval = sched->interval << MIN (sched->misses, 3);
+
+	when = sched->last_heard + interval;
+	when -= MIN (sched->rtt, interval / 2);
+
+	return MAX (when, sched->last_ping + interval / 2);
+}
+
+/**
+ * quiet_ping:
+ * @sched: ping schedule.
+ *
+ * Only pings once the server has been quiet for the refresh interval.
+ *
+ * Returns: time to next ping the server (msecs).
+ **/
+static unsigned long long
+quiet_ping (const PingSchedule *sched)
+{
+	return MAX (sched->last_heard, sched->last_ping) + sched->interval;
+}
+
+/**
+ * heard_server:
+ * @sched: ping schedule,
+ * @now: time data arrived (msecs).
+ *
+ * Notes that data arrived from the server; if we were waiting for an
+ * answer to a ping, this is it, and tells us the round-trip time.
+ **/
+static void
+heard_server (PingSchedule       *sched,
+	      unsigned long long  now)
+{
+	unsigned long long rtt;
+
+	sched->last_heard = now;
+	if (! sched->waiting)
+		return;
+
+	rtt = now - sched->last_ping;
+	sched->rtt = sched->answered ? (sched->rtt * 7 + rtt) / 8 : rtt;
+	sched->rtt_total += rtt;
+	sched->answered++;
+
+	if (sched->last_answer) {
+		sched->gap_total += now - sched->last_answer;
+		sched->gaps++;
+	}
+	sched->last_answer = now;
+
+	sched->waiting = FALSE;
+	sched->misses = 0;
+}
+
+/**
+ * watch_fd:
+ * @epfd: epoll instance,
+ * @fd: file descriptor to watch,
+ * @source: what @fd is.
+ *
+ * Adds @fd to the descriptors the event loop waits to be readable.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+watch_fd (int         epfd,
+	  int         fd,
+	  EventSource source)
+{
+	struct epoll_event event;
+
+	memset (&event, 0, sizeof (event));
+	event.events = EPOLLIN;
+	event.data.u32 = source;
+
+	return epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/**
+ * arm_timer:
+ * @fd: timerfd,
+ * @clock: clock @fd was created with,
+ * @when: time it should fire (msecs on @clock),
+ * @interval: time between firings thereafter (msecs), or zero.
+ *
+ * Sets the timer to fire at an absolute time, so that however late we
+ * are in getting round to it, it doesn't drift.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+arm_timer (int                fd,
+	   clockid_t          clock,
+	   unsigned long long when,
+	   unsigned long long interval)
+{
+	struct itimerspec spec;
+
+	spec.it_value.tv_sec = when / 1000;
+	spec.it_value.tv_nsec = (when % 1000) * 1000000;
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+
+	return timerfd_settime (fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * drain_fd:
+ * @fd: timerfd or eventfd.
+ *
+ * Reads the counter from @fd, so that it's no longer readable.
+ **/
+static void
+drain_fd (int fd)
+{
+	uint64_t count;
+
+	read (fd, &count, sizeof (count));
+}
+
+/**
+ * note_burst:
+ * @burst: burst of data read from the stream.
+ *
+ * Adds the size of @burst, and the time since it arrived, it having
+ * now been parsed, to the statistics, and that time to the histogram
+ * of socket to decode latency.
+ **/
+static void
+note_burst (const StreamBurst *burst)
+{
+	const struct timespec *arrived = &burst->arrived;
+	struct timespec        now;
+	unsigned long long     nsecs;
+
+	stats.bursts++;
+	stats.bytes += burst->len;
+	stats.reads += burst->reads;
+	stats.largest = MAX (stats.largest, burst->len);
+
+	clock_gettime (CLOCK_REALTIME, &now);
+	if ((now.tv_sec < arrived->tv_sec)
+	    || ((now.tv_sec == arrived->tv_sec)
+		&& (now.tv_nsec < arrived->tv_nsec)))
+		return;
+
+	nsecs = (now.tv_sec - arrived->tv_sec) * 1000000000ULL
+		+ now.tv_nsec - arrived->tv_nsec;
+
+	stats.timed++;
+	stats.total += nsecs;
+	stats.worst = MAX (stats.worst, nsecs);
+
+	note_decode_latency (nsecs);
+}
+
+/**
+ * monotonic_msecs:
+ *
+ * Returns: current value of the monotonic clock in milliseconds.
+ **/
+static unsigned long long
+monotonic_msecs (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
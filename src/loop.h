@@ -0,0 +1,40 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_LOOP_H
+#define LIVE_F1_LOOP_H
+
+#include "live-f1.h"
+
+
+/* Time between updates until the server tells us otherwise (msecs) */
+#define PING_INTERVAL 1000
+
+
+SJR_BEGIN_EXTERN
+
+int  run_event_loop  (CurrentState *state, int sock);
+void wake_event_loop (void);
+int  catch_signals   (void);
+int  caught_signal   (void);
+int  set_ping_policy (const char *name);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_LOOP_H */
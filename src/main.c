@@ -34,6 +34,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <locale.h>
+#include <time.h>
 #include <unistd.h>
 #include <errno.h>
 
@@ -43,11 +44,33 @@
 #include "live-f1.h"
 #include "cfgfile.h"
 #include "display.h"
+#include "emit.h"
 #include "http.h"
+#include "keyrec.h"
+#include "loop.h"
+#include "packet.h"
+#include "record.h"
+#include "relay.h"
+#include "render.h"
+#include "replay.h"
+#include "shm.h"
+#include "stats.h"
+#include "live-f1-shm.h"
 #include "stream.h"
 
 
+/* Longest, and initial, time to wait before reconnecting (msecs) */
+#define RECONNECT_MAX_DELAY 30000
+#define RECONNECT_DELAY     250
+
+/* Time connected after which we reconnect straight away again (secs) */
+#define RECONNECT_STABLE    60
+
+
 /* Forward prototypes */
+static void reset_state (CurrentState *state);
+static int  reconnect_delay (CurrentState *state, unsigned int attempt);
+static int  replay (CurrentState *state, const char *filename, double speed);
 static void print_version (void);
 static void print_usage (void);
 
@@ -62,6 +85,19 @@ static int verbosity = 0;
 static const char opts[] = "v";
 static const struct option longopts[] = {
 	{ "verbose",	no_argument, NULL, 'v' },
+	{ "record",	required_argument, NULL, 0400 + 'r' },
+	{ "replay",	required_argument, NULL, 0400 + 'p' },
+	{ "speed",	required_argument, NULL, 0400 + 's' },
+	{ "key",	required_argument, NULL, 0400 + 'k' },
+	{ "recover-key", required_argument, NULL, 0400 + 'K' },
+	{ "frame-interval", required_argument, NULL, 0400 + 'f' },
+	{ "ping",	required_argument, NULL, 0400 + 'g' },
+	{ "rcvbuf",	required_argument, NULL, 0400 + 'b' },
+	{ "relay",	optional_argument, NULL, 0400 + 'R' },
+	{ "shm",	optional_argument, NULL, 0400 + 'm' },
+	{ "no-display",	no_argument, NULL, 0400 + 'n' },
+	{ "emit",	required_argument, NULL, 0400 + 'e' },
+	{ "stats-file",	required_argument, NULL, 0400 + 'S' },
 	{ "help",	no_argument, NULL, 0400 + 'h' },
 	{ "version",	no_argument, NULL, 0400 + 'v' },
 	{ NULL,		no_argument, NULL, 0 }
@@ -73,9 +109,14 @@ main (int   argc,
       char *argv[])
 {
 	CurrentState *state;
-	const char   *home_dir;
-	char         *config_file;
-	int           opt, sock;
+	const char   *home_dir, *record_file = NULL, *replay_file = NULL;
+	const char   *recover_file = NULL, *cache_home;
+	const char   *relay_address = NULL, *shm_name = NULL;
+	const char   *stats_file = NULL;
+	char         *config_file, *cache_dir;
+	double        speed = 1.0;
+	unsigned int  attempt = 0;
+	int           opt, sock, reconnecting = FALSE, relay = FALSE;
 
 	setlocale (LC_ALL, "");
 	bindtextdomain (PACKAGE, LOCALEDIR);
@@ -88,6 +129,98 @@ main (int   argc,
 		case 'v':
 			verbosity++;
 			break;
+		case 0400 + 'r':
+			record_file = optarg;
+			break;
+		case 0400 + 'p':
+			replay_file = optarg;
+			break;
+		case 0400 + 's': {
+			char *endptr;
+
+			speed = strtod (optarg, &endptr);
+			if (*endptr || (speed < 0.0)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid speed"), optarg);
+				return 1;
+			}
+			break;
+		}
+		case 0400 + 'k': {
+			unsigned long key;
+			char          *endptr;
+
+			key = strtoul (optarg, &endptr, 16);
+			if (*endptr || (! *optarg) || (! key)
+			    || (key > 0xffffffffUL)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid key"), optarg);
+				return 1;
+			}
+
+			set_replay_key (key);
+			break;
+		}
+		case 0400 + 'f': {
+			unsigned long msecs;
+			char          *endptr;
+
+			msecs = strtoul (optarg, &endptr, 10);
+			if (*endptr || (! *optarg) || (msecs > 10000)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid frame interval"), optarg);
+				return 1;
+			}
+
+			frame_interval = msecs;
+			break;
+		}
+		case 0400 + 'g':
+			if (set_ping_policy (optarg)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("unknown ping policy"), optarg);
+				return 1;
+			}
+			break;
+		case 0400 + 'b': {
+			unsigned long bytes;
+			char          *endptr;
+
+			bytes = strtoul (optarg, &endptr, 10);
+			if (*endptr || (! *optarg) || (bytes > 16777216)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("invalid receive buffer size"), optarg);
+				return 1;
+			}
+
+			set_receive_buffer (bytes);
+			break;
+		}
+		case 0400 + 'K':
+			recover_file = optarg;
+			break;
+		case 0400 + 'R':
+			relay_address = optarg;
+			relay = TRUE;
+			break;
+		case 0400 + 'm':
+			shm_name = optarg ? optarg : LIVE_F1_SHM_NAME;
+			break;
+		case 0400 + 'n':
+			headless = TRUE;
+			break;
+		case 0400 + 'e':
+			/* Records go to standard output, so curses can't */
+			if (open_emitter (optarg)) {
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("unknown output format"), optarg);
+				return 1;
+			}
+			headless = TRUE;
+			break;
+		case 0400 + 'S':
+			stats_file = optarg;
+			break;
 		case 0400 + 'h':
 			print_usage ();
 			return 0;
@@ -102,6 +235,9 @@ main (int   argc,
 		}
 	}
 
+	if (recover_file)
+		return recover_key (recover_file);
+
 	home_dir = getenv ("HOME");
 	if (! home_dir) {
 		fprintf (stderr, "%s: %s\n", program_name,
@@ -109,8 +245,10 @@ main (int   argc,
 		return 1;
 	}
 
-	print_version ();
-	printf ("\n");
+	if (! headless) {
+		print_version ();
+		printf ("\n");
+	}
 
 	if (ne_sock_init ()) {
 		fprintf (stderr, "%s: %s\n", program_name,
@@ -126,8 +264,21 @@ main (int   argc,
 	state->email = NULL;
 	state->password = NULL;
 	state->cookie = NULL;
+	state->cars = NULL;
 	state->car_position = NULL;
 	state->car_info = NULL;
+	state->parser = malloc (sizeof (StreamParser));
+	init_stream_parser (state->parser, 0);
+
+	if (shm_name && (! relay) && open_shm (shm_name))
+		return 1;
+	if (stats_file && (! relay) && open_stats_file (stats_file))
+		return 1;
+
+	if (replay_file) {
+		catch_signals ();
+		return replay (state, replay_file, speed);
+	}
 
 	config_file = malloc (strlen (home_dir) + 7);
 	sprintf (config_file, "%s/.f1rc", home_dir);
@@ -135,93 +286,248 @@ main (int   argc,
 	if (read_config (state, config_file))
 		return 1;
 
-	if ((! state->email) || (! state->password)) {
-		if (get_config (state) || write_config (state, config_file))
-			return 1;
-	}
-
 	if (! state->host)
 		state->host = DEFAULT_HOST;
 	if (! state->auth_host)
 		state->auth_host = DEFAULT_HOST;
 
+	/* The relay never logs in, its viewers do */
+	if (relay) {
+		free (config_file);
+		return run_relay (state->host, relay_address);
+	}
+
+	if ((! state->email) || (! state->password)) {
+		if (get_config (state) || write_config (state, config_file))
+			return 1;
+	}
+
 	free (config_file);
 
-	do
-	{
-		state->cookie = obtain_auth_cookie (state->auth_host, state->email, state->password);
+	cache_home = getenv ("XDG_CACHE_HOME");
+	if (cache_home) {
+		cache_dir = malloc (strlen (cache_home) + 9);
+		sprintf (cache_dir, "%s/live-f1", cache_home);
+	} else {
+		cache_dir = malloc (strlen (home_dir) + 16);
+		sprintf (cache_dir, "%s/.cache/live-f1", home_dir);
 	}
-	while (! state->cookie);
+
+	set_cache_dir (cache_dir);
+	free (cache_dir);
+
+	if (record_file && open_recording (record_file))
+		return 1;
+
+	/* Stop cleanly when killed, now that we've nothing to prompt for */
+	catch_signals ();
+
+	/* Log in, look up and connect to the data stream and fetch the
+	 * current key frame all at once; the cookie isn't needed until
+	 * the key frame tells us the event */
+	start_board_timer ();
+	start_login (state);
+	reset_state (state);
+
+	srandom (time (NULL) ^ getpid ());
 
 	for (;;) {
-		int ret;
+		time_t connected;
+		int    ret;
+
+		fetch_key_frame (state, 0);
 
 		sock = open_stream (state->host, 4321);
-		if (sock < 0) {
+		if ((sock < 0) && (! reconnecting)) {
 			close_display ();
 			fprintf (stderr, "%s: %s: %s\n", program_name,
 				 _("unable to open data stream"),
 				 strerror (errno));
 			return 2;
-		}
-
-		state->key = 0;
-		state->frame = 0;
-		state->event_no = 0;
-		state->event_type = RACE_EVENT;
-		state->epoch_time = 0;
-		state->remaining_time = 0;
-		state->laps_completed = 0;
-		state->total_laps = 0;
-		state->flag = GREEN_FLAG;
-
-		state->track_temp = 0;
-		state->air_temp = 0;
-		state->wind_speed = 0;
-		state->humidity = 0;
-		state->pressure = 0;
-		state->wind_direction = 0;
-
-		if (state->fl_car) free (state->fl_car);
-		state->fl_car = calloc(3, sizeof(char));
-		if (state->fl_driver) free (state->fl_driver);
-		state->fl_driver = calloc(15, sizeof(char));
-		if (state->fl_time) free (state->fl_time);
-		state->fl_time = calloc(9, sizeof(char));
-		if (state->fl_lap) free (state->fl_lap);
-		state->fl_lap = calloc(3, sizeof(char));
-		
-		state->num_cars = 0;
-		if (state->car_position) {
-			free (state->car_position);
-			state->car_position = NULL;
-		}
-		if (state->car_info) {
-			free (state->car_info);
-			state->car_info = NULL;
-		}
-
-		reset_decryption (state);
+		} else if (sock < 0) {
+			info (1, "%s: %s\n", _("unable to open data stream"),
+			      strerror (errno));
+		} else {
+			connected = time (NULL);
 
-		while ((ret = read_stream (state, sock)) > 0) {
-			if (handle_keys (state) < 0) {
+			ret = run_event_loop (state, sock);
+			if (ret > 0) {
 				close_display ();
 				close (sock);
 				return 0;
+			} else if ((ret < 0) && (errno != ECONNRESET)
+				   && (errno != ETIMEDOUT)) {
+				close_display ();
+				fprintf (stderr, "%s: %s: %s\n", program_name,
+					 _("error reading from data stream"),
+					 strerror (errno));
+				return 2;
 			}
+
+			close (sock);
+
+			if (time (NULL) - connected >= RECONNECT_STABLE)
+				attempt = 0;
 		}
 
-		if (ret < 0) {
+		/* Don't lose what we received while waiting for it */
+		finish_key_frame (state, TRUE);
+
+		info (1, _("Reconnecting ...\n"));
+		if (reconnect_delay (state, attempt++) < 0) {
 			close_display ();
-			fprintf (stderr, "%s: %s: %s\n", program_name,
-				 _("error reading from data stream"),
-				 strerror (errno));
-			return 2;
+			return 0;
 		}
 
-		close (sock);
-		info (1, _("Reconnecting ...\n"));
+		/* Keep the board and key for the event, which the current
+		 * key frame brings up to date, but not the half-read packet
+		 * or key frame marker from the old connection */
+		reset_stream_parser (state->parser, state->parser->key);
+		state->frame = 0;
+		reconnecting = TRUE;
+	}
+}
+
+/**
+ * reconnect_delay:
+ * @state: application state structure,
+ * @attempt: number of reconnections since the connection was stable.
+ *
+ * Waits a random time, up to a limit that doubles with each @attempt,
+ * before we reconnect to the data stream.  A blip is recovered from
+ * almost at once, while a server that's down isn't hammered by us, or
+ * by everyone else at the same moment.  Keys and signals are still
+ * handled.
+ *
+ * Returns: 0 to reconnect, < 0 if the user quit.
+ **/
+static int
+reconnect_delay (CurrentState *state,
+		 unsigned int  attempt)
+{
+	unsigned long limit, msecs;
+
+	limit = MIN ((unsigned long) RECONNECT_DELAY << MIN (attempt, 7),
+		     RECONNECT_MAX_DELAY);
+	msecs = random () % (limit + 1);
+	if (msecs >= 1000)
+		info (2, _("Waiting %lu ms before reconnecting\n"), msecs);
+
+	while (msecs) {
+		struct timespec ts = { 0, 0 };
+
+		ts.tv_nsec = MIN (msecs, 100) * 1000000;
+		msecs -= MIN (msecs, 100);
+
+		nanosleep (&ts, NULL);
+		if ((handle_keys (state) < 0) || caught_signal ())
+			return -1;
+
+		update_time (state);
+		flush_display (state);
+	}
+
+	return 0;
+}
+
+/**
+ * reset_state:
+ * @state: application state structure.
+ *
+ * Forgets everything we know about the current event, ready to parse a
+ * data stream from the start.
+ **/
+static void
+reset_state (CurrentState *state)
+{
+	reset_stream_parser (state->parser, 0);
+	state->frame = 0;
+	state->refresh_rate = 0;
+	state->event_no = 0;
+	state->event_type = RACE_EVENT;
+	state->epoch_time = 0;
+	state->remaining_time = 0;
+	state->laps_completed = 0;
+	state->total_laps = 0;
+	state->flag = GREEN_FLAG;
+
+	state->track_temp = 0;
+	state->air_temp = 0;
+	state->wind_speed = 0;
+	state->humidity = 0;
+	state->pressure = 0;
+	state->wind_direction = 0;
+
+	if (state->fl_car) free (state->fl_car);
+	state->fl_car = calloc(3, sizeof(char));
+	if (state->fl_driver) free (state->fl_driver);
+	state->fl_driver = calloc(15, sizeof(char));
+	if (state->fl_time) free (state->fl_time);
+	state->fl_time = calloc(9, sizeof(char));
+	if (state->fl_lap) free (state->fl_lap);
+	state->fl_lap = calloc(3, sizeof(char));
+
+	free_cars (state);
+}
+
+/**
+ * replay:
+ * @state: application state structure,
+ * @filename: capture file to replay,
+ * @speed: playback speed multiplier.
+ *
+ * Replays the data stream captured in @filename instead of connecting
+ * to the live timing server, then waits for the user to quit.
+ *
+ * Returns: exit status for the program.
+ **/
+static int
+replay (CurrentState *state,
+	const char   *filename,
+	double        speed)
+{
+	int ret;
+
+	if (open_replay (filename, speed))
+		return 1;
+
+	reset_state (state);
+	start_board_timer ();
+
+	while ((ret = read_replay (state)) > 0) {
+		if ((handle_keys (state) < 0) || caught_signal ()) {
+			close_display ();
+			close_replay ();
+			return 0;
+		}
+
+		flush_display (state);
+		publish_shm (state);
+		dump_stats (FALSE);
 	}
+
+	if (ret < 0) {
+		close_display ();
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 _("capture file is corrupt"));
+		close_replay ();
+		return 2;
+	}
+
+	info (0, _("End of replay\n"));
+	while (handle_keys (state) >= 0) {
+		struct timespec ts = { 0, 100000000 };
+
+		if (((! rendering) && (! cursed)) || caught_signal ())
+			break;
+
+		nanosleep (&ts, NULL);
+		update_time (state);
+	}
+
+	close_display ();
+	close_replay ();
+	return 0;
 }
 
 
@@ -242,7 +548,7 @@ info (int         irrelevance,
 
 	if (verbosity >= irrelevance) {
 		va_start (ap, format);
-		if (cursed) {
+		if (rendering || cursed) {
 			char msg[512];
 
 			ret = vsnprintf (msg, sizeof (msg), format, ap);
@@ -250,7 +556,8 @@ info (int         irrelevance,
 
 			popup_message (msg);
 		} else {
-			ret = vprintf (format, ap);
+			ret = vfprintf (headless ? stderr : stdout,
+					format, ap);
 		}
 
 		va_end (ap);
@@ -292,6 +599,20 @@ print_usage (void)
 	printf ("\n");
 	printf (_("Options:\n"
 		  "  -v, --verbose              increase verbosity for each time repeated.\n"
+		  "      --record=FILE          append the data stream to capture FILE.\n"
+		  "      --replay=FILE          replay the data stream from capture FILE.\n"
+		  "      --speed=N              replay N times faster, or 0 for no delay.\n"
+		  "      --key=HEX              decryption key for events not in the capture.\n"
+		  "      --recover-key=FILE     find the decryption keys for capture FILE.\n"
+		  "      --frame-interval=MS    redraw the board at most every MS milliseconds.\n"
+		  "      --ping=POLICY          when to ask for data: adaptive (default) or quiet.\n"
+		  "      --rcvbuf=BYTES         size of the data stream's socket receive buffer.\n"
+		  "      --relay[=ADDRESS]      share the data stream with viewers who connect.\n"
+		  "      --shm[=NAME]           publish the timing board in shared memory.\n"
+		  "      --no-display           don't display the timing board.\n"
+		  "      --emit=FORMAT          write decoded packets to standard output as\n"
+		  "                             ndjson or binary records.\n"
+		  "      --stats-file=FILE      write latency statistics to FILE periodically.\n"
 		  "      --help                 display this help and exit.\n"
 		  "      --version              output version information and exit.\n"));
 	printf ("\n");
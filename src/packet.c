@@ -27,13 +27,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <regex.h>
 
 #include "live-f1.h"
 #include "display.h"
 #include "http.h"
 #include "stream.h"
 #include "packet.h"
+#include "value.h"
 
 
 /**
@@ -47,35 +47,25 @@ void
 handle_car_packet (CurrentState *state,
 		   const Packet *packet)
 {
+	/* All the cars share one arena, allocated when the first of
+	 * them appears */
+	if (! state->cars) {
+		state->cars = calloc (1, sizeof (CarArena));
+		if (! state->cars)
+			abort ();
+
+		state->car_position = state->cars->car_position;
+		state->car_info = state->cars->car_info;
+	}
+
 	/* Check whether a new car joined the event; actually, this is
 	 * because we never know in advance how many cars there are, and
 	 * things like practice sessions can probably have more than the
 	 * usual twenty.  (Or we might get another team in the future).
 	 *
-	 * Then increase the size of all the arrays and clear the board.
+	 * Then clear the board, to make room for it.
 	 */
 	if (packet->car > state->num_cars) {
-		int i, j;
-
-		state->car_position = realloc (state->car_position,
-					       sizeof (int) * packet->car);
-		state->car_info = realloc (state->car_info,
-					   sizeof (CarAtom *) * packet->car);
-		if ((! state->car_position) || (! state->car_info))
-			abort ();
-
-		for (i = state->num_cars; i < packet->car; i++) {
-			state->car_position[i] = 0;
-			state->car_info[i] = malloc (sizeof (CarAtom)
-						     * LAST_CAR_PACKET);
-			if (! state->car_info[i])
-				abort ();
-
-			for (j = 0; j < LAST_CAR_PACKET; j++)
-				memset (&state->car_info[i][j], 0,
-					sizeof (CarAtom));
-		}
-
 		state->num_cars = packet->car;
 		clear_board (state);
 	}
@@ -116,45 +106,46 @@ handle_car_packet (CurrentState *state,
 		 * of a field.
 		 */
 
-		/* Check for decryption failure */
+		/* Store the atom, and the value in it */
+
+		atom = &state->car_info[packet->car - 1][packet->type];
+		atom->data = packet->data;
+		if (packet->len >= 0) {
+			strcpy (atom->text, (const char *) packet->payload);
+			atom->type = parse_value (atom->text, packet->len,
+						  &atom->value);
+		}
+
+		/* Check for decryption failure; the position is always
+		 * empty or a one or two digit number, exactly, without
+		 * the spaces parse_value() would let through */
 
 		if ((packet->type == 1) && (packet->len >= 0))
 		{
-			regex_t re;
+			const char *text = atom->text;
 
-			regcomp(&re, "^[1-9][0-9]?$|^$", REG_EXTENDED|REG_NOSUB);
-
-			if (regexec(&re, packet->payload, (size_t)0, NULL, 0) == 0)
+			if ((! text[0])
+			    || ((text[0] >= '1') && (text[0] <= '9')
+				&& ((! text[1])
+				    || ((text[1] >= '0') && (text[1] <= '9')
+					&& (! text[2])))))
 			{
 				state->decryption_failure = 0;
-			} else {
+			} else if (! state->decryption_failure) {
 				state->decryption_failure = 1;
+				renew_decryption_key (state);
 			}
-
-			regfree (&re);
 		}
 
-		/* Store the atom */
-
-		atom = &state->car_info[packet->car - 1][packet->type];
-		atom->data = packet->data;
-		if (packet->len >= 0)
-			strcpy (atom->text, (const char *) packet->payload);
-
 		update_cell (state, packet->car, packet->type);
 
 		/* This is the only way to grab this information, sadly */
 		if ((state->event_type == RACE_EVENT)
 		    && (state->car_position[packet->car - 1] == 1)
-		    && (packet->type == RACE_INTERVAL)) {
-			unsigned int number = 0;
-
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-
-			state->laps_completed = number;
+		    && (packet->type == RACE_INTERVAL)
+		    && (packet->len >= 0)) {
+			state->laps_completed = ((atom->type == VALUE_NUMBER)
+						 ? atom->value : 0);
 			update_status (state);
 		}
 		break;
@@ -183,15 +174,23 @@ handle_system_packet (CurrentState *state,
 		 * Indicates the start of an event, we use this to set up
 		 * the board properly and obtain the decryption key for
 		 * the event.
+		 *
+		 * Having reconnected to the same event, the key frame
+		 * brings the board we have up to date with the key we
+		 * already hold, instead of starting again.
 		 */
-		number = 0;
-		for (i = 1; i < packet->len; i++) {
-			number *= 10;
-			number += packet->payload[i] - '0';
+		/* Skip the odd byte */
+		number = parse_number ((const char *) packet->payload + 1,
+				       packet->len - 1);
+
+		if ((number == state->event_no) && state->parser->key
+		    && (! state->decryption_failure)) {
+			reset_decryption (state->parser);
+			info (3, _("Resuming event #%d\n"), state->event_no);
+			break;
 		}
 
-		state->key = obtain_decryption_key (state->host, number,
-						    state->cookie);
+		state->parser->key = obtain_decryption_key (state, number);
 		state->event_no = number;
 		state->event_type = packet->data;
 		state->epoch_time = 0;
@@ -216,16 +215,8 @@ handle_system_packet (CurrentState *state,
 		if (state->fl_lap) free (state->fl_lap);
 		state->fl_lap = calloc(3, sizeof(char));
 	
-		state->num_cars = 0;
-		if (state->car_position) {
-			free (state->car_position);
-			state->car_position = NULL;
-		}
-		if (state->car_info) {
-			free (state->car_info);
-			state->car_info = NULL;
-		}
-		reset_decryption (state);
+		free_cars (state);
+		reset_decryption (state->parser);
 
 		clear_board (state);
 		info (3, _("Begin new event #%d (type: %d)\n"),
@@ -238,6 +229,11 @@ handle_system_packet (CurrentState *state,
 		 * If we've not yet encountered a key frame, we need to
 		 * load this to get up to date.  Otherwise we just set
 		 * our counter and carry on
+		 *
+		 * The key frame is downloaded in the background, and the
+		 * rest of the stream held back until it's been parsed.
+		 * New key frames are cached in the background too, so a
+		 * resync to them needn't wait for the network.
 		 */
 		number = 0;
 		i = packet->len;
@@ -246,14 +242,14 @@ handle_system_packet (CurrentState *state,
 			number |= packet->payload[--i];
 		}
 
-		reset_decryption (state);
+		reset_decryption (state->parser);
 		if ((!state->frame) || (state->decryption_failure))
 		{
 			state->frame = number;
-			obtain_key_frame (state->host, number, state);
-			reset_decryption (state);
+			fetch_key_frame (state, number);
 		} else {
 			state->frame = number;
+			prefetch_key_frame (state, number);
 		}
 
 		break;
@@ -282,22 +278,19 @@ handle_system_packet (CurrentState *state,
 			 * session.
 			 */
 			if (packet->len > 0) {
-				unsigned int total;
-
-				total = number = 0;
-				for (i = 0; i < packet->len; i++) {
-					if (packet->payload[i] == ':') {
-						total *= 60;
-						total += number;
-						number = 0;
-					} else {
-						number *= 10;
-						number += (packet->payload[i]
-							   - '0');
-					}
+				int total;
+
+				switch (parse_value ((const char *) packet->payload,
+						     packet->len, &total)) {
+				case VALUE_TIME:
+					total /= 1000;
+					break;
+				case VALUE_NUMBER:
+					break;
+				default:
+					total = 0;
+					break;
 				}
-				total *= 60;
-				total += number;
 
 				if (state->epoch_time)
 					state->epoch_time = time (NULL);
@@ -310,21 +303,13 @@ handle_system_packet (CurrentState *state,
 			update_time (state);
 			break;
 		case WEATHER_TRACK_TEMP:
-			number = 0;
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-			state->track_temp = number;
+			state->track_temp = parse_number (
+				(const char *) packet->payload, packet->len);
 			update_status (state);
 			break;
 		case WEATHER_AIR_TEMP:
-			number = 0;
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-			state->air_temp = number;
+			state->air_temp = parse_number (
+				(const char *) packet->payload, packet->len);
 			update_status (state);
 			break;
 		case WEATHER_WIND_SPEED:
@@ -340,12 +325,8 @@ handle_system_packet (CurrentState *state,
 			update_status (state);
 			break;
 		case WEATHER_HUMIDITY:
-			number = 0;
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-			state->humidity = number;
+			state->humidity = parse_number (
+				(const char *) packet->payload, packet->len);
 			update_status (state);
 			break;
 		case WEATHER_PRESSURE:
@@ -361,12 +342,8 @@ handle_system_packet (CurrentState *state,
 			update_status (state);
 			break;
 		case WEATHER_WIND_DIRECTION:
-			number = 0;
-			for (i = 0; i < packet->len; i++) {
-				number *= 10;
-				number += packet->payload[i] - '0';
-			}
-			state->wind_direction = number;
+			state->wind_direction = parse_number (
+				(const char *) packet->payload, packet->len);
 			update_status (state);
 			break;
 		default:
@@ -424,13 +401,24 @@ handle_system_packet (CurrentState *state,
 			break;
 		}
 		break;
+	case SYS_REFRESH_RATE:
+		/* Refresh Rate:
+		 * Format: no payload.
+		 * Data: seconds between updates, zero for the default.
+		 *
+		 * How often the server has new data for us, and so how
+		 * often it expects to be pinged for it.
+		 */
+		state->refresh_rate = packet->data * 1000;
+		info (3, _("Refresh rate: %d seconds\n"), packet->data);
+		break;
 	case SYS_COPYRIGHT:
 		/* Copyright Notice:
 		 * Format: string.
 		 *
 		 * Plain text copyright notice in the start of the feed.
 		 */
-		info (2, "%s\n", packet->payload);
+		info (2, "%.*s\n", packet->len, packet->payload);
 		break;
 	case SYS_NOTICE:
 		/* Important System Notice:
@@ -446,3 +434,20 @@ handle_system_packet (CurrentState *state,
 		break;
 	}
 }
+
+/**
+ * free_cars:
+ * @state: application state structure.
+ *
+ * Frees everything known about the cars in the event, in one go.
+ **/
+void
+free_cars (CurrentState *state)
+{
+	free (state->cars);
+	state->cars = NULL;
+
+	state->num_cars = 0;
+	state->car_position = NULL;
+	state->car_info = NULL;
+}
@@ -153,17 +153,23 @@ typedef enum {
  * @type: type of packet,
  * @data: additional data in header,
  * @len: length of @payload,
- * @payload: (decrypted) data that followed the packet.
+ * @payload: (decrypted) data that followed the packet,
+ * @buf: storage for @payload when it had to be copied.
  *
  * This is the decoded packet structure, and is slightly easier to deal
  * with than the binary hideousness from the stream.  The @car index is
  * not the car's number, but the position on the grid at the start of the
  * race.
+ *
+ * Encrypted payloads are decrypted into @buf and always followed by a
+ * zero byte; unencrypted ones may point straight into the block being
+ * parsed, so must only be read up to @len.
  **/
 typedef struct {
 	int car, type, data, len;
 
-	unsigned char payload[128];
+	const unsigned char *payload;
+	unsigned char        buf[129];
 } Packet;
 
 
@@ -172,6 +178,8 @@ SJR_BEGIN_EXTERN
 void handle_car_packet    (CurrentState *state, const Packet *packet);
 void handle_system_packet (CurrentState *state, const Packet *packet);
 
+void free_cars            (CurrentState *state);
+
 SJR_END_EXTERN
 
 #endif /* LIVE_F1_PACKET_H */
@@ -0,0 +1,494 @@
+/* live-f1
+ *
+ * record.c - capture of the raw data stream and key frames
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "record.h"
+
+
+/* Size of the buffer records are collected in before being written */
+#define RECORD_BUF_SIZE 65536
+
+/* Maximum time to hold records in the buffer (seconds) */
+#define RECORD_FLUSH_SECS 5
+
+/* Maximum number of bytes in an encoded record header */
+#define RECORD_HDR_MAX 21
+
+
+/* Forward prototypes */
+static size_t put_varint (unsigned char *buf, unsigned long long value);
+static int    get_varint (const unsigned char **buf, size_t *buf_len,
+			  unsigned long long *value);
+static int    write_all  (int fd, const unsigned char *buf, size_t len);
+static unsigned long long monotonic_usecs (void);
+
+
+/* Capture file being written */
+int recording = 0;
+
+/* Open capture file */
+static int rec_fd = -1;
+
+/* Buffer of records not yet written */
+static unsigned char rec_buf[RECORD_BUF_SIZE];
+static size_t        rec_buf_len = 0;
+
+/* Timestamp of the previous record, and of when the oldest record in
+ * the buffer was put there (usecs) */
+static unsigned long long rec_last_usecs = 0;
+static unsigned long long rec_held_usecs = 0;
+
+
+/**
+ * open_recording:
+ * @filename: capture file to write.
+ *
+ * Opens @filename for appending, writing the capture header if the file
+ * is new, and enables the recording of data stream blocks and key frames
+ * into it.
+ *
+ * A capture file is a sixteen byte header consisting of CAPTURE_MAGIC,
+ * a version byte, a reserved byte and the little-endian wall-clock
+ * time the file was created; followed by a sequence of records.  Each
+ * record is a RecordType byte, the number of microseconds since the
+ * previous record and the length of the data as unsigned LEB128
+ * numbers, then the data itself.  The first record of each recording
+ * session has a zero delta so that appended sessions replay back to back.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_recording (const char *filename)
+{
+	static int  registered = 0;
+	struct stat statbuf;
+
+	if (recording)
+		close_recording ();
+
+	rec_fd = open (filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (rec_fd < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (fstat (rec_fd, &statbuf) < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		close (rec_fd);
+		rec_fd = -1;
+		return 1;
+	}
+
+	rec_buf_len = 0;
+	if (! statbuf.st_size) {
+		unsigned long long now = time (NULL);
+		int                i;
+
+		memcpy (rec_buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN);
+		rec_buf[CAPTURE_MAGIC_LEN] = CAPTURE_VERSION;
+		rec_buf[CAPTURE_MAGIC_LEN + 1] = 0;
+		for (i = 0; i < 8; i++)
+			rec_buf[CAPTURE_MAGIC_LEN + 2 + i] = (now >> (i * 8)) & 0xff;
+
+		rec_buf_len = CAPTURE_HEADER_LEN;
+	}
+
+	rec_last_usecs = 0;
+	rec_held_usecs = monotonic_usecs ();
+	recording = 1;
+
+	info (2, _("Recording data stream to %s\n"), filename);
+
+	if (! registered++)
+		atexit (close_recording);
+
+	return 0;
+}
+
+/**
+ * close_recording:
+ *
+ * Writes any buffered records to the capture file and closes it.  This
+ * is registered with atexit() so the tail of the capture isn't lost.
+ **/
+void
+close_recording (void)
+{
+	if (! recording)
+		return;
+
+	flush_recording ();
+
+	close (rec_fd);
+	rec_fd = -1;
+	recording = 0;
+}
+
+/**
+ * flush_recording:
+ *
+ * Writes any buffered records to the capture file in a single write.
+ * This happens automatically when the buffer fills or the oldest record
+ * has been held for a few seconds, so there's rarely a need to call it.
+ **/
+void
+flush_recording (void)
+{
+	if ((! recording) || (! rec_buf_len))
+		return;
+
+	if (write_all (rec_fd, rec_buf, rec_buf_len) < 0) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("error writing capture file"), strerror (errno));
+		close (rec_fd);
+		rec_fd = -1;
+		recording = 0;
+	}
+
+	rec_buf_len = 0;
+}
+
+/**
+ * tick_recording:
+ *
+ * Writes the buffered records to the capture file once the oldest has
+ * been held for a few seconds, so that they aren't kept back while the
+ * data stream is quiet; called every second.
+ **/
+void
+tick_recording (void)
+{
+	if ((! recording) || (! rec_buf_len))
+		return;
+
+	if (monotonic_usecs () - rec_held_usecs
+	    >= RECORD_FLUSH_SECS * 1000000ULL)
+		flush_recording ();
+}
+
+/**
+ * record_block:
+ * @type: type of record,
+ * @buf: data to record,
+ * @len: length of @buf.
+ *
+ * Appends a record of @type containing @buf to the capture file, if one
+ * is open.  Records are collected in a buffer and written out in large
+ * sequential writes, so this never blocks on the disk itself.
+ **/
+void
+record_block (RecordType  type,
+	      const void *buf,
+	      size_t      len)
+{
+	unsigned long long now, delta;
+	unsigned char      hdr[RECORD_HDR_MAX];
+	size_t             hdr_len;
+
+	if (! recording)
+		return;
+
+	now = monotonic_usecs ();
+	delta = rec_last_usecs ? now - rec_last_usecs : 0;
+	rec_last_usecs = now;
+
+	hdr[0] = type;
+	hdr_len = 1;
+	hdr_len += put_varint (hdr + hdr_len, delta);
+	hdr_len += put_varint (hdr + hdr_len, len);
+
+	if ((rec_buf_len + hdr_len + len > sizeof (rec_buf))
+	    || (rec_buf_len
+		&& (now - rec_held_usecs >= RECORD_FLUSH_SECS * 1000000ULL)))
+		flush_recording ();
+
+	/* Blocks that would never fit are written straight through */
+	if (hdr_len + len > sizeof (rec_buf)) {
+		memcpy (rec_buf, hdr, hdr_len);
+		rec_buf_len = hdr_len;
+		flush_recording ();
+
+		if (recording && (write_all (rec_fd, buf, len) < 0)) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("error writing capture file"),
+				 strerror (errno));
+			close (rec_fd);
+			rec_fd = -1;
+			recording = 0;
+		}
+		return;
+	}
+
+	if (! rec_buf_len)
+		rec_held_usecs = now;
+
+	memcpy (rec_buf + rec_buf_len, hdr, hdr_len);
+	rec_buf_len += hdr_len;
+	if (len) {
+		memcpy (rec_buf + rec_buf_len, buf, len);
+		rec_buf_len += len;
+	}
+}
+
+/**
+ * record_number:
+ * @type: type of record,
+ * @number: number to record.
+ *
+ * Appends a record of @type containing @number as a four byte
+ * little-endian integer.
+ **/
+void
+record_number (RecordType   type,
+	       unsigned int number)
+{
+	unsigned char buf[4];
+
+	if (! recording)
+		return;
+
+	buf[0] = number & 0xff;
+	buf[1] = (number >> 8) & 0xff;
+	buf[2] = (number >> 16) & 0xff;
+	buf[3] = (number >> 24) & 0xff;
+
+	record_block (type, buf, sizeof (buf));
+}
+
+/**
+ * record_key:
+ * @event_no: event number,
+ * @key: decryption key for @event_no.
+ *
+ * Appends a record of the decryption key obtained for the event, so that
+ * replays don't need to fetch it again.
+ **/
+void
+record_key (unsigned int event_no,
+	    unsigned int key)
+{
+	unsigned char buf[8];
+	int           i;
+
+	if (! recording)
+		return;
+
+	for (i = 0; i < 4; i++) {
+		buf[i] = (event_no >> (i * 8)) & 0xff;
+		buf[i + 4] = (key >> (i * 8)) & 0xff;
+	}
+
+	record_block (RECORD_KEY, buf, sizeof (buf));
+}
+
+
+/**
+ * parse_record:
+ * @buf: pointer to capture data,
+ * @buf_len: length of @buf,
+ * @record: record structure to fill.
+ *
+ * Parses the next record from @buf, which should not include the
+ * capture file header, filling @record with a pointer to its data.
+ *
+ * @buf_len is decreased and @buf moved past the record when one is
+ * parsed, and left alone otherwise.
+ *
+ * Returns: 1 if a record was parsed, 0 at the end of the data and -1
+ * if the record was truncated or corrupt.
+ **/
+int
+parse_record (const unsigned char **buf,
+	      size_t               *buf_len,
+	      CaptureRecord        *record)
+{
+	const unsigned char *ptr = *buf;
+	size_t               len = *buf_len;
+	unsigned long long   data_len;
+
+	if (! len)
+		return 0;
+
+	record->type = *(ptr++);
+	len--;
+
+	if ((get_varint (&ptr, &len, &record->delta) < 0)
+	    || (get_varint (&ptr, &len, &data_len) < 0)
+	    || (data_len > len))
+		return -1;
+
+	record->data = ptr;
+	record->len = data_len;
+
+	*buf = ptr + data_len;
+	*buf_len = len - data_len;
+
+	return 1;
+}
+
+/**
+ * record_data_number:
+ * @record: record to read from,
+ * @offset: offset into the record data.
+ *
+ * Returns: four byte little-endian number at @offset within the data of
+ * @record, or zero if the record is too short.
+ **/
+unsigned int
+record_data_number (const CaptureRecord *record,
+		    size_t               offset)
+{
+	const unsigned char *ptr = record->data + offset;
+
+	if (record->len < offset + 4)
+		return 0;
+
+	return (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16)
+		| ((unsigned int) ptr[3] << 24));
+}
+
+
+/**
+ * put_varint:
+ * @buf: buffer to write to,
+ * @value: value to encode.
+ *
+ * Encodes @value into @buf as an unsigned LEB128 number, seven bits
+ * to each byte with the top bit set on all but the last.
+ *
+ * Returns: number of bytes written.
+ **/
+static size_t
+put_varint (unsigned char      *buf,
+	    unsigned long long  value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[len++] = value;
+
+	return len;
+}
+
+/**
+ * get_varint:
+ * @buf: pointer to buffer to read from,
+ * @buf_len: length of @buf,
+ * @value: pointer to store value in.
+ *
+ * Decodes an unsigned LEB128 number from @buf, moving @buf past it and
+ * decreasing @buf_len.
+ *
+ * Returns: 0 on success, -1 if the number was truncated or too long.
+ **/
+static int
+get_varint (const unsigned char **buf,
+	    size_t               *buf_len,
+	    unsigned long long   *value)
+{
+	int shift = 0;
+
+	*value = 0;
+	while (*buf_len && (shift < 64)) {
+		unsigned char byte;
+
+		byte = *((*buf)++);
+		(*buf_len)--;
+
+		*value |= (unsigned long long) (byte & 0x7f) << shift;
+		if (! (byte & 0x80))
+			return 0;
+
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/**
+ * write_all:
+ * @fd: file descriptor to write to,
+ * @buf: data to write,
+ * @len: length of @buf.
+ *
+ * Writes the whole of @buf to @fd, retrying after short writes and
+ * interruptions.
+ *
+ * Returns: 0 on success, -1 on error.
+ **/
+static int
+write_all (int                  fd,
+	   const unsigned char *buf,
+	   size_t               len)
+{
+	while (len) {
+		ssize_t ret;
+
+		ret = write (fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * monotonic_usecs:
+ *
+ * Returns: current value of the monotonic clock in microseconds.
+ **/
+static unsigned long long
+monotonic_usecs (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
@@ -0,0 +1,90 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RECORD_H
+#define LIVE_F1_RECORD_H
+
+#include "live-f1.h"
+
+
+/* Capture file magic, followed by the format version */
+#define CAPTURE_MAGIC     "LF1CAP"
+#define CAPTURE_MAGIC_LEN 6
+#define CAPTURE_VERSION   1
+
+/* Length of the capture file header */
+#define CAPTURE_HEADER_LEN 16
+
+
+/**
+ * RecordType:
+ *
+ * Type of each record in a capture file.
+ **/
+typedef enum {
+	RECORD_STREAM		= 1,
+	RECORD_KEY_FRAME_BEGIN	= 2,
+	RECORD_KEY_FRAME	= 3,
+	RECORD_KEY_FRAME_END	= 4,
+	RECORD_KEY		= 5,
+	RECORD_TOTAL_LAPS	= 6,
+	LAST_RECORD
+} RecordType;
+
+/**
+ * CaptureRecord:
+ * @type: type of record,
+ * @delta: microseconds since the previous record,
+ * @data: pointer to record data,
+ * @len: length of @data.
+ *
+ * Record parsed from a capture file, @data points into the buffer the
+ * record was parsed from rather than being a copy.
+ **/
+typedef struct {
+	RecordType           type;
+	unsigned long long   delta;
+	const unsigned char *data;
+	size_t               len;
+} CaptureRecord;
+
+
+SJR_BEGIN_EXTERN
+
+/* Capture file being written */
+extern int recording;
+
+
+int  open_recording  (const char *filename);
+void close_recording (void);
+void flush_recording (void);
+void tick_recording  (void);
+
+void record_block    (RecordType type, const void *buf, size_t len);
+void record_number   (RecordType type, unsigned int number);
+void record_key      (unsigned int event_no, unsigned int key);
+
+int  parse_record    (const unsigned char **buf, size_t *buf_len,
+		      CaptureRecord *record);
+unsigned int record_data_number (const CaptureRecord *record,
+				 size_t offset);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RECORD_H */
@@ -0,0 +1,1434 @@
+/* live-f1
+ *
+ * relay.c - share one connection to the server between many viewers
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "http.h"
+#include "loop.h"
+#include "packet.h"
+#include "stream.h"
+#include "relay.h"
+
+
+/* Largest single read from the server's data stream */
+#define RELAY_CHUNK_SIZE 16384
+
+/* Most data kept since the last key frame marker, for new viewers */
+#define RELAY_BACKLOG_MAX (4 * 1024 * 1024)
+
+/* Most data queued for a viewer before it's dropped for being slow */
+#define RELAY_QUEUE_MAX (8 * 1024 * 1024)
+
+/* Longest request a viewer may make of us */
+#define RELAY_REQUEST_MAX 4096
+
+/* Number of key frames kept to serve to viewers */
+#define RELAY_KEY_FRAMES 8
+
+/* Number of queued blocks sent to a viewer at once */
+#define RELAY_IOV_MAX 16
+
+/* Longest, and initial, time to wait before reconnecting (msecs) */
+#define RELAY_RETRY_MAX_DELAY 30000
+#define RELAY_RETRY_DELAY     250
+
+
+/**
+ * WatchType:
+ *
+ * Things the relay waits for.
+ **/
+typedef enum {
+	WATCH_UPSTREAM,
+	WATCH_LISTEN_STREAM,
+	WATCH_LISTEN_HTTP,
+	WATCH_VIEWER,
+	WATCH_WAKE,
+	WATCH_PING,
+	WATCH_RETRY,
+} WatchType;
+
+/**
+ * RelayWatch:
+ * @type: what it is,
+ * @fd: file descriptor being waited for, or -1 once closed.
+ *
+ * Stored in the epoll event data, and at the start of anything else
+ * that's waited for.
+ **/
+typedef struct {
+	WatchType type;
+	int       fd;
+} RelayWatch;
+
+/**
+ * RelayChunk:
+ * @refs: number of queues, and the marker scan, holding it,
+ * @len: length of @data,
+ * @data: bytes.
+ *
+ * Block of data read from the server, or a key frame fetched from it,
+ * shared between the queues of every viewer it's sent to rather than
+ * copied into each.
+ **/
+typedef struct {
+	unsigned int  refs;
+	size_t        len;
+	unsigned char data[];
+} RelayChunk;
+
+/**
+ * RelayQueued:
+ * @next: next block in the queue,
+ * @chunk: data to send,
+ * @off: offset of the first byte of @chunk not yet sent.
+ *
+ * Entry in a queue of data waiting to be sent.
+ **/
+typedef struct relay_queued {
+	struct relay_queued *next;
+	RelayChunk          *chunk;
+	size_t               off;
+} RelayQueued;
+
+/**
+ * RelayQueue:
+ * @head: first entry,
+ * @tail: last entry,
+ * @len: number of bytes queued.
+ *
+ * Data waiting to be sent to a viewer, or kept for new viewers.
+ **/
+typedef struct {
+	RelayQueued *head, *tail;
+	size_t       len;
+} RelayQueue;
+
+/**
+ * RelayFetch:
+ * @next: next fetch in progress,
+ * @path: page being fetched,
+ * @frame: key frame number to keep the page as, or zero,
+ * @status: HTTP status of the response, or zero if it failed,
+ * @buf: body of the response,
+ * @len: length of @buf,
+ * @done: set once the fetch has finished.
+ *
+ * Page being fetched from the server by a worker thread, for viewers
+ * waiting for it.  The worker owns everything but @done until it sets
+ * it.
+ **/
+typedef struct relay_fetch {
+	struct relay_fetch *next;
+	char               *path;
+	unsigned int        frame;
+
+	int                 status;
+	unsigned char      *buf;
+	size_t              len;
+	int                 done;
+} RelayFetch;
+
+/**
+ * RelayViewer:
+ * @watch: connection to the viewer,
+ * @next: next viewer,
+ * @http: whether it's asking for a page rather than the data stream,
+ * @events: epoll events being waited for,
+ * @queue: data waiting to be sent to it,
+ * @closing: close once @queue has been sent,
+ * @waiting: page being fetched for it, if any,
+ * @req: request received so far,
+ * @req_len: length of @req.
+ *
+ * Live-timing client connected to us.
+ **/
+typedef struct relay_viewer {
+	RelayWatch           watch;
+	struct relay_viewer *next;
+	int                  http;
+	uint32_t             events;
+
+	RelayQueue           queue;
+	int                  closing;
+	RelayFetch          *waiting;
+
+	char                 req[RELAY_REQUEST_MAX];
+	size_t               req_len;
+} RelayViewer;
+
+/**
+ * RelayKeyFrame:
+ * @frame: key frame number,
+ * @chunk: key frame data.
+ *
+ * Key frame kept to serve to viewers.
+ **/
+typedef struct {
+	unsigned int  frame;
+	RelayChunk   *chunk;
+} RelayKeyFrame;
+
+/**
+ * MarkerScan:
+ * @pkt: start of the packet being walked through,
+ * @pkt_len: bytes of @pkt seen so far,
+ * @skip: bytes of the packet's payload still to skip,
+ * @start: block the packet began in, referenced until it's complete,
+ * @start_off: offset in @start the packet began at.
+ *
+ * Where we are in walking the packet headers of the data stream to
+ * find the key frame markers, which are never encrypted.
+ **/
+typedef struct {
+	unsigned char  pkt[130];
+	size_t         pkt_len, skip;
+	RelayChunk    *start;
+	size_t         start_off;
+} MarkerScan;
+
+
+/* Forward prototypes */
+static int          listen_tcp        (const char *address,
+				       unsigned int port);
+static int          listen_unix       (const char *path);
+static int          watch             (RelayWatch *watch, uint32_t events);
+static int          connect_upstream  (void);
+static void         drop_upstream     (void);
+static void         read_upstream     (void);
+static void         scan_chunk        (RelayChunk *chunk);
+static void         end_scan_packet   (void);
+static void         key_frame_marker  (unsigned int frame, RelayChunk *chunk,
+				       size_t off);
+static void         accept_viewers    (RelayWatch *listener, int http);
+static void         read_viewer       (RelayViewer *viewer);
+static void         handle_request    (RelayViewer *viewer);
+static void         serve_key_frame   (RelayViewer *viewer,
+				       unsigned int frame);
+static void         wait_for_fetch    (RelayViewer *viewer, const char *path,
+				       unsigned int frame);
+static void         respond           (RelayViewer *viewer, int status,
+				       RelayChunk *body);
+static int          send_to_viewer    (RelayViewer *viewer, RelayChunk *chunk,
+				       size_t off);
+static int          flush_viewer      (RelayViewer *viewer);
+static void         drop_viewer       (RelayViewer *viewer);
+static RelayFetch * start_fetch       (const char *path, unsigned int frame);
+static void *       fetch_thread      (void *data);
+static void         finish_fetches    (void);
+static RelayChunk * find_key_frame    (unsigned int frame);
+static RelayChunk * new_chunk         (const void *data, size_t len);
+static void         unref_chunk       (RelayChunk *chunk);
+static void         push_queue        (RelayQueue *queue, RelayChunk *chunk,
+				       size_t off);
+static void         pop_queue         (RelayQueue *queue);
+static void         clear_queue       (RelayQueue *queue);
+static void         arm_in            (int fd, unsigned long long msecs,
+				       unsigned long long interval);
+static unsigned long long monotonic_msecs (void);
+
+
+/* Server we relay */
+static const char *upstream_host = NULL;
+
+/* Things we wait for, other than the viewers */
+static RelayWatch upstream = { WATCH_UPSTREAM, -1 };
+static RelayWatch wake = { WATCH_WAKE, -1 };
+static RelayWatch ping = { WATCH_PING, -1 };
+static RelayWatch retry = { WATCH_RETRY, -1 };
+
+/* epoll instance, and the number of times in a row connecting failed */
+static int          epfd = -1;
+static unsigned int attempt = 0;
+
+/* Time we last heard from the server (msecs) */
+static unsigned long long last_heard = 0;
+
+/* Viewers connected, and those dropped but maybe still in the events
+ * being handled */
+static RelayViewer *viewers = NULL;
+static RelayViewer *dropped = NULL;
+
+/* Data stream since the last key frame marker, where new viewers begin */
+static RelayQueue backlog;
+static MarkerScan scan;
+
+/* Key frames kept, the next slot to replace and the latest marked */
+static RelayKeyFrame key_frames[RELAY_KEY_FRAMES];
+static unsigned int  next_key_frame = 0;
+static unsigned int  current_frame = 0;
+
+/* Pages being fetched from the server */
+static RelayFetch *fetches = NULL;
+
+
+/**
+ * run_relay:
+ * @host: hostname of timing server,
+ * @address: address, or Unix socket path, to listen on; NULL for all.
+ *
+ * Connects to the data stream and passes it on to any number of viewers
+ * who connect to us, as the timing server would, with key frames served
+ * over HTTP so that they can point their host at us unchanged.  Keys are
+ * fetched from the server for each viewer with their own login.
+ *
+ * A viewer that falls too far behind is dropped rather than holding up
+ * the rest; it'll reconnect and catch up from a key frame.
+ *
+ * Returns: exit status for the program, should we fail.
+ **/
+int
+run_relay (const char *host,
+	   const char *address)
+{
+	struct epoll_event  events[16];
+	RelayWatch          stream_listener = { WATCH_LISTEN_STREAM, -1 };
+	RelayWatch          http_listener = { WATCH_LISTEN_HTTP, -1 };
+	RelayViewer        *viewer;
+	int                 nevents, i;
+
+	upstream_host = host;
+	signal (SIGPIPE, SIG_IGN);
+	srandom (time (NULL) ^ getpid ());
+
+	if (address && (address[0] == '/')) {
+		char *http_path;
+
+		http_path = malloc (strlen (address) + 6);
+		sprintf (http_path, "%s.http", address);
+
+		stream_listener.fd = listen_unix (address);
+		http_listener.fd = listen_unix (http_path);
+		free (http_path);
+	} else {
+		stream_listener.fd = listen_tcp (address, RELAY_STREAM_PORT);
+		http_listener.fd = listen_tcp (address, RELAY_HTTP_PORT);
+	}
+
+	if ((stream_listener.fd < 0) || (http_listener.fd < 0)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to listen for viewers"), strerror (errno));
+		return 1;
+	}
+
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	wake.fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	ping.fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	retry.fd = timerfd_create (CLOCK_MONOTONIC,
+				   TFD_CLOEXEC | TFD_NONBLOCK);
+	if ((epfd < 0) || (wake.fd < 0) || (ping.fd < 0) || (retry.fd < 0)
+	    || watch (&stream_listener, EPOLLIN)
+	    || watch (&http_listener, EPOLLIN)
+	    || watch (&wake, EPOLLIN) || watch (&ping, EPOLLIN)
+	    || watch (&retry, EPOLLIN)) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to start relay"), strerror (errno));
+		return 1;
+	}
+
+	if (connect_upstream ()) {
+		fprintf (stderr, "%s: %s: %s\n", program_name,
+			 _("unable to open data stream"), strerror (errno));
+		return 2;
+	}
+
+	arm_in (ping.fd, PING_INTERVAL, PING_INTERVAL);
+	info (0, _("Relaying %s to viewers\n"), host);
+
+	for (;;) {
+		nevents = epoll_wait (epfd, events, 16, -1);
+		if ((nevents < 0) && (errno == EINTR)) {
+			continue;
+		} else if (nevents < 0) {
+			fprintf (stderr, "%s: %s: %s\n", program_name,
+				 _("unable to wait for viewers"),
+				 strerror (errno));
+			return 2;
+		}
+
+		for (i = 0; i < nevents; i++) {
+			RelayWatch *watch = events[i].data.ptr;
+			uint64_t    count;
+
+			/* Dropped while handling an earlier event */
+			if (watch->fd < 0)
+				continue;
+
+			switch (watch->type) {
+			case WATCH_UPSTREAM:
+				read_upstream ();
+				break;
+			case WATCH_LISTEN_STREAM:
+				accept_viewers (watch, FALSE);
+				break;
+			case WATCH_LISTEN_HTTP:
+				accept_viewers (watch, TRUE);
+				break;
+			case WATCH_VIEWER:
+				viewer = (RelayViewer *) watch;
+				if (events[i].events & ~EPOLLOUT)
+					read_viewer (viewer);
+				if ((watch->fd >= 0)
+				    && (events[i].events & EPOLLOUT))
+					flush_viewer (viewer);
+				break;
+			case WATCH_WAKE:
+				read (wake.fd, &count, sizeof (count));
+				finish_fetches ();
+				break;
+			case WATCH_PING:
+				read (ping.fd, &count, sizeof (count));
+				if ((upstream.fd >= 0)
+				    && (monotonic_msecs () - last_heard
+					>= PING_INTERVAL)
+				    && (ping_stream (upstream.fd) <= 0))
+					drop_upstream ();
+				break;
+			case WATCH_RETRY:
+				read (retry.fd, &count, sizeof (count));
+				if (connect_upstream ())
+					drop_upstream ();
+				break;
+			}
+		}
+
+		while (dropped) {
+			viewer = dropped;
+			dropped = viewer->next;
+			free (viewer);
+		}
+	}
+}
+
+
+/**
+ * listen_tcp:
+ * @address: address to listen on, or NULL for all,
+ * @port: port to listen on.
+ *
+ * Returns: listening socket or -1 on failure.
+ **/
+static int
+listen_tcp (const char   *address,
+	    unsigned int  port)
+{
+	struct addrinfo *res, *addr, hints;
+	char             service[6];
+	int              sock = -1, ret;
+
+	sprintf (service, "%hu", port);
+
+	memset (&hints, 0, sizeof (hints));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo (address, service, &hints, &res);
+	if (ret != 0) {
+		fprintf (stderr, "%s: %s: %s: %s\n", program_name,
+			 _("failed to resolve host"), address,
+			 gai_strerror (ret));
+		return -1;
+	}
+
+	for (addr = res; addr; addr = addr->ai_next) {
+		sock = socket (addr->ai_family,
+			       addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			       addr->ai_protocol);
+		if (sock < 0)
+			continue;
+
+		ret = 1;
+		setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &ret, sizeof (ret));
+
+		if ((bind (sock, addr->ai_addr, addr->ai_addrlen) < 0)
+		    || (listen (sock, SOMAXCONN) < 0)) {
+			close (sock);
+			sock = -1;
+			continue;
+		}
+
+		info (2, _("Listening on port %u\n"), port);
+		break;
+	}
+
+	freeaddrinfo (res);
+	return sock;
+}
+
+/**
+ * listen_unix:
+ * @path: path of socket to listen on.
+ *
+ * Replaces any socket left at @path by an earlier relay.
+ *
+ * Returns: listening socket or -1 on failure.
+ **/
+static int
+listen_unix (const char *path)
+{
+	struct sockaddr_un addr;
+	int                sock;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	sock = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	unlink (path);
+	if ((bind (sock, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+	    || (listen (sock, SOMAXCONN) < 0)) {
+		close (sock);
+		return -1;
+	}
+
+	info (2, _("Listening on %s\n"), path);
+	return sock;
+}
+
+/**
+ * watch:
+ * @watch: thing to wait for,
+ * @events: epoll events to wait for.
+ *
+ * Returns: zero on success, non-zero on failure.
+ **/
+static int
+watch (RelayWatch *watch,
+       uint32_t    events)
+{
+	struct epoll_event event;
+
+	memset (&event, 0, sizeof (event));
+	event.events = events;
+	event.data.ptr = watch;
+
+	return epoll_ctl (epfd, EPOLL_CTL_ADD, watch->fd, &event);
+}
+
+
+/**
+ * connect_upstream:
+ *
+ * Connects to the server's data stream; whatever it sends first is the
+ * start of the backlog for new viewers.
+ *
+ * Returns: zero on success, non-zero on failure.
+ **/
+static int
+connect_upstream (void)
+{
+	upstream.fd = open_stream (upstream_host, RELAY_STREAM_PORT);
+	if (upstream.fd < 0)
+		return 1;
+
+	if (watch (&upstream, EPOLLIN)) {
+		close (upstream.fd);
+		upstream.fd = -1;
+		return 1;
+	}
+
+	end_scan_packet ();
+	memset (&scan, 0, sizeof (scan));
+	last_heard = monotonic_msecs ();
+	return 0;
+}
+
+/**
+ * drop_upstream:
+ *
+ * Closes the connection to the data stream, if any, and tries again
+ * after a random wait up to a limit that doubles each time in a row.
+ * Viewers of the stream are dropped too, since what we send next
+ * starts over; they'll reconnect and resync to a key frame.
+ **/
+static void
+drop_upstream (void)
+{
+	RelayViewer   *viewer, *next;
+	unsigned long  limit;
+
+	if (upstream.fd >= 0) {
+		info (1, _("Lost the data stream, reconnecting ...\n"));
+		close (upstream.fd);
+		upstream.fd = -1;
+	}
+
+	for (viewer = viewers; viewer; viewer = next) {
+		next = viewer->next;
+		if (! viewer->http)
+			drop_viewer (viewer);
+	}
+
+	clear_queue (&backlog);
+
+	limit = MIN ((unsigned long) RELAY_RETRY_DELAY << MIN (attempt, 7),
+		     RELAY_RETRY_MAX_DELAY);
+	attempt++;
+
+	arm_in (retry.fd, 1 + random () % limit, 0);
+}
+
+/**
+ * read_upstream:
+ *
+ * Drains the data stream, sending each block read to every viewer and
+ * keeping it in the backlog for new ones.
+ **/
+static void
+read_upstream (void)
+{
+	RelayViewer *viewer, *next;
+	RelayChunk  *chunk;
+	ssize_t      len;
+
+	for (;;) {
+		chunk = new_chunk (NULL, RELAY_CHUNK_SIZE);
+
+		len = recv (upstream.fd, chunk->data, RELAY_CHUNK_SIZE, 0);
+		if (len <= 0) {
+			unref_chunk (chunk);
+
+			if ((len < 0) && (errno == EINTR))
+				continue;
+			if ((len < 0) && (errno == EAGAIN))
+				break;
+
+			drop_upstream ();
+			return;
+		}
+
+		chunk = realloc (chunk, sizeof (RelayChunk) + len);
+		if (! chunk)
+			abort ();
+		chunk->len = len;
+
+		attempt = 0;
+		last_heard = monotonic_msecs ();
+
+		/* The backlog starts again at each key frame marker; should
+		 * there be none for too long, new viewers just get what
+		 * follows and resync to the next.  It's not cleared while
+		 * a packet that may be a marker crosses into the next block,
+		 * since the backlog would then start part way through it */
+		push_queue (&backlog, chunk, 0);
+		scan_chunk (chunk);
+		if ((backlog.len > RELAY_BACKLOG_MAX) && (! scan.start))
+			clear_queue (&backlog);
+
+		for (viewer = viewers; viewer; viewer = next) {
+			next = viewer->next;
+			if (! viewer->http)
+				send_to_viewer (viewer, chunk, 0);
+		}
+
+		unref_chunk (chunk);
+		if (len < RELAY_CHUNK_SIZE)
+			break;
+	}
+}
+
+/**
+ * scan_chunk:
+ * @chunk: block read from the data stream.
+ *
+ * Walks through the packet headers in @chunk, carrying on from the
+ * previous block, looking for key frame markers.
+ **/
+static void
+scan_chunk (RelayChunk *chunk)
+{
+	size_t       pos = 0, needed, n;
+	unsigned int frame;
+	Packet       packet;
+	int          i;
+
+	while (pos < chunk->len) {
+		if (scan.skip) {
+			n = MIN (scan.skip, chunk->len - pos);
+			scan.skip -= n;
+			pos += n;
+			continue;
+		}
+
+		if (! scan.pkt_len) {
+			chunk->refs++;
+			scan.start = chunk;
+			scan.start_off = pos;
+		}
+
+		scan.pkt[scan.pkt_len++] = chunk->data[pos++];
+		if (scan.pkt_len < 2)
+			continue;
+
+		packet_header (scan.pkt, &packet);
+		needed = 2 + MAX (packet.len, 0);
+
+		if (packet.car || (packet.type != SYS_KEY_FRAME)) {
+			scan.skip = needed - scan.pkt_len;
+			scan.pkt_len = 0;
+			end_scan_packet ();
+			continue;
+		} else if (scan.pkt_len < needed) {
+			continue;
+		}
+
+		frame = 0;
+		for (i = packet.len; i > 0; i--) {
+			frame <<= 8;
+			frame |= scan.pkt[1 + i];
+		}
+
+		scan.pkt_len = 0;
+		key_frame_marker (frame, scan.start, scan.start_off);
+		end_scan_packet ();
+	}
+}
+
+/**
+ * end_scan_packet:
+ *
+ * Gives up the block the packet being walked through began in, once
+ * it's no longer needed to mark where the packet began.
+ **/
+static void
+end_scan_packet (void)
+{
+	if (scan.start)
+		unref_chunk (scan.start);
+	scan.start = NULL;
+}
+
+/**
+ * key_frame_marker:
+ * @frame: key frame number,
+ * @chunk: block the marker began in,
+ * @off: offset in @chunk the marker began at.
+ *
+ * Starts the backlog again from the marker, and fetches the key frame
+ * so that it's ready for new viewers.
+ **/
+static void
+key_frame_marker (unsigned int  frame,
+		  RelayChunk   *chunk,
+		  size_t        off)
+{
+	char path[32];
+
+	info (3, _("Key frame %u marked in data stream\n"), frame);
+
+	while (backlog.head && (backlog.head->chunk != chunk))
+		pop_queue (&backlog);
+	if (backlog.head) {
+		backlog.len -= off - backlog.head->off;
+		backlog.head->off = off;
+	}
+
+	current_frame = frame;
+
+	sprintf (path, "%s_%05u.bin", KEYFRAME_URL_PREFIX, frame);
+	if (! find_key_frame (frame))
+		wait_for_fetch (NULL, path, frame);
+}
+
+
+/**
+ * accept_viewers:
+ * @listener: socket viewers connect to,
+ * @http: whether they're asking for pages.
+ *
+ * Accepts every viewer waiting to connect; viewers of the data stream
+ * are sent the backlog first.
+ **/
+static void
+accept_viewers (RelayWatch *listener,
+		int         http)
+{
+	RelayViewer       *viewer;
+	const RelayQueued *queued;
+	int                sock;
+
+	for (;;) {
+		sock = accept4 (listener->fd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if ((sock < 0) && (errno == EINTR))
+			continue;
+		if (sock < 0)
+			break;
+
+		viewer = calloc (1, sizeof (RelayViewer));
+		if (! viewer)
+			abort ();
+
+		viewer->watch.type = WATCH_VIEWER;
+		viewer->watch.fd = sock;
+		viewer->http = http;
+		viewer->events = EPOLLIN;
+
+		if (watch (&viewer->watch, viewer->events)) {
+			close (sock);
+			free (viewer);
+			continue;
+		}
+
+		viewer->next = viewers;
+		viewers = viewer;
+
+		if (http)
+			continue;
+
+		info (2, _("Viewer connected to the data stream\n"));
+		for (queued = backlog.head; queued; queued = queued->next)
+			if (send_to_viewer (viewer, queued->chunk, queued->off))
+				break;
+	}
+}
+
+/**
+ * read_viewer:
+ * @viewer: viewer that sent us something.
+ *
+ * Reads the request of a viewer asking for a page, and handles it once
+ * it's all arrived; anything else viewers of the data stream send us is
+ * just to wake the server up, which is our job.
+ **/
+static void
+read_viewer (RelayViewer *viewer)
+{
+	char    buf[256];
+	ssize_t len;
+
+	for (;;) {
+		if (viewer->http && (! viewer->closing)
+		    && (! viewer->waiting)) {
+			len = recv (viewer->watch.fd,
+				    viewer->req + viewer->req_len,
+				    sizeof (viewer->req) - viewer->req_len - 1,
+				    0);
+		} else {
+			len = recv (viewer->watch.fd, buf, sizeof (buf), 0);
+		}
+
+		if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((len < 0) && (errno == EAGAIN)) {
+			return;
+		} else if (len <= 0) {
+			drop_viewer (viewer);
+			return;
+		}
+
+		if (viewer->http && (! viewer->closing)
+		    && (! viewer->waiting)) {
+			viewer->req_len += len;
+			viewer->req[viewer->req_len] = '\0';
+
+			if (strstr (viewer->req, "\r\n\r\n")) {
+				handle_request (viewer);
+			} else if (viewer->req_len + 1 >= sizeof (viewer->req)) {
+				respond (viewer, 400, NULL);
+			}
+		}
+
+		if (viewer->watch.fd < 0)
+			return;
+	}
+}
+
+/**
+ * handle_request:
+ * @viewer: viewer asking for a page.
+ *
+ * Serves key frames we have and fetches those we don't, and fetches keys
+ * with the viewer's own login.  Nothing else is served.
+ **/
+static void
+handle_request (RelayViewer *viewer)
+{
+	char         *path, *end;
+	unsigned int  frame;
+	int           n = 0;
+
+	if (strncmp (viewer->req, "GET ", 4)) {
+		respond (viewer, 400, NULL);
+		return;
+	}
+
+	path = viewer->req + 4;
+	end = strpbrk (path, " \r\n");
+	if (end)
+		*end = '\0';
+
+	/* The query holds the viewer's cookie, which isn't for the log */
+	info (3, _("Viewer asked for %.*s\n"), (int) strcspn (path, "?"), path);
+
+	if (! strcmp (path, KEYFRAME_URL_PREFIX ".bin")) {
+		if (current_frame) {
+			serve_key_frame (viewer, current_frame);
+		} else {
+			wait_for_fetch (viewer, path, 0);
+		}
+	} else if ((sscanf (path, KEYFRAME_URL_PREFIX "_%u.bin%n",
+			    &frame, &n) == 1) && n && (! path[n])) {
+		serve_key_frame (viewer, frame);
+	} else if (! strncmp (path, KEY_URL_BASE, strlen (KEY_URL_BASE))) {
+		wait_for_fetch (viewer, path, 0);
+	} else {
+		respond (viewer, 404, NULL);
+	}
+}
+
+/**
+ * serve_key_frame:
+ * @viewer: viewer asking for a key frame,
+ * @frame: key frame number.
+ *
+ * Sends the viewer the key frame if we have it, or fetches it for them.
+ **/
+static void
+serve_key_frame (RelayViewer  *viewer,
+		 unsigned int  frame)
+{
+	RelayChunk *chunk;
+	char        path[32];
+
+	chunk = find_key_frame (frame);
+	if (chunk) {
+		respond (viewer, 200, chunk);
+		return;
+	}
+
+	sprintf (path, "%s_%05u.bin", KEYFRAME_URL_PREFIX, frame);
+	wait_for_fetch (viewer, path, frame);
+}
+
+/**
+ * wait_for_fetch:
+ * @viewer: viewer asking for the page, or NULL,
+ * @path: page to fetch,
+ * @frame: key frame number to keep the page as, or zero.
+ *
+ * Has @viewer wait for the page at @path, which is fetched from the
+ * server unless it already is being.
+ **/
+static void
+wait_for_fetch (RelayViewer  *viewer,
+		const char   *path,
+		unsigned int  frame)
+{
+	RelayFetch *fetch;
+
+	for (fetch = fetches; fetch; fetch = fetch->next)
+		if (! strcmp (fetch->path, path))
+			break;
+
+	if (! fetch)
+		fetch = start_fetch (path, frame);
+
+	if (viewer)
+		viewer->waiting = fetch;
+}
+
+/**
+ * respond:
+ * @viewer: viewer asking for a page,
+ * @status: HTTP status,
+ * @body: page to send, or NULL.
+ *
+ * Sends the viewer the page, sharing @body with anyone else it's sent
+ * to, and closes the connection once it's gone.
+ **/
+static void
+respond (RelayViewer *viewer,
+	 int          status,
+	 RelayChunk  *body)
+{
+	RelayChunk *header;
+	const char *reason;
+
+	switch (status) {
+	case 200:
+		reason = "OK";
+		break;
+	case 400:
+		reason = "Bad Request";
+		break;
+	case 404:
+		reason = "Not Found";
+		break;
+	case 502:
+		reason = "Bad Gateway";
+		break;
+	default:
+		reason = "Unknown";
+		break;
+	}
+
+	header = new_chunk (NULL, 128);
+	header->len = snprintf ((char *) header->data, 128,
+				"HTTP/1.1 %d %s\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n"
+				"\r\n", status, reason,
+				body ? body->len : 0);
+
+	push_queue (&viewer->queue, header, 0);
+	if (body)
+		push_queue (&viewer->queue, body, 0);
+	unref_chunk (header);
+
+	viewer->closing = TRUE;
+	flush_viewer (viewer);
+}
+
+/**
+ * send_to_viewer:
+ * @viewer: viewer to send to,
+ * @chunk: data to send,
+ * @off: offset of first byte of @chunk to send.
+ *
+ * Queues the data for the viewer and sends what it'll take now.  A
+ * viewer with too much queued already is dropped instead, so it can't
+ * hold up the others.
+ *
+ * Returns: zero on success, non-zero if the viewer was dropped.
+ **/
+static int
+send_to_viewer (RelayViewer *viewer,
+		RelayChunk  *chunk,
+		size_t       off)
+{
+	if (viewer->queue.len + chunk->len - off > RELAY_QUEUE_MAX) {
+		info (1, _("Dropped a viewer too far behind\n"));
+		drop_viewer (viewer);
+		return 1;
+	}
+
+	push_queue (&viewer->queue, chunk, off);
+	return flush_viewer (viewer);
+}
+
+/**
+ * flush_viewer:
+ * @viewer: viewer to send to.
+ *
+ * Sends as much of the viewer's queue as it'll take without blocking,
+ * and waits until it'll take more if that's not all of it.
+ *
+ * Returns: zero on success, non-zero if the viewer was dropped.
+ **/
+static int
+flush_viewer (RelayViewer *viewer)
+{
+	struct epoll_event  event;
+	struct iovec        iov[RELAY_IOV_MAX];
+	struct msghdr       msg;
+	const RelayQueued  *queued;
+	ssize_t             len;
+	uint32_t            events;
+	int                 n;
+
+	while (viewer->queue.head) {
+		n = 0;
+		for (queued = viewer->queue.head; queued && (n < RELAY_IOV_MAX);
+		     queued = queued->next) {
+			iov[n].iov_base = queued->chunk->data + queued->off;
+			iov[n].iov_len = queued->chunk->len - queued->off;
+			n++;
+		}
+
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		len = sendmsg (viewer->watch.fd, &msg,
+			       MSG_NOSIGNAL | MSG_DONTWAIT);
+		if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((len < 0) && (errno == EAGAIN)) {
+			break;
+		} else if (len < 0) {
+			drop_viewer (viewer);
+			return 1;
+		}
+
+		while (len) {
+			RelayQueued *sent = viewer->queue.head;
+
+			if (len < sent->chunk->len - sent->off) {
+				sent->off += len;
+				viewer->queue.len -= len;
+				break;
+			}
+
+			len -= sent->chunk->len - sent->off;
+			pop_queue (&viewer->queue);
+		}
+	}
+
+	if ((! viewer->queue.head) && viewer->closing) {
+		drop_viewer (viewer);
+		return 1;
+	}
+
+	events = (viewer->queue.head ? EPOLLOUT : 0);
+	if ((! viewer->http) || (! (viewer->closing || viewer->waiting)))
+		events |= EPOLLIN;
+
+	if (events != viewer->events) {
+		memset (&event, 0, sizeof (event));
+		event.events = events;
+		event.data.ptr = &viewer->watch;
+
+		epoll_ctl (epfd, EPOLL_CTL_MOD, viewer->watch.fd, &event);
+		viewer->events = events;
+	}
+
+	return 0;
+}
+
+/**
+ * drop_viewer:
+ * @viewer: viewer to drop.
+ *
+ * Closes the connection to the viewer and forgets it, though it isn't
+ * freed until the events being handled are done with.
+ **/
+static void
+drop_viewer (RelayViewer *viewer)
+{
+	RelayViewer **ptr;
+
+	for (ptr = &viewers; *ptr; ptr = &(*ptr)->next)
+		if (*ptr == viewer) {
+			*ptr = viewer->next;
+			break;
+		}
+
+	if (! viewer->http)
+		info (2, _("Viewer disconnected from the data stream\n"));
+
+	close (viewer->watch.fd);
+	viewer->watch.fd = -1;
+	clear_queue (&viewer->queue);
+
+	viewer->next = dropped;
+	dropped = viewer;
+}
+
+
+/**
+ * start_fetch:
+ * @path: page to fetch,
+ * @frame: key frame number to keep the page as, or zero.
+ *
+ * Fetches the page from the server in the background.
+ *
+ * Returns: fetch in progress.
+ **/
+static RelayFetch *
+start_fetch (const char   *path,
+	     unsigned int  frame)
+{
+	RelayFetch     *fetch;
+	pthread_t       thread;
+	pthread_attr_t  attr;
+
+	fetch = calloc (1, sizeof (RelayFetch));
+	if (! fetch)
+		abort ();
+
+	fetch->path = strdup (path);
+	fetch->frame = frame;
+
+	fetch->next = fetches;
+	fetches = fetch;
+
+	info (3, _("Fetching %.*s ...\n"), (int) strcspn (path, "?"), path);
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create (&thread, &attr, fetch_thread, fetch))
+		fetch_thread (fetch);
+	pthread_attr_destroy (&attr);
+
+	return fetch;
+}
+
+/**
+ * fetch_thread:
+ * @data: page being fetched.
+ *
+ * Fetches the page, then wakes the relay to send it to the viewers
+ * waiting for it.
+ *
+ * Returns: NULL.
+ **/
+static void *
+fetch_thread (void *data)
+{
+	RelayFetch *fetch = data;
+	uint64_t    one = 1;
+
+	fetch->status = fetch_page (upstream_host, fetch->path,
+				    &fetch->buf, &fetch->len);
+
+	__sync_lock_test_and_set (&fetch->done, 1);
+	write (wake.fd, &one, sizeof (one));
+	return NULL;
+}
+
+/**
+ * finish_fetches:
+ *
+ * Sends each page that's been fetched to the viewers waiting for it,
+ * keeping key frames for those who ask later.
+ **/
+static void
+finish_fetches (void)
+{
+	RelayFetch  **ptr, *fetch;
+	RelayViewer  *viewer, *next;
+	RelayChunk   *chunk;
+
+	ptr = &fetches;
+	while ((fetch = *ptr) != NULL) {
+		if (! __sync_fetch_and_add (&fetch->done, 0)) {
+			ptr = &fetch->next;
+			continue;
+		}
+
+		*ptr = fetch->next;
+
+		chunk = new_chunk (fetch->buf, fetch->len);
+		if ((fetch->status == 200) && fetch->frame && fetch->len
+		    && (! find_key_frame (fetch->frame))) {
+			RelayKeyFrame *kept = &key_frames[next_key_frame];
+
+			if (kept->chunk)
+				unref_chunk (kept->chunk);
+
+			kept->frame = fetch->frame;
+			kept->chunk = chunk;
+			chunk->refs++;
+
+			next_key_frame = (next_key_frame + 1) % RELAY_KEY_FRAMES;
+		}
+
+		for (viewer = viewers; viewer; viewer = next) {
+			next = viewer->next;
+			if (viewer->waiting != fetch)
+				continue;
+
+			viewer->waiting = NULL;
+			respond (viewer, fetch->status ? fetch->status : 502,
+				 chunk);
+		}
+
+		unref_chunk (chunk);
+		free (fetch->path);
+		free (fetch->buf);
+		free (fetch);
+	}
+}
+
+/**
+ * find_key_frame:
+ * @frame: key frame number.
+ *
+ * Returns: key frame kept, or NULL if we don't have it.
+ **/
+static RelayChunk *
+find_key_frame (unsigned int frame)
+{
+	int i;
+
+	for (i = 0; i < RELAY_KEY_FRAMES; i++)
+		if (key_frames[i].chunk && (key_frames[i].frame == frame))
+			return key_frames[i].chunk;
+
+	return NULL;
+}
+
+
+/**
+ * new_chunk:
+ * @data: data to copy, or NULL,
+ * @len: length of @data, or space to allocate.
+ *
+ * Returns: newly allocated chunk with one reference.
+ **/
+static RelayChunk *
+new_chunk (const void *data,
+	   size_t      len)
+{
+	RelayChunk *chunk;
+
+	chunk = malloc (sizeof (RelayChunk) + len);
+	if (! chunk)
+		abort ();
+
+	chunk->refs = 1;
+	chunk->len = len;
+	if (data)
+		memcpy (chunk->data, data, len);
+
+	return chunk;
+}
+
+/**
+ * unref_chunk:
+ * @chunk: chunk no longer needed.
+ *
+ * Frees the chunk once nothing needs it.
+ **/
+static void
+unref_chunk (RelayChunk *chunk)
+{
+	if (! --chunk->refs)
+		free (chunk);
+}
+
+/**
+ * push_queue:
+ * @queue: queue to add to,
+ * @chunk: data to add,
+ * @off: offset of first byte of @chunk to add.
+ **/
+static void
+push_queue (RelayQueue *queue,
+	    RelayChunk *chunk,
+	    size_t      off)
+{
+	RelayQueued *queued;
+
+	queued = malloc (sizeof (RelayQueued));
+	if (! queued)
+		abort ();
+
+	queued->next = NULL;
+	queued->chunk = chunk;
+	queued->off = off;
+	chunk->refs++;
+
+	if (queue->tail) {
+		queue->tail->next = queued;
+	} else {
+		queue->head = queued;
+	}
+	queue->tail = queued;
+	queue->len += chunk->len - off;
+}
+
+/**
+ * pop_queue:
+ * @queue: queue to remove from.
+ *
+ * Removes the first entry from the queue.
+ **/
+static void
+pop_queue (RelayQueue *queue)
+{
+	RelayQueued *queued = queue->head;
+
+	queue->head = queued->next;
+	if (! queue->head)
+		queue->tail = NULL;
+	queue->len -= queued->chunk->len - queued->off;
+
+	unref_chunk (queued->chunk);
+	free (queued);
+}
+
+/**
+ * clear_queue:
+ * @queue: queue to empty.
+ **/
+static void
+clear_queue (RelayQueue *queue)
+{
+	while (queue->head)
+		pop_queue (queue);
+}
+
+/**
+ * arm_in:
+ * @fd: timerfd to arm,
+ * @msecs: time until it fires (msecs),
+ * @interval: time between firing after that, or zero (msecs).
+ **/
+static void
+arm_in (int                fd,
+	unsigned long long msecs,
+	unsigned long long interval)
+{
+	struct itimerspec spec;
+
+	spec.it_value.tv_sec = msecs / 1000;
+	spec.it_value.tv_nsec = (msecs % 1000) * 1000000;
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+
+	timerfd_settime (fd, 0, &spec, NULL);
+}
+
+/**
+ * monotonic_msecs:
+ *
+ * Returns: current value of the monotonic clock in milliseconds.
+ **/
+static unsigned long long
+monotonic_msecs (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
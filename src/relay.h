@@ -0,0 +1,37 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RELAY_H
+#define LIVE_F1_RELAY_H
+
+#include "live-f1.h"
+
+
+/* Ports viewers expect the data stream and key frames on */
+#define RELAY_STREAM_PORT 4321
+#define RELAY_HTTP_PORT   80
+
+
+SJR_BEGIN_EXTERN
+
+int run_relay (const char *host, const char *address);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RELAY_H */
@@ -0,0 +1,1065 @@
+/* live-f1
+ *
+ * render.c - drawing the display on a thread of its own
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* The thread that reads and decodes the data stream never touches the
+ * terminal; each display function it calls instead pushes a copy of
+ * what changed into a ring that only it writes and only the render
+ * thread reads, so neither ever waits for the other.  The render
+ * thread applies what it takes out to its own copy of the board, and
+ * draws that with the display code as before, a frame at a time.
+ *
+ * Should the terminal fall so far behind that the ring fills, what
+ * doesn't fit is only noted as dirty: the cells, cars and status that
+ * changed.  Everything after the first such change is noted too, so
+ * that nothing overtakes it, and once there's room again they're sent
+ * with whatever the latest values are by then.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "loop.h"
+#include "packet.h"
+#include "render.h"
+
+
+/* Number of events the ring holds, a power of two */
+#define RENDER_QUEUE_SIZE 1024
+
+/**
+ * RenderEventType:
+ *
+ * Changes to the display the render thread is told of.
+ **/
+typedef enum {
+	RENDER_RESET,
+	RENDER_LAYOUT,
+	RENDER_CELL,
+	RENDER_CAR,
+	RENDER_CLEAR_CAR,
+	RENDER_STATUS,
+	RENDER_TIME,
+	RENDER_BULK_LOAD,
+	RENDER_DECODED,
+	RENDER_POPUP,
+	RENDER_CLOSE_POPUP
+} RenderEventType;
+
+/**
+ * RenderStatus:
+ *
+ * Copy of the parts of the application state shown in the status
+ * window, and above it the session clock.
+ **/
+typedef struct {
+	EventType    event_type;
+	FlagStatus   flag;
+	time_t       remaining_time, epoch_time;
+	unsigned int laps_completed, total_laps;
+
+	int          track_temp, air_temp, humidity;
+	int          wind_speed, wind_direction, pressure;
+
+	char         fl_car[3], fl_driver[15], fl_time[9], fl_lap[3];
+} RenderStatus;
+
+/**
+ * RenderEvent:
+ * @type: what changed,
+ * @car: car it changed for, or zero,
+ * @arg: number of cars for RENDER_RESET and RENDER_LAYOUT, atom for
+ *       RENDER_CELL, position for RENDER_CAR, or +1 or -1 for
+ *       RENDER_BULK_LOAD,
+ * @atom: contents of the atom for RENDER_CELL,
+ * @status: status for RENDER_RESET, RENDER_LAYOUT, RENDER_STATUS and
+ *          RENDER_TIME,
+ * @message: message for RENDER_POPUP, freed by the render thread,
+ * @when: time the changes before RENDER_DECODED were parsed (nsecs).
+ *
+ * One entry in the ring; everything the render thread needs is copied
+ * into it, since the state it came from carries on changing.
+ **/
+typedef struct {
+	RenderEventType type;
+	int             car, arg;
+
+	union {
+		CarAtom             atom;
+		RenderStatus        status;
+		char               *message;
+		unsigned long long  when;
+	} u;
+} RenderEvent;
+
+/**
+ * RenderBacklog:
+ * @any: whether anything at all is waiting,
+ * @layout: board to be laid out again from scratch,
+ * @moved: bitmask of cars whose position changed,
+ * @cells: bitmask of atoms that changed for each car,
+ * @status: status window changed,
+ * @time: session clock changed,
+ * @close_popup: popup to be closed,
+ * @popup: latest message to be shown, or NULL,
+ * @decoded: time the earliest of the changes were parsed (nsecs),
+ * @bulk_load: change in the depth of bulk loads.
+ *
+ * Changes that didn't fit in the ring, collapsed to what's dirty.
+ **/
+typedef struct {
+	int                 any;
+	int                 layout;
+	unsigned int        moved;
+	unsigned int        cells[MAX_CARS + 1];
+	int                 status, time;
+	int                 close_popup;
+	char               *popup;
+	unsigned long long  decoded;
+	int                 bulk_load;
+} RenderBacklog;
+
+
+/* Forward prototypes */
+static void  start_render_thread (void);
+static void *render_main         (void *data);
+static int   push_event          (const RenderEvent *event);
+static int   queue_event         (const RenderEvent *event);
+static void  drain_backlog       (const CurrentState *state);
+static void  apply_events        (void);
+static void  apply_event         (RenderEvent *event);
+static void  show_stray_popup    (void);
+static void  set_status          (const RenderStatus *status);
+static void  copy_status         (RenderStatus *status,
+				  const CurrentState *state);
+static void  copy_text           (char *dst, const char *src, size_t size);
+
+
+/* Render thread running; only ever changed by the decoding thread */
+int rendering = FALSE;
+
+/* Ring of events, and the next to be pushed and taken from it; only the
+ * decoding thread pushes and only the render thread takes */
+static RenderEvent  ring[RENDER_QUEUE_SIZE];
+static unsigned int ring_head = 0;
+static unsigned int ring_tail = 0;
+
+/* Changes that didn't fit, whether anything's been pushed since the
+ * render thread was last woken and whether the board has changed since
+ * it was last told when; all kept by the decoding thread */
+static RenderBacklog backlog;
+static int           pushed = FALSE;
+static int           changed = FALSE;
+
+/* eventfd that wakes the render thread */
+static int render_fd = -1;
+
+/* The two threads, and whether starting the render thread failed */
+static pthread_t render_thread;
+static pthread_t decode_thread;
+static int       render_failed = FALSE;
+
+/* Render thread to finish; user asked to quit */
+static int stopping = FALSE;
+static int quitting = FALSE;
+
+/* Why the render thread gave up, for the decoding thread to report */
+static const char *failure = NULL;
+
+/* Set only on the render thread */
+static __thread int on_render_thread = FALSE;
+
+/* Message from any other thread, handed over under the lock */
+static pthread_mutex_t stray_lock = PTHREAD_MUTEX_INITIALIZER;
+static char           *stray_popup = NULL;
+
+/* Render thread's copy of the board */
+static CurrentState view;
+static CarArena     view_cars;
+static RenderStatus view_status;
+
+
+/**
+ * queue_display:
+ * @open: whether the call would open the display.
+ *
+ * Decides whether a display function should queue its change for the
+ * render thread rather than make it, starting the thread the first time
+ * the display would have been opened.  Calls made on the render thread
+ * itself, and any made while it isn't running, are made as before.
+ *
+ * Returns: TRUE if the change should be queued.
+ **/
+int
+queue_display (int open)
+{
+	if (on_render_thread || headless)
+		return FALSE;
+
+	if ((! rendering) && open && (! render_failed))
+		start_render_thread ();
+
+	return rendering;
+}
+
+/**
+ * start_render_thread:
+ *
+ * Starts the render thread with an empty board, and notes the whole of
+ * the current one as dirty so that it's sent at the next flush.  If the
+ * thread can't be started, the display is drawn by the caller instead.
+ **/
+static void
+start_render_thread (void)
+{
+	if (render_fd < 0)
+		render_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (render_fd < 0) {
+		render_failed = TRUE;
+		return;
+	}
+
+	ring_head = ring_tail = 0;
+	stopping = quitting = FALSE;
+	failure = NULL;
+	pushed = FALSE;
+
+	memset (&backlog, 0, sizeof (backlog));
+	backlog.any = backlog.layout = backlog.status = TRUE;
+
+	memset (&view, 0, sizeof (view));
+	memset (&view_cars, 0, sizeof (view_cars));
+	memset (&view_status, 0, sizeof (view_status));
+	view.cars = &view_cars;
+	view.car_position = view_cars.car_position;
+	view.car_info = view_cars.car_info;
+	view.fl_car = view_status.fl_car;
+	view.fl_driver = view_status.fl_driver;
+	view.fl_time = view_status.fl_time;
+	view.fl_lap = view_status.fl_lap;
+
+	decode_thread = pthread_self ();
+	if (pthread_create (&render_thread, NULL, render_main, NULL)) {
+		render_failed = TRUE;
+		return;
+	}
+
+	rendering = TRUE;
+}
+
+/**
+ * stop_render_thread:
+ *
+ * Stops the render thread, without drawing anything still queued, and
+ * waits for it to finish; the display is then the caller's to close.
+ **/
+void
+stop_render_thread (void)
+{
+	uint64_t     one = 1;
+	unsigned int tail;
+
+	if (! rendering)
+		return;
+
+	__atomic_store_n (&stopping, TRUE, __ATOMIC_RELEASE);
+	write (render_fd, &one, sizeof (one));
+	pthread_join (render_thread, NULL);
+	rendering = FALSE;
+
+	/* Messages never shown */
+	for (tail = ring_tail; tail != ring_head; tail++) {
+		RenderEvent *event = &ring[tail & (RENDER_QUEUE_SIZE - 1)];
+
+		if (event->type == RENDER_POPUP)
+			free (event->u.message);
+	}
+	ring_head = ring_tail = 0;
+
+	free (backlog.popup);
+	memset (&backlog, 0, sizeof (backlog));
+
+	pthread_mutex_lock (&stray_lock);
+	free (stray_popup);
+	stray_popup = NULL;
+	pthread_mutex_unlock (&stray_lock);
+}
+
+/**
+ * render_quitting:
+ *
+ * Returns: TRUE if the user pressed a key to quit on the render thread.
+ **/
+int
+render_quitting (void)
+{
+	return __atomic_load_n (&quitting, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * fail_render:
+ * @message: reason the display can't be drawn.
+ *
+ * Gives up drawing the display because of @message, such as the terminal
+ * being too small for the board.  The decoding thread may be writing the
+ * capture file or shared memory, so it's left to the event loop to close
+ * the display, report @message and exit, as it does when asked to quit.
+ *
+ * Returns: TRUE if called on the render thread, FALSE if the caller
+ * should give up itself.
+ **/
+int
+fail_render (const char *message)
+{
+	if (! on_render_thread)
+		return FALSE;
+
+	if (! quitting) {
+		failure = message;
+		__atomic_store_n (&quitting, TRUE, __ATOMIC_RELEASE);
+		wake_event_loop ();
+	}
+
+	return TRUE;
+}
+
+/**
+ * render_failure:
+ *
+ * Returns: message passed to fail_render() if the render thread gave
+ * up, or NULL.
+ **/
+const char *
+render_failure (void)
+{
+	return render_quitting () ? failure : NULL;
+}
+
+
+/**
+ * render_main:
+ * @data: unused.
+ *
+ * Render thread: takes everything in the ring at once, applies it to
+ * the board and draws it when the next frame is due, handling the keys
+ * pressed meanwhile, then sleeps until there's more, a key or the
+ * frame.  A key to quit is passed on to the event loop, which closes
+ * the display when it's ready.
+ *
+ * Returns: NULL.
+ **/
+static void *
+render_main (void *data)
+{
+	struct pollfd fds[2];
+	uint64_t      count;
+
+	on_render_thread = TRUE;
+
+	while (! __atomic_load_n (&stopping, __ATOMIC_ACQUIRE)) {
+		read (render_fd, &count, sizeof (count));
+
+		show_stray_popup ();
+		apply_events ();
+		if (failure)
+			break;
+
+		if ((handle_keys (&view) < 0) && (! quitting)) {
+			__atomic_store_n (&quitting, TRUE, __ATOMIC_RELEASE);
+			wake_event_loop ();
+		}
+
+		flush_display (&view);
+
+		fds[0].fd = render_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = cursed ? STDIN_FILENO : -1;
+		fds[1].events = POLLIN;
+
+		poll (fds, 2, frame_delay ());
+	}
+
+	return NULL;
+}
+
+/**
+ * push_event:
+ * @event: event to push.
+ *
+ * Copies @event into the ring, unless it's full.
+ *
+ * Returns: TRUE if it was pushed, FALSE if there was no room.
+ **/
+static int
+push_event (const RenderEvent *event)
+{
+	unsigned int head, tail;
+
+	head = ring_head;
+	tail = __atomic_load_n (&ring_tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= RENDER_QUEUE_SIZE)
+		return FALSE;
+
+	ring[head & (RENDER_QUEUE_SIZE - 1)] = *event;
+	__atomic_store_n (&ring_head, head + 1, __ATOMIC_RELEASE);
+
+	pushed = TRUE;
+	return TRUE;
+}
+
+/**
+ * queue_event:
+ * @event: event to push.
+ *
+ * Pushes @event, unless earlier changes are already waiting in the
+ * backlog, which it mustn't overtake.
+ *
+ * Returns: TRUE if it was pushed, FALSE if it should be noted in the
+ * backlog instead.
+ **/
+static int
+queue_event (const RenderEvent *event)
+{
+	if (backlog.any)
+		return FALSE;
+
+	return push_event (event);
+}
+
+/**
+ * queue_layout:
+ * @state: application state structure.
+ *
+ * Queues the board to be laid out again, as clear_board() would; when
+ * the cars have been forgotten, the render thread forgets them too.
+ **/
+void
+queue_layout (const CurrentState *state)
+{
+	RenderEvent event;
+
+	event.type = state->cars ? RENDER_LAYOUT : RENDER_RESET;
+	event.car = 0;
+	event.arg = state->num_cars;
+	copy_status (&event.u.status, state);
+
+	changed = TRUE;
+	if (queue_event (&event))
+		return;
+
+	backlog.layout = TRUE;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * queue_cell:
+ * @state: application state structure,
+ * @car: car number to update,
+ * @type: atom to update.
+ *
+ * Queues the cell to be drawn with its new contents, as update_cell()
+ * would.
+ **/
+void
+queue_cell (const CurrentState *state,
+	    int                 car,
+	    int                 type)
+{
+	RenderEvent event;
+
+	event.type = RENDER_CELL;
+	event.car = car;
+	event.arg = type;
+	event.u.atom = state->car_info[car - 1][type];
+
+	changed = TRUE;
+	if (queue_event (&event))
+		return;
+
+	backlog.cells[car] |= 1U << type;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * queue_car:
+ * @state: application state structure,
+ * @car: car number to update.
+ *
+ * Queues the car to be drawn in its new position, as update_car()
+ * would; any other car the render thread has there is taken off.
+ **/
+void
+queue_car (const CurrentState *state,
+	   int                 car)
+{
+	RenderEvent event;
+
+	event.type = RENDER_CAR;
+	event.car = car;
+	event.arg = state->car_position[car - 1];
+
+	changed = TRUE;
+	if (queue_event (&event))
+		return;
+
+	backlog.moved |= 1U << car;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * queue_clear_car:
+ * @state: application state structure,
+ * @car: car number to update.
+ *
+ * Queues the car to be taken off the board, as clear_car() would.
+ **/
+void
+queue_clear_car (const CurrentState *state,
+		 int                 car)
+{
+	RenderEvent event;
+
+	event.type = RENDER_CLEAR_CAR;
+	event.car = car;
+	event.arg = 0;
+
+	changed = TRUE;
+	if (queue_event (&event))
+		return;
+
+	backlog.moved |= 1U << car;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * queue_status:
+ * @state: application state structure.
+ *
+ * Queues the status window to be drawn, as update_status() would.
+ **/
+void
+queue_status (const CurrentState *state)
+{
+	RenderEvent event;
+
+	event.type = RENDER_STATUS;
+	event.car = event.arg = 0;
+	copy_status (&event.u.status, state);
+
+	changed = TRUE;
+	if (queue_event (&event))
+		return;
+
+	backlog.status = TRUE;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * queue_time:
+ * @state: application state structure.
+ *
+ * Queues the session clock to be drawn, as update_time() would.
+ **/
+void
+queue_time (const CurrentState *state)
+{
+	RenderEvent event;
+
+	event.type = RENDER_TIME;
+	event.car = event.arg = 0;
+	copy_status (&event.u.status, state);
+
+	if (queue_event (&event))
+		return;
+
+	backlog.time = TRUE;
+	backlog.any = TRUE;
+}
+
+/**
+ * queue_bulk_load:
+ * @depth: +1 to begin a bulk load, -1 to end one.
+ *
+ * Queues a bulk load to begin or end, as begin_bulk_load() and
+ * end_bulk_load() would.
+ **/
+void
+queue_bulk_load (int depth)
+{
+	RenderEvent event;
+
+	event.type = RENDER_BULK_LOAD;
+	event.car = 0;
+	event.arg = depth;
+
+	if (queue_event (&event))
+		return;
+
+	backlog.bulk_load += depth;
+	backlog.any = TRUE;
+}
+
+/**
+ * queue_decoded:
+ * @when: time the changes were parsed (nsecs).
+ *
+ * Tells the render thread when the changes queued since it was last
+ * told were parsed, as mark_decoded() would; if none were, there's
+ * nothing to tell.  Only the earliest time waiting in the backlog is
+ * kept.
+ **/
+void
+queue_decoded (unsigned long long when)
+{
+	RenderEvent event;
+
+	if (! changed)
+		return;
+	changed = FALSE;
+
+	event.type = RENDER_DECODED;
+	event.car = event.arg = 0;
+	event.u.when = when;
+
+	if (queue_event (&event))
+		return;
+
+	if (! backlog.decoded)
+		backlog.decoded = when;
+	backlog.any = TRUE;
+}
+
+/**
+ * queue_popup:
+ * @message: message to display.
+ *
+ * Queues @message to be shown, as popup_message() would; only the
+ * latest waiting in the backlog is kept.  Messages from threads other
+ * than the decoding thread are handed straight to the render thread.
+ **/
+void
+queue_popup (const char *message)
+{
+	RenderEvent event;
+
+	if (! pthread_equal (pthread_self (), decode_thread)) {
+		uint64_t one = 1;
+
+		pthread_mutex_lock (&stray_lock);
+		free (stray_popup);
+		stray_popup = strdup (message);
+		pthread_mutex_unlock (&stray_lock);
+
+		write (render_fd, &one, sizeof (one));
+		return;
+	}
+
+	event.type = RENDER_POPUP;
+	event.car = event.arg = 0;
+	event.u.message = strdup (message);
+	if (! event.u.message)
+		return;
+
+	if (queue_event (&event))
+		return;
+
+	free (backlog.popup);
+	backlog.popup = event.u.message;
+	backlog.any = TRUE;
+}
+
+/**
+ * queue_close_popup:
+ *
+ * Queues the popup to be closed, as close_popup() would.
+ **/
+void
+queue_close_popup (void)
+{
+	RenderEvent event;
+
+	event.type = RENDER_CLOSE_POPUP;
+	event.car = event.arg = 0;
+
+	if (queue_event (&event))
+		return;
+
+	backlog.close_popup = TRUE;
+	backlog.any = TRUE;
+	free (backlog.popup);
+	backlog.popup = NULL;
+}
+
+/**
+ * flush_queue:
+ * @state: application state structure.
+ *
+ * Sends what it can of the backlog, then wakes the render thread if
+ * anything was pushed since it was last woken.  Called where the
+ * display would have been flushed, so a burst of packets costs a single
+ * wakeup.
+ **/
+void
+flush_queue (const CurrentState *state)
+{
+	uint64_t one = 1;
+
+	if (backlog.any)
+		drain_backlog (state);
+
+	if (pushed) {
+		write (render_fd, &one, sizeof (one));
+		pushed = FALSE;
+	}
+}
+
+/**
+ * drain_backlog:
+ * @state: application state structure.
+ *
+ * Pushes the changes noted in the backlog, taking their contents from
+ * @state as it is now, in the order they'd have been made: the layout,
+ * each car's position and then its cells, the status, when they were
+ * parsed, any popup and last the end of a bulk load.  Whatever doesn't fit stays noted.
+ **/
+static void
+drain_backlog (const CurrentState *state)
+{
+	RenderEvent event;
+	int         car, type;
+
+	if (backlog.layout) {
+		event.type = RENDER_RESET;
+		event.car = 0;
+		event.arg = state->num_cars;
+		copy_status (&event.u.status, state);
+		if (! push_event (&event))
+			return;
+
+		/* Every car, having been forgotten, is sent again */
+		backlog.layout = FALSE;
+		for (car = 1; car <= state->num_cars; car++) {
+			backlog.moved |= 1U << car;
+			backlog.cells[car] = (1U << LAST_CAR_PACKET) - 1;
+		}
+	}
+
+	for (car = 1; car <= state->num_cars; car++) {
+		if (backlog.moved & (1U << car)) {
+			event.type = RENDER_CAR;
+			event.car = car;
+			event.arg = state->car_position[car - 1];
+			if (! push_event (&event))
+				return;
+
+			backlog.moved &= ~(1U << car);
+		}
+
+		for (type = 0; backlog.cells[car]; type++) {
+			if (! (backlog.cells[car] & (1U << type)))
+				continue;
+
+			event.type = RENDER_CELL;
+			event.car = car;
+			event.arg = type;
+			event.u.atom = state->car_info[car - 1][type];
+			if (! push_event (&event))
+				return;
+
+			backlog.cells[car] &= ~(1U << type);
+		}
+	}
+	backlog.moved = 0;
+	memset (backlog.cells, 0, sizeof (backlog.cells));
+
+	if (backlog.status || backlog.time) {
+		event.type = backlog.status ? RENDER_STATUS : RENDER_TIME;
+		event.car = event.arg = 0;
+		copy_status (&event.u.status, state);
+		if (! push_event (&event))
+			return;
+
+		backlog.status = backlog.time = FALSE;
+	}
+
+	if (backlog.decoded) {
+		event.type = RENDER_DECODED;
+		event.car = event.arg = 0;
+		event.u.when = backlog.decoded;
+		if (! push_event (&event))
+			return;
+
+		backlog.decoded = 0;
+	}
+
+	if (backlog.close_popup) {
+		event.type = RENDER_CLOSE_POPUP;
+		event.car = event.arg = 0;
+		if (! push_event (&event))
+			return;
+
+		backlog.close_popup = FALSE;
+	}
+
+	if (backlog.popup) {
+		event.type = RENDER_POPUP;
+		event.car = event.arg = 0;
+		event.u.message = backlog.popup;
+		if (! push_event (&event))
+			return;
+
+		backlog.popup = NULL;
+	}
+
+	while (backlog.bulk_load) {
+		event.type = RENDER_BULK_LOAD;
+		event.car = 0;
+		event.arg = (backlog.bulk_load > 0) ? 1 : -1;
+		if (! push_event (&event))
+			return;
+
+		backlog.bulk_load -= event.arg;
+	}
+
+	backlog.any = FALSE;
+}
+
+/**
+ * apply_events:
+ *
+ * Takes everything in the ring, applying each in turn to the render
+ * thread's copy of the board; each slot is given back as soon as it's
+ * been applied.
+ **/
+static void
+apply_events (void)
+{
+	unsigned int head, tail;
+
+	tail = ring_tail;
+	head = __atomic_load_n (&ring_head, __ATOMIC_ACQUIRE);
+
+	while ((tail != head) && (! failure)) {
+		apply_event (&ring[tail & (RENDER_QUEUE_SIZE - 1)]);
+		__atomic_store_n (&ring_tail, ++tail, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * apply_event:
+ * @event: event taken from the ring.
+ *
+ * Makes the change in @event to the render thread's copy of the board,
+ * and marks it to be drawn with the display functions, just as the
+ * decoding thread did before it had a thread of its own.
+ **/
+static void
+apply_event (RenderEvent *event)
+{
+	int i;
+
+	switch (event->type) {
+	case RENDER_RESET:
+		memset (&view_cars, 0, sizeof (view_cars));
+		/* fall through */
+	case RENDER_LAYOUT:
+		set_status (&event->u.status);
+		view.num_cars = MIN (event->arg, MAX_CARS);
+		clear_board (&view);
+		break;
+	case RENDER_CELL:
+		if ((event->car < 1) || (event->car > view.num_cars))
+			break;
+
+		view.car_info[event->car - 1][event->arg] = event->u.atom;
+		update_cell (&view, event->car, event->arg);
+		break;
+	case RENDER_CAR:
+		if ((event->car < 1) || (event->car > view.num_cars))
+			break;
+
+		if (view.car_position[event->car - 1] != event->arg)
+			clear_car (&view, event->car);
+		for (i = 0; i < view.num_cars; i++)
+			if (view.car_position[i] == event->arg)
+				view.car_position[i] = 0;
+
+		view.car_position[event->car - 1] = event->arg;
+		if (event->arg)
+			update_car (&view, event->car);
+		break;
+	case RENDER_CLEAR_CAR:
+		if ((event->car < 1) || (event->car > view.num_cars))
+			break;
+
+		clear_car (&view, event->car);
+		view.car_position[event->car - 1] = 0;
+		break;
+	case RENDER_STATUS:
+		set_status (&event->u.status);
+		update_status (&view);
+		break;
+	case RENDER_TIME:
+		set_status (&event->u.status);
+		update_time (&view);
+		break;
+	case RENDER_BULK_LOAD:
+		if (event->arg > 0) {
+			begin_bulk_load ();
+		} else {
+			end_bulk_load (&view);
+		}
+		break;
+	case RENDER_DECODED:
+		mark_decoded (event->u.when);
+		break;
+	case RENDER_POPUP:
+		popup_message (event->u.message);
+		free (event->u.message);
+		break;
+	case RENDER_CLOSE_POPUP:
+		close_popup ();
+		break;
+	}
+}
+
+/**
+ * show_stray_popup:
+ *
+ * Shows the latest message handed over by a thread other than the
+ * decoding thread, if there is one.
+ **/
+static void
+show_stray_popup (void)
+{
+	char *message;
+
+	pthread_mutex_lock (&stray_lock);
+	message = stray_popup;
+	stray_popup = NULL;
+	pthread_mutex_unlock (&stray_lock);
+
+	if (message) {
+		popup_message (message);
+		free (message);
+	}
+}
+
+/**
+ * set_status:
+ * @status: status taken from the ring.
+ *
+ * Copies @status into the render thread's copy of the board; the fastest
+ * lap strings there point into view_status.
+ **/
+static void
+set_status (const RenderStatus *status)
+{
+	view_status = *status;
+
+	view.event_type = status->event_type;
+	view.flag = status->flag;
+	view.remaining_time = status->remaining_time;
+	view.epoch_time = status->epoch_time;
+	view.laps_completed = status->laps_completed;
+	view.total_laps = status->total_laps;
+
+	view.track_temp = status->track_temp;
+	view.air_temp = status->air_temp;
+	view.humidity = status->humidity;
+	view.wind_speed = status->wind_speed;
+	view.wind_direction = status->wind_direction;
+	view.pressure = status->pressure;
+}
+
+/**
+ * copy_status:
+ * @status: status to copy into,
+ * @state: application state structure.
+ *
+ * Copies the parts of @state shown in the status window into @status.
+ **/
+static void
+copy_status (RenderStatus       *status,
+	     const CurrentState *state)
+{
+	status->event_type = state->event_type;
+	status->flag = state->flag;
+	status->remaining_time = state->remaining_time;
+	status->epoch_time = state->epoch_time;
+	status->laps_completed = state->laps_completed;
+	status->total_laps = state->total_laps;
+
+	status->track_temp = state->track_temp;
+	status->air_temp = state->air_temp;
+	status->humidity = state->humidity;
+	status->wind_speed = state->wind_speed;
+	status->wind_direction = state->wind_direction;
+	status->pressure = state->pressure;
+
+	copy_text (status->fl_car, state->fl_car, sizeof (status->fl_car));
+	copy_text (status->fl_driver, state->fl_driver,
+		   sizeof (status->fl_driver));
+	copy_text (status->fl_time, state->fl_time, sizeof (status->fl_time));
+	copy_text (status->fl_lap, state->fl_lap, sizeof (status->fl_lap));
+}
+
+/**
+ * copy_text:
+ * @dst: buffer to copy into,
+ * @src: string to copy, or NULL,
+ * @size: size of @dst.
+ *
+ * Copies as much of @src as fits into @dst, always NUL-terminating it.
+ **/
+static void
+copy_text (char       *dst,
+	   const char *src,
+	   size_t      size)
+{
+	size_t len;
+
+	len = src ? strnlen (src, size - 1) : 0;
+	memcpy (dst, src ? src : "", len);
+	dst[len] = '\0';
+}
@@ -0,0 +1,53 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_RENDER_H
+#define LIVE_F1_RENDER_H
+
+#include "live-f1.h"
+
+
+SJR_BEGIN_EXTERN
+
+/* Render thread running; only ever changed by the decoding thread */
+extern int rendering;
+
+
+int  queue_display      (int open);
+void stop_render_thread (void);
+int  render_quitting    (void);
+int  fail_render        (const char *message);
+
+const char *render_failure (void);
+
+void queue_layout       (const CurrentState *state);
+void queue_cell         (const CurrentState *state, int car, int type);
+void queue_car          (const CurrentState *state, int car);
+void queue_clear_car    (const CurrentState *state, int car);
+void queue_status       (const CurrentState *state);
+void queue_time         (const CurrentState *state);
+void queue_bulk_load    (int depth);
+void queue_decoded      (unsigned long long when);
+void queue_popup        (const char *message);
+void queue_close_popup  (void);
+void flush_queue        (const CurrentState *state);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_RENDER_H */
@@ -0,0 +1,542 @@
+/* live-f1
+ *
+ * replay.c - replaying of captured data streams
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "display.h"
+#include "record.h"
+#include "stream.h"
+#include "replay.h"
+
+
+/* Longest we sleep before returning to the caller (usecs) */
+#define REPLAY_MAX_SLEEP 100000
+
+/* Longest we parse for before returning when unpaced (usecs) */
+#define REPLAY_MAX_BUSY 10000
+
+
+/**
+ * ReplayEntry:
+ * @number: key frame or event number the entry is for,
+ * @value: value recorded,
+ * @offset: offset of the record within the capture.
+ *
+ * Index of the out-of-band records in the capture file, which are
+ * looked up when the stream parser asks for them rather than being
+ * replayed in sequence.
+ **/
+typedef struct {
+	unsigned int number, value;
+	size_t       offset;
+} ReplayEntry;
+
+/**
+ * ReplayIndex:
+ * @entries: array of entries,
+ * @len: number of entries in @entries.
+ **/
+typedef struct {
+	ReplayEntry *entries;
+	size_t       len;
+} ReplayIndex;
+
+
+/* Forward prototypes */
+static int  index_capture (void);
+static void index_add     (ReplayIndex *index, unsigned int number,
+			   unsigned int value, size_t offset);
+static const ReplayEntry *index_find (const ReplayIndex *index,
+				      unsigned int number, int any);
+static unsigned long long monotonic_usecs (void);
+
+
+/* Capture file being replayed */
+int replaying = 0;
+
+/* Mapping of the capture file */
+static const unsigned char *rp_map = NULL;
+static size_t               rp_size = 0;
+
+/* Offset of the next record to be replayed, and of the one being
+ * replayed (or of the key frame record being parsed).
+ */
+static size_t rp_pos = 0;
+static size_t rp_here = 0;
+
+/* Playback speed, zero means as fast as possible */
+static double rp_speed = 1.0;
+
+/* Capture time of the last record replayed, and the monotonic clock
+ * time playback started (usecs).
+ */
+static unsigned long long rp_clock = 0;
+static unsigned long long rp_start_usecs = 0;
+
+/* Index of key frames, decryption keys and total laps */
+static ReplayIndex rp_key_frames = { NULL, 0 };
+static ReplayIndex rp_keys = { NULL, 0 };
+static ReplayIndex rp_laps = { NULL, 0 };
+
+/* Key to use for events whose key wasn't captured */
+static unsigned int rp_key = 0;
+
+
+/**
+ * open_replay:
+ * @filename: capture file to replay,
+ * @speed: playback speed multiplier.
+ *
+ * Maps the capture file @filename into memory and indexes the key
+ * frames, decryption keys and lap counts recorded in it.  Once open,
+ * the HTTP functions return the recorded data instead of making
+ * requests.
+ *
+ * @speed is the multiplier applied to the recorded time between data
+ * stream blocks; or zero to replay them as fast as possible.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_replay (const char *filename,
+	     double      speed)
+{
+	struct stat  statbuf;
+	void        *map;
+	int          fd;
+
+	if (replaying)
+		close_replay ();
+
+	fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (fstat (fd, &statbuf) < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		close (fd);
+		return 1;
+	}
+
+	if (statbuf.st_size < CAPTURE_HEADER_LEN) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 _("not a capture file"));
+		close (fd);
+		return 1;
+	}
+
+	map = mmap (NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 strerror (errno));
+		return 1;
+	}
+
+	rp_map = map;
+	rp_size = statbuf.st_size;
+
+	if (memcmp (rp_map, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)
+	    || (rp_map[CAPTURE_MAGIC_LEN] != CAPTURE_VERSION)) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 _("not a capture file"));
+		munmap (map, rp_size);
+		rp_map = NULL;
+		return 1;
+	}
+
+	if (index_capture ()) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, filename,
+			 _("capture file is corrupt, replaying what we can"));
+	}
+
+	madvise (map, rp_size, MADV_SEQUENTIAL);
+
+	rp_pos = rp_here = CAPTURE_HEADER_LEN;
+	rp_speed = MAX (speed, 0.0);
+	rp_clock = 0;
+	rp_start_usecs = monotonic_usecs ();
+	replaying = 1;
+
+	info (2, _("Replaying %s (%zu key frames)\n"), filename,
+	      rp_key_frames.len);
+
+	return 0;
+}
+
+/**
+ * close_replay:
+ *
+ * Unmaps the capture file being replayed and frees the index.
+ **/
+void
+close_replay (void)
+{
+	if (! replaying)
+		return;
+
+	munmap ((void *) rp_map, rp_size);
+	rp_map = NULL;
+	rp_size = 0;
+
+	free (rp_key_frames.entries);
+	free (rp_keys.entries);
+	free (rp_laps.entries);
+	memset (&rp_key_frames, 0, sizeof (rp_key_frames));
+	memset (&rp_keys, 0, sizeof (rp_keys));
+	memset (&rp_laps, 0, sizeof (rp_laps));
+
+	replaying = 0;
+}
+
+/**
+ * read_replay:
+ * @state: application state structure.
+ *
+ * Replays the next data stream blocks from the capture file, passing
+ * them directly from the mapping to parse_stream_block().  When the
+ * playback is paced and the next block isn't due yet, sleeps for a
+ * short while instead so that the caller can check for key presses.
+ *
+ * Returns: 0 at the end of the capture, > 0 on success, < 0 on error.
+ **/
+int
+read_replay (CurrentState *state)
+{
+	unsigned long long busy_until;
+	size_t             count = 0;
+
+	busy_until = monotonic_usecs () + REPLAY_MAX_BUSY;
+
+	for (;;) {
+		const unsigned char *buf;
+		size_t               buf_len;
+		CaptureRecord        record;
+		int                  ret;
+
+		buf = rp_map + rp_pos;
+		buf_len = rp_size - rp_pos;
+
+		ret = parse_record (&buf, &buf_len, &record);
+		if (ret <= 0)
+			return count ? (int) count : ret;
+
+		if (rp_speed > 0.0) {
+			unsigned long long now, due;
+
+			now = monotonic_usecs ();
+			due = rp_start_usecs + ((rp_clock + record.delta)
+						/ rp_speed);
+			if (due > now) {
+				struct timespec ts;
+				unsigned long long wait;
+
+				if (count)
+					return count;
+
+				wait = MIN (due - now, REPLAY_MAX_SLEEP);
+				ts.tv_sec = wait / 1000000;
+				ts.tv_nsec = (wait % 1000000) * 1000;
+				nanosleep (&ts, NULL);
+
+				update_time (state);
+				return 1;
+			}
+		}
+
+		rp_here = rp_pos;
+		rp_pos = buf - rp_map;
+		rp_clock += record.delta;
+
+		if (record.type == RECORD_STREAM) {
+			parse_stream_block (state, record.data, record.len);
+			count += record.len;
+		}
+
+		if (monotonic_usecs () > busy_until)
+			return MAX (count, 1);
+	}
+}
+
+/**
+ * replay_key_frame:
+ * @frame: key frame number to replay,
+ * @userdata: pointer to pass to stream parser.
+ *
+ * Replays the key frame numbered from the capture file, parsing each
+ * block of it in the order it was received from the website.  Where the
+ * same frame was captured more than once, the first copy after the
+ * current playback position is used.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+replay_key_frame (unsigned int  frame,
+		  void         *userdata)
+{
+	const ReplayEntry   *entry;
+	const unsigned char *buf;
+	size_t               buf_len, saved_here;
+	CaptureRecord        record;
+	int                  depth = 0;
+
+	entry = index_find (&rp_key_frames, frame, 0);
+	if (! entry) {
+		info (2, _("Key frame %d not in capture\n"), frame);
+		return 1;
+	}
+
+	info (2, _("Replaying key frame %d ...\n"), frame);
+
+	saved_here = rp_here;
+	buf = rp_map + entry->offset;
+	buf_len = rp_size - entry->offset;
+
+	/* Skip the begin record */
+	parse_record (&buf, &buf_len, &record);
+
+	for (;;) {
+		rp_here = buf - rp_map;
+		if (parse_record (&buf, &buf_len, &record) <= 0)
+			break;
+
+		if (record.type == RECORD_KEY_FRAME_BEGIN) {
+			depth++;
+		} else if (record.type == RECORD_KEY_FRAME_END) {
+			if (! depth--)
+				break;
+		} else if ((record.type == RECORD_KEY_FRAME) && (! depth)) {
+			parse_stream_block (userdata, record.data,
+					    record.len);
+		}
+	}
+
+	rp_here = saved_here;
+
+	info (3, _("Key frame received\n"));
+	return 0;
+}
+
+/**
+ * replay_decryption_key:
+ * @event_no: official event number.
+ *
+ * Returns: decryption key recorded for the event, the key given to
+ * set_replay_key() if it was not captured, or zero if neither.
+ **/
+unsigned int
+replay_decryption_key (unsigned int event_no)
+{
+	const ReplayEntry *entry;
+
+	entry = index_find (&rp_keys, event_no, 0);
+	if ((! entry) && rp_key) {
+		info (3, _("Using given decryption key: %08x\n"), rp_key);
+		return rp_key;
+	} else if (! entry) {
+		info (1, _("Decryption key for event %d not in capture\n"),
+		      event_no);
+		return 0;
+	}
+
+	info (3, _("Got decryption key: %08x\n"), entry->value);
+	return entry->value;
+}
+
+/**
+ * set_replay_key:
+ * @key: decryption key.
+ *
+ * Sets the decryption key used for events whose key is not in the
+ * capture, e.g. one found with recover_key().
+ **/
+void
+set_replay_key (unsigned int key)
+{
+	rp_key = key;
+}
+
+/**
+ * replay_total_laps:
+ *
+ * Returns: total number of laps recorded nearest to the current
+ * playback position, or zero if it was not captured.
+ **/
+unsigned int
+replay_total_laps (void)
+{
+	const ReplayEntry *entry;
+
+	entry = index_find (&rp_laps, 0, 1);
+
+	return entry ? entry->value : 0;
+}
+
+
+/**
+ * index_capture:
+ *
+ * Scans the whole capture file, adding each key frame, decryption key
+ * and lap count to the relevant index.
+ *
+ * Returns: 0 on success, -1 if the capture was truncated or corrupt.
+ **/
+static int
+index_capture (void)
+{
+	const unsigned char *buf;
+	size_t               buf_len, offset;
+	CaptureRecord        record;
+	int                  ret;
+
+	buf = rp_map + CAPTURE_HEADER_LEN;
+	buf_len = rp_size - CAPTURE_HEADER_LEN;
+
+	for (;;) {
+		offset = buf - rp_map;
+
+		ret = parse_record (&buf, &buf_len, &record);
+		if (ret <= 0)
+			break;
+
+		switch (record.type) {
+		case RECORD_KEY_FRAME_BEGIN:
+			index_add (&rp_key_frames,
+				   record_data_number (&record, 0), 0, offset);
+			break;
+		case RECORD_KEY:
+			index_add (&rp_keys, record_data_number (&record, 0),
+				   record_data_number (&record, 4), offset);
+			break;
+		case RECORD_TOTAL_LAPS:
+			index_add (&rp_laps, 0,
+				   record_data_number (&record, 0), offset);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Stop replaying at the corruption */
+	if (ret < 0)
+		rp_size = offset;
+
+	return ret;
+}
+
+/**
+ * index_add:
+ * @index: index to add to,
+ * @number: key frame or event number,
+ * @value: value recorded,
+ * @offset: offset of the record.
+ *
+ * Appends an entry to @index; since the capture is scanned in order,
+ * the index is always sorted by @offset.
+ **/
+static void
+index_add (ReplayIndex  *index,
+	   unsigned int  number,
+	   unsigned int  value,
+	   size_t        offset)
+{
+	ReplayEntry *entry;
+
+	index->entries = realloc (index->entries,
+				  sizeof (ReplayEntry) * (index->len + 1));
+	if (! index->entries)
+		abort ();
+
+	entry = &index->entries[index->len++];
+	entry->number = number;
+	entry->value = value;
+	entry->offset = offset;
+}
+
+/**
+ * index_find:
+ * @index: index to search,
+ * @number: key frame or event number to look for,
+ * @any: TRUE to ignore @number.
+ *
+ * Finds the entry for @number in @index that was recorded soonest after
+ * the record currently being replayed, since that's the one that the
+ * live client fetched while handling it; or failing that, the last one
+ * recorded before it.
+ *
+ * Returns: entry found or NULL.
+ **/
+static const ReplayEntry *
+index_find (const ReplayIndex *index,
+	    unsigned int       number,
+	    int                any)
+{
+	const ReplayEntry *found = NULL;
+	size_t             i;
+
+	for (i = 0; i < index->len; i++) {
+		const ReplayEntry *entry = &index->entries[i];
+
+		if ((! any) && (entry->number != number))
+			continue;
+
+		found = entry;
+		if (entry->offset > rp_here)
+			break;
+	}
+
+	return found;
+}
+
+/**
+ * monotonic_usecs:
+ *
+ * Returns: current value of the monotonic clock in microseconds.
+ **/
+static unsigned long long
+monotonic_usecs (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
@@ -0,0 +1,43 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_REPLAY_H
+#define LIVE_F1_REPLAY_H
+
+#include "live-f1.h"
+
+
+SJR_BEGIN_EXTERN
+
+/* Capture file being replayed */
+extern int replaying;
+
+
+int          open_replay           (const char *filename, double speed);
+void         close_replay          (void);
+int          read_replay           (CurrentState *state);
+
+int          replay_key_frame      (unsigned int frame, void *userdata);
+unsigned int replay_decryption_key (unsigned int event_no);
+void         set_replay_key        (unsigned int key);
+unsigned int replay_total_laps     (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_REPLAY_H */
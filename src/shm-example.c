@@ -0,0 +1,132 @@
+/* live-f1
+ *
+ * shm-example.c - example reader of the board published with --shm
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/* Prints the top of the timing board, and the session clock, once a
+ * second from the shared memory object live-f1 publishes it to; using
+ * nothing but live-f1-shm.h, as any other reader would.
+ *
+ * Usage: live-f1-shm-example [NAME]
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1-shm.h"
+
+
+/* Number of positions printed */
+#define EXAMPLE_POSITIONS 10
+
+
+int
+main (int   argc,
+      char *argv[])
+{
+	const LiveF1Shm *shm;
+	const char      *name;
+	int              fd;
+
+	name = (argc > 1) ? argv[1] : LIVE_F1_SHM_NAME;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror (name);
+		return 1;
+	}
+
+	shm = mmap (NULL, sizeof (LiveF1Shm), PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (shm == MAP_FAILED) {
+		perror (name);
+		return 1;
+	}
+
+	if ((__atomic_load_n (&shm->magic, __ATOMIC_ACQUIRE)
+	     != LIVE_F1_SHM_MAGIC)
+	    || (shm->version != LIVE_F1_SHM_VERSION)
+	    || (shm->size != sizeof (LiveF1Shm))) {
+		fprintf (stderr, "%s: not a live-f1 board of this version\n",
+			 name);
+		return 1;
+	}
+
+	for (;;) {
+		char     driver[EXAMPLE_POSITIONS][16];
+		int32_t  number[EXAMPLE_POSITIONS];
+		int64_t  remaining, epoch;
+		uint64_t updates;
+		uint32_t seq, laps, total_laps, num_cars;
+		int      i;
+
+		/* Only what's printed is taken out of the board; nothing
+		 * else is copied, and nothing is trusted until it's known
+		 * to be consistent */
+		do {
+			seq = live_f1_shm_begin (shm);
+
+			updates = shm->updates;
+			remaining = shm->remaining_time;
+			epoch = shm->epoch_time;
+			laps = shm->laps_completed;
+			total_laps = shm->total_laps;
+			num_cars = shm->num_cars;
+
+			memset (number, 0, sizeof (number));
+			for (i = 0; (i < (int) num_cars) && (i < LIVE_F1_SHM_CARS); i++) {
+				const LiveF1ShmCar *car = &shm->cars[i];
+
+				if ((car->position < 1)
+				    || (car->position > EXAMPLE_POSITIONS))
+					continue;
+
+				number[car->position - 1] = i + 1;
+				memcpy (driver[car->position - 1],
+					car->atoms[3].text, 16);
+			}
+		} while (live_f1_shm_retry (shm, seq));
+
+		if (epoch)
+			remaining -= time (NULL) - epoch;
+		if (remaining < 0)
+			remaining = 0;
+
+		printf ("\nUpdate %llu, lap %u of %u, %d:%02d:%02d remaining\n",
+			(unsigned long long) updates, laps, total_laps,
+			(int) (remaining / 3600), (int) (remaining / 60 % 60),
+			(int) (remaining % 60));
+		for (i = 0; i < EXAMPLE_POSITIONS; i++) {
+			if (! number[i])
+				continue;
+
+			driver[i][15] = '\0';
+			printf ("%2d %2d %s\n", i + 1, number[i], driver[i]);
+		}
+
+		fflush (stdout);
+		sleep (1);
+	}
+}
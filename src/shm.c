@@ -0,0 +1,224 @@
+/* live-f1
+ *
+ * shm.c - publish the timing board in shared memory
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "live-f1-shm.h"
+#include "packet.h"
+#include "shm.h"
+
+
+/* Forward prototypes */
+static void copy_string (char *dst, const char *src, size_t size);
+
+
+/* Shared memory object we publish to, and its name */
+static LiveF1Shm *shm = NULL;
+static char      *shm_name = NULL;
+
+
+/**
+ * open_shm:
+ * @name: name of the POSIX shared memory object.
+ *
+ * Creates the shared memory object, replacing any left by an earlier
+ * run, and publishes the timing board there each time it changes from
+ * now on.  The object is removed again at exit.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_shm (const char *name)
+{
+	static int registered = 0;
+	int        fd;
+
+	if (shm)
+		close_shm ();
+
+	fd = shm_open (name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, name,
+			 strerror (errno));
+		return 1;
+	}
+
+	if (ftruncate (fd, sizeof (LiveF1Shm)) < 0) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, name,
+			 strerror (errno));
+		close (fd);
+		shm_unlink (name);
+		return 1;
+	}
+
+	shm = mmap (NULL, sizeof (LiveF1Shm), PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	close (fd);
+	if (shm == MAP_FAILED) {
+		fprintf (stderr, "%s:%s: %s\n", program_name, name,
+			 strerror (errno));
+		shm = NULL;
+		shm_unlink (name);
+		return 1;
+	}
+
+	shm_name = strdup (name);
+
+	/* Readers check the magic last */
+	shm->version = LIVE_F1_SHM_VERSION;
+	shm->size = sizeof (LiveF1Shm);
+	__atomic_store_n (&shm->magic, LIVE_F1_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	info (2, _("Publishing timing board to %s\n"), name);
+
+	if (! registered++)
+		atexit (close_shm);
+
+	return 0;
+}
+
+/**
+ * publish_shm:
+ * @state: application state structure.
+ *
+ * Writes the timing board into the shared memory object, under the
+ * sequence number readers check, so that they see either all of it or
+ * know to read it again.  This never waits for readers.
+ **/
+void
+publish_shm (const CurrentState *state)
+{
+	uint32_t seq;
+	int      i, num_cars;
+
+	if (! shm)
+		return;
+
+	/* Odd while we write */
+	seq = shm->seq;
+	__atomic_store_n (&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	shm->updates++;
+	shm->event_no = state->event_no;
+	shm->event_type = state->event_type;
+	shm->flag = state->flag;
+	shm->frame = state->frame;
+	shm->remaining_time = state->remaining_time;
+	shm->epoch_time = state->epoch_time;
+	shm->laps_completed = state->laps_completed;
+	shm->total_laps = state->total_laps;
+
+	shm->track_temp = state->track_temp;
+	shm->air_temp = state->air_temp;
+	shm->humidity = state->humidity;
+	shm->wind_speed = state->wind_speed;
+	shm->wind_direction = state->wind_direction;
+	shm->pressure = state->pressure;
+
+	copy_string (shm->fl_car, state->fl_car, sizeof (shm->fl_car));
+	copy_string (shm->fl_driver, state->fl_driver,
+		     sizeof (shm->fl_driver));
+	copy_string (shm->fl_time, state->fl_time, sizeof (shm->fl_time));
+	copy_string (shm->fl_lap, state->fl_lap, sizeof (shm->fl_lap));
+
+	num_cars = MIN (state->num_cars, LIVE_F1_SHM_CARS);
+	for (i = 0; i < num_cars; i++) {
+		LiveF1ShmCar *car = &shm->cars[i];
+		int           j;
+
+		car->position = state->car_position[i];
+		for (j = 0; j < MIN (LAST_CAR_PACKET, LIVE_F1_SHM_ATOMS); j++) {
+			car->atoms[j].data = state->car_info[i][j].data;
+			copy_string (car->atoms[j].text,
+				     state->car_info[i][j].text,
+				     sizeof (car->atoms[j].text));
+			car->atoms[j].type = state->car_info[i][j].type;
+			car->atoms[j].value = state->car_info[i][j].value;
+		}
+	}
+
+	/* Cars gone since the last event aren't left behind */
+	if (shm->num_cars > num_cars)
+		memset (&shm->cars[num_cars], 0,
+			(shm->num_cars - num_cars) * sizeof (LiveF1ShmCar));
+	shm->num_cars = num_cars;
+
+	__atomic_store_n (&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * close_shm:
+ *
+ * Stops publishing the timing board and removes the shared memory
+ * object; readers that still have it mapped keep the last board.  This
+ * is registered with atexit().
+ **/
+void
+close_shm (void)
+{
+	if (! shm)
+		return;
+
+	munmap (shm, sizeof (LiveF1Shm));
+	shm = NULL;
+
+	shm_unlink (shm_name);
+	free (shm_name);
+	shm_name = NULL;
+}
+
+
+/**
+ * copy_string:
+ * @dst: buffer to copy into,
+ * @src: string to copy, or NULL,
+ * @size: size of @dst.
+ *
+ * Copies as much of @src as fits into @dst, always NUL-terminating it.
+ **/
+static void
+copy_string (char       *dst,
+	     const char *src,
+	     size_t      size)
+{
+	size_t len;
+
+	len = src ? strnlen (src, size - 1) : 0;
+	if (len)
+		memcpy (dst, src, len);
+	memset (dst + len, 0, size - len);
+}
@@ -0,0 +1,611 @@
+/* live-f1
+ *
+ * stats.c - where the time goes between the server and the screen
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "live-f1.h"
+#include "packet.h"
+#include "stats.h"
+
+
+/* Each power of two is split into this many buckets, a histogram bucket
+ * is within about 3% of any value in it */
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_HALF     (1 << (HISTOGRAM_SUB_BITS - 1))
+
+/* Largest shift applied to a value, so values up to 2^41 usecs */
+#define HISTOGRAM_SHIFTS   35
+
+/* Number of buckets in a histogram */
+#define HISTOGRAM_BUCKETS  ((HISTOGRAM_SHIFTS + 2) * HISTOGRAM_HALF)
+
+/* Packet types counted, for cars and otherwise */
+#define STATS_PACKET_TYPES 16
+
+/* Time between writes of the statistics file (secs) */
+#define STATS_FILE_INTERVAL 10
+
+/* Width packet counts are wrapped to */
+#define STATS_WIDTH 56
+
+
+/**
+ * Histogram:
+ * @counts: number of values in each bucket,
+ * @count: number of values,
+ * @total: sum of the values (usecs),
+ * @max: largest value (usecs).
+ *
+ * Latencies recorded with a fixed relative precision, in the manner of
+ * an HDR histogram: values below 2^HISTOGRAM_SUB_BITS usecs each have a
+ * bucket, above that each power of two is split into HISTOGRAM_HALF.
+ **/
+typedef struct {
+	unsigned long long counts[HISTOGRAM_BUCKETS];
+	unsigned long long count, total, max;
+} Histogram;
+
+/**
+ * Stats:
+ * @decode: time from a burst arriving at the socket to it having been
+ *          parsed,
+ * @screen: time from a change having been parsed to the doupdate() that
+ *          shows it,
+ * @car_packets: number of car packets of each type,
+ * @sys_packets: number of other packets of each type,
+ * @decrypted: number of bytes decrypted,
+ * @key_frames: number of key frames parsed,
+ * @cached_key_frames: number of those read from the cache,
+ * @http_requests: number of HTTP requests made,
+ * @http_nsecs: time spent in them (nsecs).
+ *
+ * Everything counted.  Each counter is only ever added to by one thread,
+ * except for the HTTP ones, and may be read from any.
+ **/
+typedef struct {
+	Histogram          decode, screen;
+
+	unsigned long long car_packets[STATS_PACKET_TYPES];
+	unsigned long long sys_packets[STATS_PACKET_TYPES];
+	unsigned long long decrypted;
+
+	unsigned long long key_frames, cached_key_frames;
+	unsigned long long http_requests, http_nsecs;
+} Stats;
+
+
+/* Forward prototypes */
+static void               add_counter      (unsigned long long *counter,
+					    unsigned long long n);
+static unsigned long long get_counter      (const unsigned long long *counter);
+static void               record_value     (Histogram *hist,
+					    unsigned long long nsecs);
+static unsigned long long percentile       (const Histogram *hist,
+					    double fraction);
+static void               format_histogram (char *buf, size_t size,
+					    size_t *len, const char *title,
+					    const char *unit,
+					    const Histogram *hist);
+static void               format_packets   (char *buf, size_t size,
+					    size_t *len, const char *title,
+					    const unsigned long long *packets);
+static void               append           (char *buf, size_t size,
+					    size_t *len, const char *format,
+					    ...);
+static int                write_stats_file (void);
+
+
+/* Everything counted */
+static Stats stats;
+
+/* File the statistics are written to, and when they last were (nsecs) */
+static char               *stats_filename = NULL;
+static unsigned long long  last_dump = 0;
+
+
+/**
+ * stats_clock:
+ *
+ * Returns: monotonic time in nanoseconds.
+ **/
+unsigned long long
+stats_clock (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * note_decode_latency:
+ * @nsecs: time from a burst arriving to it having been parsed.
+ *
+ * Records the time taken for a burst read from the data stream to be
+ * parsed.  Only called by the thread reading the data stream.
+ **/
+void
+note_decode_latency (unsigned long long nsecs)
+{
+	record_value (&stats.decode, nsecs);
+}
+
+/**
+ * note_screen_latency:
+ * @nsecs: time from a change being parsed to it being on screen.
+ *
+ * Records the time taken for a change to the board to be drawn.  Only
+ * called by the thread drawing the display.
+ **/
+void
+note_screen_latency (unsigned long long nsecs)
+{
+	record_value (&stats.screen, nsecs);
+}
+
+/**
+ * count_packet:
+ * @packet: packet parsed.
+ *
+ * Counts @packet by its type.
+ **/
+void
+count_packet (const Packet *packet)
+{
+	unsigned long long *packets;
+
+	packets = packet->car ? stats.car_packets : stats.sys_packets;
+	add_counter (&packets[packet->type % STATS_PACKET_TYPES], 1);
+}
+
+/**
+ * count_decrypted:
+ * @len: number of bytes.
+ *
+ * Counts bytes decrypted.
+ **/
+void
+count_decrypted (size_t len)
+{
+	add_counter (&stats.decrypted, len);
+}
+
+/**
+ * count_key_frame:
+ * @cached: whether it was read from the cache.
+ *
+ * Counts a key frame having been parsed.
+ **/
+void
+count_key_frame (int cached)
+{
+	add_counter (&stats.key_frames, 1);
+	if (cached)
+		add_counter (&stats.cached_key_frames, 1);
+}
+
+/**
+ * count_http_request:
+ * @nsecs: time it took.
+ *
+ * Counts an HTTP request to the website and the time it took; may be
+ * called from any thread.
+ **/
+void
+count_http_request (unsigned long long nsecs)
+{
+	__atomic_fetch_add (&stats.http_requests, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&stats.http_nsecs, nsecs, __ATOMIC_RELAXED);
+}
+
+/**
+ * format_stats:
+ * @buf: buffer to format into,
+ * @size: size of @buf.
+ *
+ * Formats the latency percentiles and counters as lines of text, no
+ * wider than a popup, for the overlay and the statistics file.  May be
+ * called from any thread while they're being counted.
+ *
+ * Returns: length of the text in @buf.
+ **/
+size_t
+format_stats (char   *buf,
+	      size_t  size)
+{
+	size_t len = 0;
+
+	buf[0] = '\0';
+
+	format_histogram (buf, size, &len, _("Socket to decode"),
+			  _("bursts"), &stats.decode);
+	format_histogram (buf, size, &len, _("Decode to screen"),
+			  _("frames"), &stats.screen);
+
+	format_packets (buf, size, &len, _("Car packets"),
+			stats.car_packets);
+	format_packets (buf, size, &len, _("System packets"),
+			stats.sys_packets);
+
+	append (buf, size, &len, "%s: %llu %s\n", _("Decrypted"),
+		get_counter (&stats.decrypted), _("bytes"));
+	append (buf, size, &len, "%s: %llu, %llu %s\n", _("Key frames"),
+		get_counter (&stats.key_frames),
+		get_counter (&stats.cached_key_frames), _("from cache"));
+	append (buf, size, &len, "%s: %llu %s, %.0f ms\n", _("HTTP"),
+		get_counter (&stats.http_requests), _("requests"),
+		get_counter (&stats.http_nsecs) / 1e6);
+
+	return len;
+}
+
+/**
+ * open_stats_file:
+ * @filename: file to write to.
+ *
+ * Writes the statistics to @filename now, every STATS_FILE_INTERVAL
+ * seconds that dump_stats() is called from then on, and at exit.  The
+ * file is replaced each time, so it's never seen half-written.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+int
+open_stats_file (const char *filename)
+{
+	static int registered = 0;
+
+	free (stats_filename);
+	stats_filename = strdup (filename);
+	if (! stats_filename)
+		abort ();
+
+	if (write_stats_file ()) {
+		fprintf (stderr, "%s: %s: %s\n", program_name, filename,
+			 strerror (errno));
+		free (stats_filename);
+		stats_filename = NULL;
+		return 1;
+	}
+	last_dump = stats_clock ();
+
+	if (! registered++)
+		atexit (close_stats_file);
+
+	return 0;
+}
+
+/**
+ * dump_stats:
+ * @force: write even if it's not yet time.
+ *
+ * Writes the statistics file, if there is one and STATS_FILE_INTERVAL
+ * seconds have passed since it was last written.  Called each second
+ * by the event loop.
+ **/
+void
+dump_stats (int force)
+{
+	unsigned long long now;
+
+	if (! stats_filename)
+		return;
+
+	now = stats_clock ();
+	if ((! force)
+	    && (now - last_dump < STATS_FILE_INTERVAL * 1000000000ULL))
+		return;
+
+	write_stats_file ();
+	last_dump = now;
+}
+
+/**
+ * close_stats_file:
+ *
+ * Writes the statistics file for the last time.  This is registered
+ * with atexit().
+ **/
+void
+close_stats_file (void)
+{
+	if (! stats_filename)
+		return;
+
+	dump_stats (TRUE);
+
+	free (stats_filename);
+	stats_filename = NULL;
+}
+
+
+/**
+ * add_counter:
+ * @counter: counter to add to,
+ * @n: amount to add.
+ *
+ * Adds @n to a counter only this thread adds to, such that other
+ * threads reading it never see a torn value; cheaper than an atomic
+ * add, for the counters added to with every packet.
+ **/
+static void
+add_counter (unsigned long long *counter,
+	     unsigned long long  n)
+{
+	__atomic_store_n (counter, __atomic_load_n (counter, __ATOMIC_RELAXED) + n,
+			  __ATOMIC_RELAXED);
+}
+
+/**
+ * get_counter:
+ * @counter: counter to read.
+ *
+ * Returns: value of @counter, which another thread may be adding to.
+ **/
+static unsigned long long
+get_counter (const unsigned long long *counter)
+{
+	return __atomic_load_n (counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * record_value:
+ * @hist: histogram to record in,
+ * @nsecs: value to record.
+ *
+ * Records @nsecs, to the microsecond, in the bucket of @hist it falls
+ * into.
+ **/
+static void
+record_value (Histogram          *hist,
+	      unsigned long long  nsecs)
+{
+	unsigned long long usecs;
+	int                shift, bucket;
+
+	usecs = nsecs / 1000;
+
+	shift = 0;
+	if (usecs >= 2 * HISTOGRAM_HALF)
+		shift = 63 - __builtin_clzll (usecs) - (HISTOGRAM_SUB_BITS - 1);
+
+	if (shift > HISTOGRAM_SHIFTS) {
+		bucket = HISTOGRAM_BUCKETS - 1;
+	} else {
+		bucket = shift * HISTOGRAM_HALF + (usecs >> shift);
+	}
+
+	add_counter (&hist->counts[bucket], 1);
+	add_counter (&hist->count, 1);
+	add_counter (&hist->total, usecs);
+	if (usecs > get_counter (&hist->max))
+		__atomic_store_n (&hist->max, usecs, __ATOMIC_RELAXED);
+}
+
+/**
+ * percentile:
+ * @hist: histogram,
+ * @fraction: fraction of values, from 0 to 1.
+ *
+ * Returns: value (usecs) that @fraction of those in @hist are no larger
+ * than, give or take the precision of its bucket.
+ **/
+static unsigned long long
+percentile (const Histogram *hist,
+	    double           fraction)
+{
+	unsigned long long count, target, seen = 0;
+	int                bucket, shift;
+
+	count = get_counter (&hist->count);
+	if (! count)
+		return 0;
+
+	target = MAX (fraction * count + 0.5, 1);
+	for (bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+		seen += get_counter (&hist->counts[bucket]);
+		if (seen >= target)
+			break;
+	}
+
+	/* Middle of the bucket it's in */
+	shift = MAX (bucket / HISTOGRAM_HALF - 1, 0);
+	return (((unsigned long long) (bucket - shift * HISTOGRAM_HALF) << shift)
+		+ ((1ULL << shift) >> 1));
+}
+
+/**
+ * format_histogram:
+ * @buf: buffer to format into,
+ * @size: size of @buf,
+ * @len: length of text already in @buf, updated,
+ * @title: what @hist is of,
+ * @unit: what each value is,
+ * @hist: histogram.
+ *
+ * Appends the number of values in @hist and its percentiles.
+ **/
+static void
+format_histogram (char            *buf,
+		  size_t           size,
+		  size_t          *len,
+		  const char      *title,
+		  const char      *unit,
+		  const Histogram *hist)
+{
+	unsigned long long count;
+
+	count = get_counter (&hist->count);
+	append (buf, size, len, "%s: %llu %s, %.2f ms %s\n", title, count,
+		unit, count ? get_counter (&hist->total) / 1e3 / count : 0.0,
+		_("average"));
+	append (buf, size, len, "  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f ms\n",
+		percentile (hist, 0.5) / 1e3, percentile (hist, 0.9) / 1e3,
+		percentile (hist, 0.99) / 1e3, get_counter (&hist->max) / 1e3);
+}
+
+/**
+ * format_packets:
+ * @buf: buffer to format into,
+ * @size: size of @buf,
+ * @len: length of text already in @buf, updated,
+ * @title: what @packets are,
+ * @packets: number of packets of each type.
+ *
+ * Appends the total of @packets, and the number of each type seen,
+ * wrapped to STATS_WIDTH.
+ **/
+static void
+format_packets (char                     *buf,
+		size_t                    size,
+		size_t                   *len,
+		const char               *title,
+		const unsigned long long *packets)
+{
+	unsigned long long total = 0;
+	char               item[32];
+	int                type, col = 0;
+
+	for (type = 0; type < STATS_PACKET_TYPES; type++)
+		total += get_counter (&packets[type]);
+
+	append (buf, size, len, "%s: %llu\n", title, total);
+	for (type = 0; type < STATS_PACKET_TYPES; type++) {
+		unsigned long long count = get_counter (&packets[type]);
+		int                itemlen;
+
+		if (! count)
+			continue;
+
+		itemlen = snprintf (item, sizeof (item), " %d:%llu",
+				    type, count);
+		if (col && (col + itemlen > STATS_WIDTH)) {
+			append (buf, size, len, "\n");
+			col = 0;
+		}
+		if (! col) {
+			append (buf, size, len, " ");
+			col = 1;
+		}
+
+		append (buf, size, len, "%s", item);
+		col += itemlen;
+	}
+	if (col)
+		append (buf, size, len, "\n");
+}
+
+/**
+ * append:
+ * @buf: buffer to format into,
+ * @size: size of @buf,
+ * @len: length of text already in @buf, updated,
+ * @format: format string for vsnprintf.
+ *
+ * Appends formatted text to @buf, as much as fits.
+ **/
+static void
+append (char       *buf,
+	size_t      size,
+	size_t     *len,
+	const char *format,
+	...)
+{
+	va_list ap;
+	int     ret;
+
+	if (*len + 1 >= size)
+		return;
+
+	va_start (ap, format);
+	ret = vsnprintf (buf + *len, size - *len, format, ap);
+	va_end (ap);
+
+	if (ret > 0)
+		*len = MIN (*len + ret, size - 1);
+}
+
+/**
+ * write_stats_file:
+ *
+ * Writes the time and the statistics to a temporary file next to the
+ * statistics file, and renames it over the top.
+ *
+ * Returns: 0 on success, non-zero on failure.
+ **/
+static int
+write_stats_file (void)
+{
+	char    buf[4096], when[32];
+	char   *tmpname;
+	FILE   *file;
+	size_t  len;
+	time_t  now;
+	int     fd, written, ret = 1;
+
+	now = time (NULL);
+	strftime (when, sizeof (when), "%Y-%m-%d %H:%M:%S", localtime (&now));
+	len = format_stats (buf, sizeof (buf));
+
+	tmpname = malloc (strlen (stats_filename) + 8);
+	if (! tmpname)
+		abort ();
+	sprintf (tmpname, "%s.XXXXXX", stats_filename);
+
+	/* mkstemp() creates the file with mode 0600, but anyone may read
+	 * the statistics */
+	fd = mkstemp (tmpname);
+	if (fd < 0)
+		goto error;
+	fchmod (fd, 0644);
+
+	file = fdopen (fd, "w");
+	if (! file) {
+		close (fd);
+		unlink (tmpname);
+		goto error;
+	}
+
+	fprintf (file, "%s %s\n\n", _("live-f1 statistics at"), when);
+	written = (fwrite (buf, 1, len, file) == len);
+	if (fclose (file) || (! written)
+	    || rename (tmpname, stats_filename)) {
+		unlink (tmpname);
+		goto error;
+	}
+
+	ret = 0;
+error:
+	free (tmpname);
+	return ret;
+}
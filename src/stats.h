@@ -0,0 +1,49 @@
+/* live-f1
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef LIVE_F1_STATS_H
+#define LIVE_F1_STATS_H
+
+#include <stddef.h>
+
+#include "live-f1.h"
+#include "packet.h"
+
+
+SJR_BEGIN_EXTERN
+
+unsigned long long stats_clock (void);
+
+void   note_decode_latency (unsigned long long nsecs);
+void   note_screen_latency (unsigned long long nsecs);
+
+void   count_packet        (const Packet *packet);
+void   count_decrypted     (size_t len);
+void   count_key_frame     (int cached);
+void   count_http_request  (unsigned long long nsecs);
+
+size_t format_stats        (char *buf, size_t size);
+
+int    open_stats_file     (const char *filename);
+void   dump_stats          (int force);
+void   close_stats_file    (void);
+
+SJR_END_EXTERN
+
+#endif /* LIVE_F1_STATS_H */
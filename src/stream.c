@@ -24,24 +24,36 @@
 #endif /* HAVE_CONFIG_H */
 
 
-#include <sys/poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <fcntl.h>
 #include <errno.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "live-f1.h"
 #include "display.h"
+#include "emit.h"
 #include "packet.h"
+#include "record.h"
+#include "stats.h"
 #include "stream.h"
 
 
-/* Encryption seed */
-#define CRYPTO_SEED 0x55555555
+/* Number of keys we cache the keystream for */
+#define KEYSTREAM_CACHE 4
+
+/* Minimum number of keystream bytes to generate at once */
+#define KEYSTREAM_CHUNK 4096
+
+/* Initial, and largest, size of the buffer the stream is read into */
+#define RECV_BUFFER_SIZE 4096
+#define RECV_BUFFER_MAX  (1024 * 1024)
 
 /* Which car the packet is for */
 #define PACKET_CAR(_p) ((_p)[0] & 0x1f)
@@ -68,9 +80,119 @@
 #define SPECIAL_PACKET_LEN(_p) 0
 
 
+/**
+ * PacketLength:
+ *
+ * Where the length of the payload comes from in the packet header.
+ **/
+typedef enum {
+	LENGTH_NONE,
+	LENGTH_SHORT,
+	LENGTH_LONG,
+	LENGTH_TIMESTAMP
+} PacketLength;
+
+/**
+ * PacketData:
+ *
+ * Where the additional data comes from in the packet header.
+ **/
+typedef enum {
+	DATA_NONE,
+	DATA_SHORT,
+	DATA_SPECIAL
+} PacketData;
+
+/**
+ * PacketRule:
+ * @length: where the payload length comes from,
+ * @data: where the additional data comes from,
+ * @decrypt: whether the payload is encrypted,
+ * @known: whether we know about this type of packet.
+ *
+ * How to decode the header of each type of packet.
+ **/
+typedef struct {
+	unsigned char length, data, decrypt, known;
+} PacketRule;
+
+
+/**
+ * KeyStream:
+ * @key: decryption key,
+ * @salt: salt after generating @len bytes,
+ * @len: number of bytes generated,
+ * @size: allocated size of @bytes,
+ * @bytes: keystream bytes.
+ *
+ * Since the salt is always reset to the same seed, the sequence of bytes
+ * that payloads are xor'd with is the same for every key frame for any
+ * given key.  We generate the sequence once and keep it, rather than
+ * stepping the salt for every byte we decrypt.
+ **/
+typedef struct {
+	unsigned int   key, salt;
+	size_t         len, size;
+	unsigned char *bytes;
+} KeyStream;
+
+
 /* Forward prototypes */
-static int next_packet (CurrentState *state, Packet *packet,
-			const unsigned char **buf, size_t *buf_len);
+static const unsigned char *keystream (StreamParser *parser, size_t len);
+static void xor_bytes (unsigned char *dst, const unsigned char *src,
+		       const unsigned char *key, size_t len);
+static void set_payload (StreamParser *parser, Packet *packet,
+			 const unsigned char *src, int decrypt, int copy);
+static void decrypt_copy (StreamParser *parser, unsigned char *dst,
+			  const unsigned char *src, size_t len);
+static void queue_block (StreamParser *parser, const unsigned char *buf,
+			 size_t len);
+
+
+/* Socket receive buffer size to ask for, or zero for the default */
+static int rcvbuf = 0;
+
+/* Header decoding rules, indexed by whether it's a car packet and type */
+static const PacketRule packet_rules[2][16] = {
+	{
+		/* System packets */
+		{ LENGTH_NONE,      DATA_NONE,    0, 0 },
+		{ LENGTH_SHORT,     DATA_SHORT,   0, 1 }, /* SYS_EVENT_ID */
+		{ LENGTH_SHORT,     DATA_SHORT,   0, 1 }, /* SYS_KEY_FRAME */
+		{ LENGTH_NONE,      DATA_NONE,    0, 1 }, /* SYS_VALID_MARKER */
+		{ LENGTH_LONG,      DATA_NONE,    1, 1 }, /* SYS_COMMENTARY */
+		{ LENGTH_NONE,      DATA_SHORT,   0, 1 }, /* SYS_REFRESH_RATE */
+		{ LENGTH_LONG,      DATA_NONE,    1, 1 }, /* SYS_NOTICE */
+		{ LENGTH_TIMESTAMP, DATA_NONE,    1, 1 }, /* SYS_TIMESTAMP */
+		{ LENGTH_NONE,      DATA_NONE,    0, 0 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 }, /* SYS_WEATHER */
+		{ LENGTH_LONG,      DATA_NONE,    1, 1 }, /* SYS_SPEED */
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 }, /* SYS_TRACK_STATUS */
+		{ LENGTH_LONG,      DATA_NONE,    0, 1 }, /* SYS_COPYRIGHT */
+		{ LENGTH_NONE,      DATA_NONE,    0, 0 },
+		{ LENGTH_NONE,      DATA_NONE,    0, 0 },
+		{ LENGTH_NONE,      DATA_NONE,    0, 0 },
+	},
+	{
+		/* Car packets; all but two are data atoms */
+		{ LENGTH_NONE,      DATA_SPECIAL, 0, 1 }, /* CAR_POSITION_UPDATE */
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_SHORT,     DATA_SHORT,   1, 1 },
+		{ LENGTH_LONG,      DATA_NONE,    1, 1 }, /* CAR_POSITION_HISTORY */
+	}
+};
 
 
 /**
@@ -118,6 +240,11 @@ open_stream (const char   *hostname,
 		if (sock < 0)
 			continue;
 
+		/* Must be before connecting, so the window is scaled */
+		if (rcvbuf)
+			setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+				    sizeof (rcvbuf));
+
 		ret = connect (sock, addr->ai_addr, addr->ai_addrlen);
 		if (ret < 0) {
 			close (sock);
@@ -128,9 +255,20 @@ open_stream (const char   *hostname,
 		break;
 	}
 
-	if (sock >= 0)
+	if (sock >= 0) {
 		info (2, _("Connected to %s.\n"), addr->ai_canonname);
 
+#ifdef SO_TIMESTAMPNS
+		/* Have the kernel note when each block arrives */
+		ret = 1;
+		setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &ret,
+			    sizeof (ret));
+#endif /* SO_TIMESTAMPNS */
+
+		/* So the socket can be drained until there's nothing left */
+		fcntl (sock, F_SETFL, fcntl (sock, F_GETFL) | O_NONBLOCK);
+	}
+
 	freeaddrinfo (res);
 	return sock;
 }
@@ -138,69 +276,143 @@ open_stream (const char   *hostname,
 /**
  * read_stream:
  * @state: application state structure,
- * @sock: socket to read from.
+ * @sock: socket to read from,
+ * @burst: filled with what was read.
+ *
+ * Drains the stream, which should be readable, until there's nothing
+ * left and parses everything that was read in one go.  The buffer read
+ * into grows to fit the largest burst, so a key frame's worth of data
+ * arriving at once needs few reads and a single wakeup.
  *
- * Read a block of data from the stream, this isn't quite as simple as it
- * seems because the server won't actually send us data unless we ping it;
- * but we don't want to ping as often as we need to check for things like
- * key presses from the user.
+ * The kernel's timestamp of when the first of the data arrived is
+ * returned in @burst along with how much was read and the number of
+ * reads it took, so that the time it waited for us can be measured;
+ * without one, the time it was read is used instead.
  *
  * Returns: 0 if socket closed, > 0 on success, < 0 on error.
  **/
 int
-read_stream (CurrentState *state, int sock)
+read_stream (CurrentState *state,
+	     int           sock,
+	     StreamBurst  *burst)
 {
-	struct pollfd poll_fd;
-	static int    timer = 0;
-	int           numr, len;
+	char            control[CMSG_SPACE (sizeof (struct timespec))];
+	struct iovec    iov;
+	struct msghdr   msg;
+	struct cmsghdr *cmsg;
+	StreamParser   *parser = state->parser;
+	ssize_t         len;
+	int             ret = 1;
+
+	memset (burst, 0, sizeof (StreamBurst));
+
+	for (;;) {
+		if (burst->len == parser->recv_size) {
+			if (parser->recv_size >= RECV_BUFFER_MAX)
+				break;
+
+			parser->recv_size = (parser->recv_size
+					     ? parser->recv_size * 2
+					     : RECV_BUFFER_SIZE);
+			parser->recv_buf = realloc (parser->recv_buf,
+						    parser->recv_size);
+			if (! parser->recv_buf)
+				abort ();
+		}
 
-	poll_fd.fd = sock;
-	poll_fd.events = POLLIN;
-	poll_fd.revents = 0;
+		iov.iov_base = parser->recv_buf + burst->len;
+		iov.iov_len = parser->recv_size - burst->len;
 
-	numr = poll (&poll_fd, 1, 100);
-	if (numr > 0) {
-		unsigned char buf[512];
+		memset (&msg, 0, sizeof (msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof (control);
 
-		len = read (sock, buf, sizeof (buf));
+		len = recvmsg (sock, &msg, 0);
+		burst->reads++;
 		if (len > 0) {
-			parse_stream_block (state, buf, len);
-			timer = 0;
-			return len;
+			if (! burst->len) {
+				clock_gettime (CLOCK_REALTIME, &burst->arrived);
+#ifdef SO_TIMESTAMPNS
+				for (cmsg = CMSG_FIRSTHDR (&msg); cmsg;
+				     cmsg = CMSG_NXTHDR (&msg, cmsg))
+					if ((cmsg->cmsg_level == SOL_SOCKET)
+					    && (cmsg->cmsg_type == SCM_TIMESTAMPNS))
+						memcpy (&burst->arrived,
+							CMSG_DATA (cmsg),
+							sizeof (struct timespec));
+#endif /* SO_TIMESTAMPNS */
+			}
+
+			burst->len += len;
+
+			/* A short read means the socket is empty; anything
+			 * arriving since wakes us again */
+			if (burst->len < parser->recv_size)
+				break;
+		} else if ((len < 0) && (errno == EINTR)) {
+			continue;
+		} else if ((len < 0) && (errno == EAGAIN)) {
+			break;
 		} else if ((len < 0) && (errno != ECONNRESET)) {
-			if (errno == EINTR)
-				return 1;
-
-			return -1;
+			ret = -1;
+			break;
 		} else {
-			return 0;
+			ret = 0;
+			break;
 		}
-	} else if (numr < 0) {
-		if (errno == EINTR)
-			return 1;
+	}
 
-		return -1;
-	} else {
-		char buf[1];
+	/* Whatever happened, don't lose what was read before it */
+	if (burst->len) {
+		record_block (RECORD_STREAM, parser->recv_buf, burst->len);
+		parse_stream_block (state, parser->recv_buf, burst->len);
+	}
+
+	return ret;
+}
 
-		if (timer++ < 10)
+/**
+ * set_receive_buffer:
+ * @size: size of socket receive buffer in bytes, or zero.
+ *
+ * Sets the size of the socket receive buffer asked for when connecting
+ * to the data stream, rather than leaving the kernel to tune it.
+ **/
+void
+set_receive_buffer (int size)
+{
+	rcvbuf = size;
+}
+
+/**
+ * ping_stream:
+ * @sock: socket to write to.
+ *
+ * The server won't send us data unless we ping it every so often, so
+ * this should be called whenever it's been quiet for a while.
+ *
+ * Returns: 0 if socket closed, > 0 on success, < 0 on error.
+ **/
+int
+ping_stream (int sock)
+{
+	char buf[1];
+	int  len;
+
+	/* Wake the server up */
+	buf[0] = 0x10;
+	len = write (sock, buf, sizeof (buf));
+	if (len > 0) {
+		return len;
+	} else if ((len < 0) && (errno != EPIPE)) {
+		if ((errno == EINTR) || (errno == EAGAIN))
 			return 1;
 
-		/* Wake the server up */
-		buf[0] = 0x10;
-		len = write (sock, buf, sizeof (buf));
-		if (len > 0) {
-			update_time (state);
-			timer = 0;
-			return len;
-		} else if ((len < 0) && (errno != EPIPE)) {
-			if (errno == EINTR)
-				return 1;
-
-			return -1;
-		} else {
-			return 0;
-		}
+		return -1;
+	} else {
+		return 0;
 	}
 }
 
@@ -213,6 +425,11 @@ read_stream (CurrentState *state, int sock)
  * Parse a data stream block obtained either from the data server or a
  * key frame.  Calls either handle_car_packet() or handle_system_packet(),
  * and is safe for those to result in further stream parsing calls.
+ * The changes to the board are drawn together once the block is done,
+ * and the time until they're on screen is measured from then.
+ *
+ * While a key frame is being downloaded, the rest of the data is queued
+ * until resume_stream() is called.
  **/
 int
 parse_stream_block (CurrentState        *state,
@@ -221,22 +438,158 @@ parse_stream_block (CurrentState        *state,
 {
 	Packet packet;
 
-	while (next_packet (state, &packet, &buf, &buf_len)) {
+	if (state->parser->key_frame) {
+		queue_block (state->parser, buf, buf_len);
+		return 0;
+	}
+
+	while (next_packet (state->parser, &packet, &buf, &buf_len)) {
+		count_packet (&packet);
+		if (emitting)
+			emit_packet (&packet);
+
 		if (packet.car) {
 			handle_car_packet (state, &packet);
 		} else {
 			handle_system_packet (state, &packet);
 		}
+
+		if (state->parser->key_frame) {
+			queue_block (state->parser, buf, buf_len);
+			break;
+		}
+	}
+
+	mark_decoded (stats_clock ());
+	flush_display (state);
+	flush_emitter ();
+
+	return 0;
+}
+
+/**
+ * resume_stream:
+ * @state: application state structure.
+ *
+ * Parses the data queued while waiting for a key frame, in the order it
+ * was received; called once the key frame has been parsed.
+ **/
+void
+resume_stream (CurrentState *state)
+{
+	StreamParser  *parser = state->parser;
+	unsigned char *queue;
+	size_t         queue_len;
+
+	queue = parser->queue;
+	queue_len = parser->queue_len;
+
+	parser->queue = NULL;
+	parser->queue_len = parser->queue_size = 0;
+
+	if (queue) {
+		info (3, _("Resuming %zu bytes of queued data\n"), queue_len);
+		parse_stream_block (state, queue, queue_len);
+		free (queue);
+	}
+}
+
+/**
+ * queued_key_frame:
+ * @parser: data stream being parsed.
+ *
+ * Looks through the data queued while waiting for a key frame for the
+ * first key frame marker.
+ *
+ * Returns: key frame number, or zero if no marker is queued.
+ **/
+unsigned int
+queued_key_frame (const StreamParser *parser)
+{
+	/* Can't tell where packets begin after a split one */
+	if (parser->pbuf_len)
+		return 0;
+
+	return first_key_frame (parser->queue, parser->queue_len);
+}
+
+/**
+ * first_key_frame:
+ * @buf: data stream or key frame,
+ * @len: length of @buf.
+ *
+ * Looks through @buf, which must begin with a packet, for the first key
+ * frame marker.  Packet headers and markers are never encrypted, so
+ * this doesn't need or disturb the decryption.
+ *
+ * Returns: key frame number, or zero if @buf has no marker.
+ **/
+unsigned int
+first_key_frame (const unsigned char *buf,
+		 size_t               len)
+{
+	unsigned int number;
+	size_t       needed;
+	Packet       packet;
+	int          i;
+
+	while (len >= 2) {
+		packet_header (buf, &packet);
+
+		needed = 2 + MAX (packet.len, 0);
+		if (needed > len)
+			break;
+
+		if ((! packet.car) && (packet.type == SYS_KEY_FRAME)) {
+			number = 0;
+			for (i = packet.len; i > 0; i--) {
+				number <<= 8;
+				number |= buf[1 + i];
+			}
+
+			return number;
+		}
+
+		buf += needed;
+		len -= needed;
 	}
 
 	return 0;
 }
 
+/**
+ * queue_block:
+ * @parser: data stream being parsed,
+ * @buf: data to queue,
+ * @len: length of @buf.
+ *
+ * Adds @buf to the data waiting to be parsed.
+ **/
+static void
+queue_block (StreamParser        *parser,
+	     const unsigned char *buf,
+	     size_t               len)
+{
+	if (! len)
+		return;
+
+	if (parser->queue_len + len > parser->queue_size) {
+		parser->queue_size = MAX (parser->queue_len + len,
+					  parser->queue_size * 2);
+		parser->queue = realloc (parser->queue, parser->queue_size);
+		if (! parser->queue)
+			abort ();
+	}
+
+	memcpy (parser->queue + parser->queue_len, buf, len);
+	parser->queue_len += len;
+}
+
 /**
  * next_packet:
- * @state: application state structure,
+ * @parser: data stream being parsed,
  * @packet: packet structure to fill,
- * @buf: buffer to copy packet from,
+ * @buf: buffer to take packet from,
  * @buf_len: length of @buf.
  *
  * Takes bytes from @buf until a complete raw packet has been seen,
@@ -244,165 +597,286 @@ parse_stream_block (CurrentState        *state,
  * it.
  *
  * @buf_len is decreased and @buf moved upwards each time bytes are
- * taken from it.  The bytes are copied into an internal buffer so
- * there's no need to worry about packets crossing block boundaries.
+ * taken from it.  Packets wholly inside @buf are decoded from there,
+ * with unencrypted payloads left pointing into it; only packets that
+ * cross block boundaries are copied into the @parser's buffer.
  *
  * Returns: 0 if the packet was not complete, 1 if it is complete
  **/
-static int
-next_packet (CurrentState         *state,
+int
+next_packet (StreamParser         *parser,
 	     Packet               *packet,
 	     const unsigned char **buf,
 	     size_t               *buf_len)
 {
-	static unsigned char pbuf[129];
-	static size_t        pbuf_len = 0;
+	unsigned char       *pbuf = parser->pbuf;
+	size_t               needed;
 	int                  decrypt = 0;
 
+	/* Most packets sit entirely within the block, in which case
+	 * there's no need to copy them anywhere first.
+	 */
+	if ((! parser->pbuf_len) && (*buf_len >= 2)) {
+		decrypt = packet_header (*buf, packet);
+
+		needed = 2 + MAX (packet->len, 0);
+		if (*buf_len >= needed) {
+			set_payload (parser, packet, *buf + 2, decrypt, 0);
+
+			*buf += needed;
+			*buf_len -= needed;
+			return 1;
+		}
+	}
+
 	/* We need a minimum of two bytes to figure out how long the rest
 	 * of it's supposed to be; copy those now if we have room.
 	 */
-	if (pbuf_len < 2) {
-		size_t needed;
-
-		needed = MIN (*buf_len, 2 - pbuf_len);
-		memcpy (pbuf + pbuf_len, *buf, needed);
+	if (parser->pbuf_len < 2) {
+		needed = MIN (*buf_len, 2 - parser->pbuf_len);
+		memcpy (pbuf + parser->pbuf_len, *buf, needed);
 
-		pbuf_len += needed;
+		parser->pbuf_len += needed;
 		*buf += needed;
 		*buf_len -= needed;
 
-		if (pbuf_len < 2)
+		if (parser->pbuf_len < 2)
 			return 0;
 	}
 
 	/* We now have the packet header, this is enough information to
 	 * figure out how long the rest of it is and whether we need to
 	 * decrypt it or not.
-	 *
-	 * Fill in some of the fields now, ok we'll rewrite these every
-	 * time we come through, but that's not really that bad.
 	 */
-	packet->car = PACKET_CAR (pbuf);
-	packet->type = PACKET_TYPE (pbuf);
-
-	if (packet->car) {
-		switch ((CarPacketType) packet->type) {
-		case CAR_POSITION_UPDATE:
-			packet->len = SPECIAL_PACKET_LEN (pbuf);
-			packet->data = SPECIAL_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case CAR_POSITION_HISTORY:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		default:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		}
-	} else {
-		switch ((SystemPacketType) packet->type) {
-		case SYS_EVENT_ID:
-		case SYS_KEY_FRAME:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case SYS_TIMESTAMP:
-			packet->len = 2;
-			packet->data = 0;
-			decrypt = 1;
-			break;
-		case SYS_WEATHER:
-		case SYS_TRACK_STATUS:
-			packet->len = SHORT_PACKET_LEN (pbuf);
-			packet->data = SHORT_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		case SYS_COMMENTARY:
-		case SYS_NOTICE:
-		case SYS_SPEED:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 1;
-			break;
-		case SYS_COPYRIGHT:
-			packet->len = LONG_PACKET_LEN (pbuf);
-			packet->data = LONG_PACKET_DATA (pbuf);
-			decrypt = 0;
-			break;
-		case SYS_VALID_MARKER:
-		case SYS_REFRESH_RATE:
-			packet->len = 0;
-			packet->data = 0;
-			decrypt = 0;
-			break;
-		default:
-			info (3, _("Unknown system packet type: %d\n"),
-			      packet->type);
-			packet->len = 0;
-			packet->data = 0;
-			decrypt = 0;
-			break;
-		}
-	}
+	decrypt = packet_header (pbuf, packet);
 
 	/* Copy as much as we can of the rest of the packet */
 	if (packet->len > 0) {
-		size_t needed;
+		needed = MIN (*buf_len, (packet->len + 2) - parser->pbuf_len);
+		memcpy (pbuf + parser->pbuf_len, *buf, needed);
 
-		needed = MIN (*buf_len, (packet->len + 2) - pbuf_len);
-		memcpy (pbuf + pbuf_len, *buf, needed);
-
-		pbuf_len += needed;
+		parser->pbuf_len += needed;
 		*buf += needed;
 		*buf_len -= needed;
 
-		if (pbuf_len < (packet->len + 2))
+		if (parser->pbuf_len < (packet->len + 2))
 			return 0;
 	}
 
-	/* We have a full packet, reset our static cache length so we
-	 * can re-use it for the next packet (which might happen before
-	 * this one has finished being handled when key frames are being
-	 * fetched).
+	/* We have a full packet, reset our cache length so we can re-use
+	 * it for the next packet, which is also why the payload must be
+	 * copied out.
 	 */
-	pbuf_len = 0;
+	parser->pbuf_len = 0;
+	set_payload (parser, packet, pbuf + 2, decrypt, 1);
 
-	/* Copy the payload and decrypt it */
-	if (packet->len > 0) {
-		memcpy (packet->payload, pbuf + 2, packet->len);
-		packet->payload[packet->len] = 0;
+	return 1;
+}
 
-		if (decrypt)
-			decrypt_bytes (state, packet->payload, packet->len);
+/**
+ * set_payload:
+ * @parser: data stream being parsed,
+ * @packet: packet structure to fill,
+ * @src: raw payload,
+ * @decrypt: whether @src is encrypted,
+ * @copy: whether @src must be copied even if not encrypted.
+ *
+ * Points the @payload of @packet at its contents; encrypted payloads
+ * are decrypted from @src into the packet in one pass, others are used
+ * where they are unless @copy is given.
+ **/
+static void
+set_payload (StreamParser        *parser,
+	     Packet              *packet,
+	     const unsigned char *src,
+	     int                  decrypt,
+	     int                  copy)
+{
+	if (packet->len <= 0) {
+		packet->buf[0] = 0;
+		packet->payload = packet->buf;
+	} else if (decrypt || copy) {
+		if (decrypt) {
+			decrypt_copy (parser, packet->buf, src, packet->len);
+		} else {
+			memcpy (packet->buf, src, packet->len);
+		}
+
+		packet->buf[packet->len] = 0;
+		packet->payload = packet->buf;
 	} else {
-		packet->payload[0] = 0;
+		packet->payload = src;
 	}
+}
 
-	return 1;
+/**
+ * packet_header:
+ * @hdr: two byte packet header,
+ * @packet: packet structure to fill.
+ *
+ * Decodes the packet header in @hdr, filling in the @car, @type, @len
+ * and @data fields of @packet according to packet_rules.  Since the
+ * headers are never encrypted this can be used to walk through a data
+ * stream without the key.
+ *
+ * Returns: 1 if the payload is encrypted, 0 if not.
+ **/
+int
+packet_header (const unsigned char *hdr,
+	       Packet              *packet)
+{
+	const PacketRule *rule;
+
+	packet->car = PACKET_CAR (hdr);
+	packet->type = PACKET_TYPE (hdr);
+
+	rule = &packet_rules[packet->car ? 1 : 0][packet->type];
+	switch (rule->length) {
+	case LENGTH_SHORT:
+		packet->len = SHORT_PACKET_LEN (hdr);
+		break;
+	case LENGTH_LONG:
+		packet->len = LONG_PACKET_LEN (hdr);
+		break;
+	case LENGTH_TIMESTAMP:
+		packet->len = 2;
+		break;
+	default:
+		packet->len = 0;
+		break;
+	}
+
+	switch (rule->data) {
+	case DATA_SHORT:
+		packet->data = SHORT_PACKET_DATA (hdr);
+		break;
+	case DATA_SPECIAL:
+		packet->data = SPECIAL_PACKET_DATA (hdr);
+		break;
+	default:
+		packet->data = 0;
+		break;
+	}
+
+	if (! rule->known)
+		info (3, _("Unknown system packet type: %d\n"),
+		      packet->type);
+
+	return rule->decrypt;
+}
+
+/**
+ * init_stream_parser:
+ * @parser: parser to initialise,
+ * @key: decryption key, or zero if not yet known.
+ *
+ * Readies @parser to decode a data stream from the start.
+ **/
+void
+init_stream_parser (StreamParser *parser,
+		    unsigned int  key)
+{
+	memset (parser, 0, sizeof (StreamParser));
+	parser->key = key;
+}
+
+/**
+ * reset_stream_parser:
+ * @parser: parser to reset,
+ * @key: decryption key, or zero if not yet known.
+ *
+ * Readies @parser, which has been used before, to decode a data stream
+ * from the start; it keeps its buffers and keystreams for next time.
+ **/
+void
+reset_stream_parser (StreamParser *parser,
+		     unsigned int  key)
+{
+	parser->key = key;
+	parser->salt_pos = 0;
+	parser->pbuf_len = 0;
+
+	parser->key_frame = NULL;
+	parser->queue_len = 0;
+}
+
+/**
+ * free_stream_parser:
+ * @parser: parser to free.
+ *
+ * Frees the buffers and keystreams allocated by @parser, which must not
+ * be used again until init_stream_parser() readies it.
+ **/
+void
+free_stream_parser (StreamParser *parser)
+{
+	KeyStream *keystreams = parser->keystreams;
+	int        i;
+
+	if (keystreams)
+		for (i = 0; i < KEYSTREAM_CACHE; i++)
+			free (keystreams[i].bytes);
+
+	free (keystreams);
+	free (parser->queue);
+	free (parser->recv_buf);
+	memset (parser, 0, sizeof (StreamParser));
+}
+
+/**
+ * begin_key_frame_parser:
+ * @key_frame: parser to initialise,
+ * @parser: data stream the key frame arrived in.
+ *
+ * Readies @key_frame to decode a key frame with @parser's key.  It
+ * borrows @parser's keystreams, so the two must be used on the same
+ * thread, and @parser not at all until end_key_frame_parser().
+ **/
+void
+begin_key_frame_parser (StreamParser *key_frame,
+			StreamParser *parser)
+{
+	init_stream_parser (key_frame, parser->key);
+	key_frame->keystreams = parser->keystreams;
+}
+
+/**
+ * end_key_frame_parser:
+ * @key_frame: parser the key frame was decoded with,
+ * @parser: data stream the key frame arrived in.
+ *
+ * Hands @key_frame's key, since a key frame may begin a new event, and
+ * keystreams back to @parser, and resets its decryption ready for the
+ * data following the key frame.  @key_frame's own buffers are freed.
+ **/
+void
+end_key_frame_parser (StreamParser *key_frame,
+		      StreamParser *parser)
+{
+	parser->key = key_frame->key;
+	parser->keystreams = key_frame->keystreams;
+	reset_decryption (parser);
+
+	key_frame->keystreams = NULL;
+	free_stream_parser (key_frame);
 }
 
 /**
  * reset_decryption:
- * @state: application state structure.
+ * @parser: data stream being parsed.
  *
  * Resets the encryption salt to the initial seed; this begins the
  * cycle again.
  **/
 void
-reset_decryption (CurrentState *state)
+reset_decryption (StreamParser *parser)
 {
-	state->salt = CRYPTO_SEED;
+	parser->salt_pos = 0;
 }
 
 /**
  * decrypt_bytes:
- * @state: application state structure,
+ * @parser: data stream being parsed,
  * @buf: buffer to decrypt,
  * @len: number of bytes in @buf to decrypt.
  *
@@ -410,16 +884,139 @@ reset_decryption (CurrentState *state)
  * rather than returning a new string.
  **/
 void
-decrypt_bytes (CurrentState  *state,
+decrypt_bytes (StreamParser  *parser,
 	       unsigned char *buf,
 	       size_t         len)
 {
-	if (! state->key)
+	decrypt_copy (parser, buf, buf, len);
+}
+
+/**
+ * decrypt_copy:
+ * @parser: data stream being parsed,
+ * @dst: buffer to store decrypted bytes in,
+ * @src: buffer to decrypt,
+ * @len: number of bytes in @src to decrypt.
+ *
+ * Decrypts the initial @len bytes of @src into @dst, which may be the
+ * same buffer.  Without a key, the bytes are copied as they are.
+ **/
+static void
+decrypt_copy (StreamParser        *parser,
+	      unsigned char       *dst,
+	      const unsigned char *src,
+	      size_t               len)
+{
+	const unsigned char *key;
+
+	if (! parser->key) {
+		memmove (dst, src, len);
 		return;
+	}
+
+	key = keystream (parser, parser->salt_pos + len);
+	xor_bytes (dst, src, key + parser->salt_pos, len);
+
+	parser->salt_pos += len;
+	count_decrypted (len);
+}
+
+/**
+ * keystream:
+ * @parser: data stream being parsed,
+ * @len: number of bytes needed.
+ *
+ * Looks up @parser's cached keystream for its key, creating it if we
+ * haven't got one and generating more of it if it's shorter than @len.
+ * Each step of the salt provides the next byte.
+ *
+ * Returns: keystream bytes, valid until the next call with @parser.
+ **/
+static const unsigned char *
+keystream (StreamParser *parser,
+	   size_t        len)
+{
+	KeyStream    *keystreams = parser->keystreams;
+	KeyStream     ks;
+	unsigned int  key = parser->key;
+	int           i;
+
+	if (! keystreams) {
+		keystreams = calloc (KEYSTREAM_CACHE, sizeof (KeyStream));
+		if (! keystreams)
+			abort ();
 
-	while (len--) {
-		state->salt = ((state->salt >> 1)
-			       ^ (state->salt & 0x01 ? state->key : 0));
-		*(buf++) ^= (state->salt & 0xff);
+		parser->keystreams = keystreams;
 	}
+
+	for (i = 0; i < KEYSTREAM_CACHE - 1; i++)
+		if (keystreams[i].key == key)
+			break;
+
+	/* Move to the front, dropping the least recently used */
+	ks = keystreams[i];
+	if (ks.key != key) {
+		free (ks.bytes);
+		memset (&ks, 0, sizeof (ks));
+		ks.key = key;
+		ks.salt = CRYPTO_SEED;
+	}
+	memmove (&keystreams[1], &keystreams[0], sizeof (KeyStream) * i);
+
+	if (ks.len < len) {
+		unsigned int salt = ks.salt;
+		size_t       want;
+
+		want = MAX (len, ks.len + KEYSTREAM_CHUNK);
+		if (want > ks.size) {
+			ks.size = MAX (want, ks.size * 2);
+			ks.bytes = realloc (ks.bytes, ks.size);
+			if (! ks.bytes)
+				abort ();
+		}
+
+		while (ks.len < want) {
+			salt = (salt >> 1) ^ (salt & 0x01 ? key : 0);
+			ks.bytes[ks.len++] = salt & 0xff;
+		}
+		ks.salt = salt;
+	}
+
+	keystreams[0] = ks;
+	return ks.bytes;
+}
+
+/**
+ * xor_bytes:
+ * @dst: destination buffer,
+ * @src: source buffer,
+ * @key: keystream bytes,
+ * @len: number of bytes.
+ *
+ * Stores the xor of each byte of @src and @key in @dst, which may be the
+ * same as @src.  This works a word at a time, which the compiler can
+ * widen further into vector instructions.
+ **/
+static void
+xor_bytes (unsigned char       *dst,
+	   const unsigned char *src,
+	   const unsigned char *key,
+	   size_t               len)
+{
+	while (len >= sizeof (unsigned long)) {
+		unsigned long word, mask;
+
+		memcpy (&word, src, sizeof (word));
+		memcpy (&mask, key, sizeof (mask));
+		word ^= mask;
+		memcpy (dst, &word, sizeof (word));
+
+		dst += sizeof (word);
+		src += sizeof (word);
+		key += sizeof (word);
+		len -= sizeof (word);
+	}
+
+	while (len--)
+		*(dst++) = *(src++) ^ *(key++);
 }
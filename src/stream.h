@@ -21,17 +21,54 @@
 #define LIVE_F1_STREAM_H
 
 #include "live-f1.h"
+#include "packet.h"
+
+
+/* Encryption seed */
+#define CRYPTO_SEED 0x55555555
+
+
+/**
+ * StreamBurst:
+ * @arrived: time the first of the data arrived,
+ * @len: number of bytes read,
+ * @reads: number of reads it took.
+ *
+ * What read_stream() drained from the data stream in one go.
+ **/
+typedef struct {
+	struct timespec arrived;
+	size_t          len;
+	unsigned int    reads;
+} StreamBurst;
 
 
 SJR_BEGIN_EXTERN
 
-int  open_stream        (const char *hostname, unsigned int port);
-int  read_stream        (CurrentState *state, int sock);
-int  parse_stream_block (CurrentState *state, const unsigned char *buf,
-			 size_t buf_len);
+int          open_stream        (const char *hostname, unsigned int port);
+int          read_stream        (CurrentState *state, int sock,
+				 StreamBurst *burst);
+int          ping_stream        (int sock);
+void         set_receive_buffer (int size);
+int          parse_stream_block (CurrentState *state,
+				 const unsigned char *buf, size_t buf_len);
+void         resume_stream      (CurrentState *state);
+unsigned int queued_key_frame   (const StreamParser *parser);
+unsigned int first_key_frame    (const unsigned char *buf, size_t len);
+int          next_packet        (StreamParser *parser, Packet *packet,
+				 const unsigned char **buf, size_t *buf_len);
+int          packet_header      (const unsigned char *hdr, Packet *packet);
 
-void reset_decryption   (CurrentState *state);
-void decrypt_bytes      (CurrentState *state, unsigned char *buf, size_t len);
+void         init_stream_parser     (StreamParser *parser, unsigned int key);
+void         reset_stream_parser    (StreamParser *parser, unsigned int key);
+void         free_stream_parser     (StreamParser *parser);
+void         begin_key_frame_parser (StreamParser *key_frame,
+				     StreamParser *parser);
+void         end_key_frame_parser   (StreamParser *key_frame,
+				     StreamParser *parser);
+void         reset_decryption       (StreamParser *parser);
+void         decrypt_bytes          (StreamParser *parser, unsigned char *buf,
+				     size_t len);
 
 SJR_END_EXTERN
 
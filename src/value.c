@@ -0,0 +1,165 @@
+/* live-f1
+ *
+ * value.c - parse the values out of the text in the data stream
+ *
+ * Copyright © 2011 Dave Pusey <dave@puseyuk.co.uk>.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+
+#include <string.h>
+
+#include "live-f1.h"
+#include "value.h"
+
+
+/* Largest value parsed, that still fits in an int */
+#define VALUE_MAX 2000000000LL
+
+
+/**
+ * parse_value:
+ * @text: text to parse,
+ * @len: length of @text,
+ * @value: set to the value parsed.
+ *
+ * Works out what @text holds, and its value, so that it needn't be
+ * parsed again:
+ *
+ * VALUE_NUMBER: a whole number, such as a position or lap count;
+ * VALUE_TIME: a time or gap, such as "1:23.456", "+12.3" or "1:30:00",
+ *             in milliseconds;
+ * VALUE_LAPS: a gap of laps, such as "1 L", in laps;
+ * VALUE_PIT: "PIT", "IN PIT" or "OUT", a car in or leaving the pits;
+ * VALUE_STOPPED: "STOP" or "RETIRED", a car that's stopped;
+ * VALUE_NONE: anything else, such as a driver's name or nothing at all,
+ *             for which @value is zero.
+ *
+ * Returns: type of value in @text.
+ **/
+ValueType
+parse_value (const char *text,
+	     int         len,
+	     int        *value)
+{
+	long long total = 0, number = 0;
+	int       digits = 0, decimals = -1, i = 0;
+
+	*value = 0;
+
+	while ((len > 0) && (text[len - 1] == ' '))
+		len--;
+	while ((i < len) && (text[i] == ' '))
+		i++;
+
+	if (i >= len)
+		return VALUE_NONE;
+
+	if ((text[i] < '0') || (text[i] > '9')) {
+		const char *word = text + i;
+		size_t      word_len = len - i;
+
+#define IS(_word) ((word_len == sizeof (_word) - 1) \
+		   && (! memcmp (word, _word, word_len)))
+
+		if (IS ("PIT") || IS ("IN PIT") || IS ("OUT")) {
+			return VALUE_PIT;
+		} else if (IS ("STOP") || IS ("RETIRED")) {
+			return VALUE_STOPPED;
+		} else if (text[i] != '+') {
+			return VALUE_NONE;
+		}
+
+#undef IS
+
+		i++;
+	}
+
+	for (; i < len; i++) {
+		if ((text[i] >= '0') && (text[i] <= '9')) {
+			if (decimals < 3) {
+				number = number * 10 + (text[i] - '0');
+				decimals += (decimals >= 0);
+			}
+			digits++;
+		} else if ((text[i] == ':') && digits && (decimals < 0)) {
+			total = (total + number) * 60;
+			number = 0;
+			digits = 0;
+		} else if ((text[i] == '.') && digits && (decimals < 0)) {
+			decimals = 0;
+			digits = 0;
+		} else if ((text[i] == 'L') && digits && (decimals < 0)
+			   && (! total) && (i == len - 1)) {
+			*value = number;
+			return VALUE_LAPS;
+		} else if ((text[i] != ' ') || (! digits) || (decimals >= 0)
+			   || total || (i + 2 != len) || (text[i + 1] != 'L')) {
+			return VALUE_NONE;
+		}
+
+		if ((total > VALUE_MAX) || (number > VALUE_MAX))
+			return VALUE_NONE;
+	}
+
+	if (! digits)
+		return VALUE_NONE;
+
+	if ((decimals < 0) && (! total)) {
+		*value = number;
+		return VALUE_NUMBER;
+	}
+
+	for (decimals = MAX (decimals, 0); decimals < 3; decimals++)
+		number *= 10;
+
+	total = (total * 1000) + number;
+	if (total > VALUE_MAX)
+		return VALUE_NONE;
+
+	*value = total;
+	return VALUE_TIME;
+}
+
+/**
+ * parse_number:
+ * @text: text to parse,
+ * @len: length of @text.
+ *
+ * Parses a whole number from @text, such as a temperature or the laps
+ * in a race, ignoring any fraction.
+ *
+ * Returns: number in @text, or zero if there isn't one.
+ **/
+int
+parse_number (const char *text,
+	      int         len)
+{
+	int value;
+
+	switch (parse_value (text, len, &value)) {
+	case VALUE_NUMBER:
+		return value;
+	case VALUE_TIME:
+		return value / 1000;
+	default:
+		return 0;
+	}
+}